@@ -0,0 +1,146 @@
+/*
+** bench_broadcast.c -- cost of walking a room for a broadcast
+**
+** Compares the old layout (one malloc'd struct Client per member, linked in a
+** ring) against the connection table's hot arrays. Nothing is sent; each pass
+** just visits every member the way relay() does and reads its fd.
+**
+** build: gcc -O2 -o bench_broadcast bench_broadcast.c conn_table.c -pthread
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "conn_table.h"
+
+#define ROOM		3
+#define TARGET_NS	200000000L // Run each case for about this long
+
+
+// Same layout (and size) as the linked list node ChatServer.c used before the table
+struct Client {
+	int sockfd;
+	int pipefd[2];
+	pthread_t thread_id;
+	struct Client *next;
+	pthread_mutex_t send_lock;
+	int zerocopy;
+	uint32_t zc_seq;
+	void *zc_pending;
+	char ip[INET6_ADDRSTRLEN];
+	char name[USERNAME_LEN];
+};
+
+
+long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+// Builds a ring of n clients. Clients join and leave in no particular order, so link order is shuffled.
+struct Client *build_ring(int n) {
+	struct Client **nodes = malloc(n * sizeof(struct Client*));
+	for (int i = 0; i < n; i++) {
+		nodes[i] = calloc(1, sizeof(struct Client));
+		nodes[i]->sockfd = i + 4;
+	}
+	for (int i = n - 1; i > 0; i--) {
+		int j = rand() % (i + 1);
+		struct Client *tmp = nodes[i]; nodes[i] = nodes[j]; nodes[j] = tmp;
+	}
+	for (int i = 0; i < n; i++) nodes[i]->next = nodes[(i + 1) % n];
+
+	struct Client *first = nodes[0];
+	free(nodes);
+	return first;
+}
+
+
+void free_ring(struct Client *first) {
+	struct Client *curr = first->next;
+	while (curr != first) {
+		struct Client *next = curr->next;
+		free(curr);
+		curr = next;
+	}
+	free(first);
+}
+
+
+// One relay() pass over the ring
+long walk_ring(struct Client *sender) {
+	long sum = 0;
+	struct Client *curr = sender;
+	do {
+		curr = curr->next;
+		sum += curr->sockfd;
+	} while (curr->next != sender);
+	return sum;
+}
+
+
+// One relay() pass over the table
+long walk_table(struct ConnTable *table, int sender) {
+	long sum = 0;
+	int room = table->room[sender];
+	for (int i = 0; i < table->high_water; i++) {
+		if (i == sender || !(table->flags[i] & CONN_USED) || table->room[i] != room) continue;
+		sum += table->fd[i];
+	}
+	return sum;
+}
+
+
+void bench(int n) {
+	volatile long sink = 0;
+	long start, elapsed;
+	int passes;
+
+	struct Client *ring = build_ring(n);
+	passes = 0;
+	start = now_ns();
+	do {
+		sink += walk_ring(ring);
+		passes++;
+	} while ((elapsed = now_ns() - start) < TARGET_NS);
+	double ring_ns = (double)elapsed / passes / (n - 1);
+	free_ring(ring);
+
+	struct ConnTable table;
+	if (ct_init(&table, n) == -1) {
+		fprintf(stderr, "bench: out of memory for %d clients\n", n);
+		exit(1);
+	}
+	for (int i = 0; i < n; i++) ct_add(&table, i + 4, ROOM);
+	passes = 0;
+	start = now_ns();
+	do {
+		sink += walk_table(&table, 0);
+		passes++;
+	} while ((elapsed = now_ns() - start) < TARGET_NS);
+	double table_ns = (double)elapsed / passes / (n - 1);
+	ct_destroy(&table);
+
+	printf("%8d members | linked list %6.2f ns/member | table %6.2f ns/member | %5.1fx\n",
+		n, ring_ns, table_ns, ring_ns / table_ns);
+	(void)sink;
+}
+
+
+int main(void)
+{
+	srand(528);
+
+	printf("broadcast iteration cost (struct Client is %zu bytes)\n", sizeof(struct Client));
+	bench(1000);
+	bench(10000);
+	bench(100000);
+
+	return 0;
+}
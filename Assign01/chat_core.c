@@ -0,0 +1,631 @@
+/*
+** chat_core.c -- client handling for the chat server
+**
+** Everything after accept(): the connection table, username handshake,
+** per-client threads and message relay. ChatServer.c feeds it accepted
+** sockets; chat_harness.c feeds it socketpair()s.
+*/
+
+#define _GNU_SOURCE // splice()
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+
+#include <pthread.h>
+
+#include "chat_core.h"
+#include "probes.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY		60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY	0x4000000
+#endif
+
+#define LOG(...) do { if (chat_verbose) printf(__VA_ARGS__); } while (0)
+
+#define ZC_REAP_MS		50   // How often completions are collected for clients nobody is sending to
+#define ZC_DRAIN_MS		200  // How long a disconnect waits for its sends to complete
+#define ZC_ORPHAN_MS	10000 // How long a closed client's unfinished sends are waited for after that
+
+
+
+// Reference counted message buffer. Each zerocopy send holds a reference until the kernel is done with the pages.
+struct Payload {
+	int refs;
+	int len;
+	char data[]; // USERNAME_LEN name header, then the message
+};
+
+// A zerocopy send waiting for its completion notification
+struct ZcPending {
+	uint32_t seq;
+	struct Payload *payload;
+	struct ZcPending *next;
+};
+
+// A disconnected client's socket, kept open until the kernel is done with its zerocopy sends
+struct ZcOrphan {
+	int fd;
+	struct ZcPending *pending;
+	int64_t since_ns;
+	struct ZcOrphan *next;
+};
+
+static struct ZcOrphan *zc_orphans;
+static pthread_mutex_t zc_orphans_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Every connected client, indexed by slot
+struct ConnTable CLIENTS;
+
+// When set (-s), two-party rooms are relayed socket-to-socket with splice()
+int splice_relay = 0;
+
+// Payloads of at least this many bytes (-z) are broadcast with MSG_ZEROCOPY; 0 disables it
+int zerocopy_threshold = 0;
+
+// Largest message accepted from a client (-m)
+int max_message_len = MESSAGE_LEN;
+
+int chat_verbose = 1;
+
+// Totals for chat_stats(); updated with atomics from every client thread
+static struct ChatStats stats;
+
+
+int64_t chat_monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void chat_stats(struct ChatStats *out) {
+	out->messages = __atomic_load_n(&stats.messages, __ATOMIC_RELAXED);
+	out->bytes = __atomic_load_n(&stats.bytes, __ATOMIC_RELAXED);
+	out->deliveries = __atomic_load_n(&stats.deliveries, __ATOMIC_RELAXED);
+	out->fanout_ns_total = __atomic_load_n(&stats.fanout_ns_total, __ATOMIC_RELAXED);
+	out->fanout_ns_max = __atomic_load_n(&stats.fanout_ns_max, __ATOMIC_RELAXED);
+}
+
+
+// Records one relayed message and how long its fan-out took
+static void record_fanout(int bytes, int deliveries, int64_t fanout_ns) {
+	__atomic_add_fetch(&stats.messages, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.deliveries, deliveries, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.fanout_ns_total, fanout_ns, __ATOMIC_RELAXED);
+
+	int64_t max = __atomic_load_n(&stats.fanout_ns_max, __ATOMIC_RELAXED);
+	while (fanout_ns > max && !__atomic_compare_exchange_n(&stats.fanout_ns_max, &max, fanout_ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+// Allocates a payload with room for capacity bytes; the caller holds the only reference
+struct Payload *payload_new(int capacity) {
+	struct Payload *payload = malloc(sizeof(struct Payload) + capacity);
+	if (payload) {
+		payload->refs = 1;
+		payload->len = 0;
+	}
+	return payload;
+}
+
+
+void payload_release(struct Payload *payload) {
+	if (__atomic_sub_fetch(&payload->refs, 1, __ATOMIC_ACQ_REL) == 0) free(payload);
+}
+
+
+// Reads zerocopy completions off fd's error queue and releases the finished payloads in list
+static void zc_reap_list(int fd, struct ZcPending **list) {
+	char control[128];
+	struct msghdr msg;
+
+	while (*list) {
+		memset(&msg, 0, sizeof msg);
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof control;
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) break; // Nothing (more) completed
+
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+		if (!cm) continue;
+		struct sock_extended_err *serr = (struct sock_extended_err*)CMSG_DATA(cm);
+		if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+		// Completions cover the inclusive sequence range [ee_info, ee_data]
+		uint32_t lo = serr->ee_info, hi = serr->ee_data;
+		struct ZcPending **link = list;
+		while (*link) {
+			struct ZcPending *pending = *link;
+			if (pending->seq - lo <= hi - lo) {
+				*link = pending->next;
+				payload_release(pending->payload);
+				free(pending);
+			}
+			else link = &pending->next;
+		}
+	}
+}
+
+
+// The same for a connected client. Caller must hold the client's send_lock
+void zc_reap(int slot) {
+	zc_reap_list(CLIENTS.fd[slot], &CLIENTS.zc_pending[slot]);
+}
+
+
+static void zc_release_all(struct ZcPending *pending) {
+	while (pending) {
+		struct ZcPending *next = pending->next;
+		payload_release(pending->payload);
+		free(pending);
+		pending = next;
+	}
+}
+
+
+// Collects completions for clients that aren't being sent to (which would otherwise hold their
+// payloads until the next large message) and finishes off orphaned sockets
+static void* zc_reaper(void* args) {
+	(void)args;
+	for (;;) {
+		usleep(ZC_REAP_MS * 1000);
+
+		pthread_rwlock_rdlock(&CLIENTS.lock);
+		for (int i = 0; i < CLIENTS.high_water; i++) {
+			if (!(CLIENTS.flags[i] & CONN_USED) || !CLIENTS.zc_pending[i]) continue;
+			if (pthread_mutex_trylock(&CLIENTS.meta[i].send_lock) != 0) continue; // a sender is reaping it anyway
+			zc_reap(i);
+			pthread_mutex_unlock(&CLIENTS.meta[i].send_lock);
+		}
+		pthread_rwlock_unlock(&CLIENTS.lock);
+
+		int64_t now = chat_monotonic_ns();
+		pthread_mutex_lock(&zc_orphans_lock);
+		struct ZcOrphan **link = &zc_orphans;
+		while (*link) {
+			struct ZcOrphan *orphan = *link;
+			zc_reap_list(orphan->fd, &orphan->pending);
+			if (orphan->pending && now - orphan->since_ns < (int64_t)ZC_ORPHAN_MS * 1000000) {
+				link = &orphan->next;
+				continue;
+			}
+			if (orphan->pending) {
+				// Never acknowledged: reset the connection so the kernel drops the unsent data, then let go
+				struct linger abort_close = { 1, 0 };
+				setsockopt(orphan->fd, SOL_SOCKET, SO_LINGER, &abort_close, sizeof abort_close);
+			}
+			close(orphan->fd);
+			zc_release_all(orphan->pending);
+			*link = orphan->next;
+			free(orphan);
+		}
+		pthread_mutex_unlock(&zc_orphans_lock);
+	}
+	return NULL;
+}
+
+
+// Sends the payload without copying it; the client's pending list keeps a reference until completion
+void zc_send(int slot, struct Payload *payload) {
+	struct ClientMeta *meta = &CLIENTS.meta[slot];
+
+	pthread_mutex_lock(&meta->send_lock);
+	zc_reap(slot);
+
+	struct ZcPending *pending = malloc(sizeof(struct ZcPending));
+	if (pending && send(CLIENTS.fd[slot], payload->data, payload->len, MSG_ZEROCOPY) != -1) {
+		__atomic_add_fetch(&payload->refs, 1, __ATOMIC_ACQ_REL);
+		pending->seq = meta->zc_seq++;
+		pending->payload = payload;
+		pending->next = CLIENTS.zc_pending[slot];
+		CLIENTS.zc_pending[slot] = pending;
+	}
+	else {
+		free(pending);
+		// Out of optmem (ENOBUFS) or similar; fall back to a normal copy
+		if (send(CLIENTS.fd[slot], payload->data, payload->len, 0) == -1)
+			perror("Failed to relay message to client");
+	}
+
+	pthread_mutex_unlock(&meta->send_lock);
+}
+
+
+// Drops a reference to a client's slot. The last one closes the socket (unless the kernel still has
+// our pages, in which case the reaper does) and frees the slot.
+static void release_slot(int slot) {
+	if (!ct_release(&CLIENTS, slot)) return;
+
+	// Nobody else can send to the slot now
+	int sockfd = CLIENTS.fd[slot];
+	struct ZcPending *unfinished = CLIENTS.zc_pending[slot];
+	CLIENTS.zc_pending[slot] = NULL;
+
+	if (unfinished) {
+		struct ZcOrphan *orphan = malloc(sizeof(struct ZcOrphan));
+		if (orphan) {
+			orphan->fd = sockfd;
+			orphan->pending = unfinished;
+			orphan->since_ns = chat_monotonic_ns();
+			pthread_mutex_lock(&zc_orphans_lock);
+			orphan->next = zc_orphans;
+			zc_orphans = orphan;
+			pthread_mutex_unlock(&zc_orphans_lock);
+		}
+		else {
+			// Nowhere to keep them: reset so the kernel drops the sends before the payloads go
+			struct linger abort_close = { 1, 0 };
+			setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &abort_close, sizeof abort_close);
+			close(sockfd);
+			zc_release_all(unfinished);
+		}
+	}
+	else close(sockfd);
+
+	ct_free(&CLIENTS, slot);
+}
+
+
+// Holds every member of room except one, listing them in members (room_size entries).
+// Caller holds the table lock for reading. Returns how many were held
+static int hold_room(int room, int except, int *members) {
+	int count = 0;
+	for (int i = 0; i < CLIENTS.high_water; i++) {
+		if (i == except || !(CLIENTS.flags[i] & CONN_USED) || CLIENTS.room[i] != room) continue;
+		ct_hold(&CLIENTS, i);
+		members[count++] = i;
+	}
+	return count;
+}
+
+
+// Prints the connected clients to the server terminal
+void query_clients() {
+	if (!chat_verbose) return;
+
+	pthread_rwlock_rdlock(&CLIENTS.lock);
+	if (CLIENTS.high_water == 0) printf("NO CLIENTS CONNECTED\n\n");
+	else {
+		printf("CONNECTED CLIENTS:\n");
+		for (int i = 0; i < CLIENTS.high_water; i++) {
+			if (!(CLIENTS.flags[i] & CONN_USED)) continue;
+			printf("\tName: %s | IP: %s\n", CLIENTS.meta[i].name, CLIENTS.meta[i].ip);
+		}
+		printf("END OF CLIENT LIST\n\n");
+	}
+	pthread_rwlock_unlock(&CLIENTS.lock);
+};
+
+
+// Relays a message to all other clients in the sender's room. The recipients are held while the
+// table is locked and sent to after, so a client that stops reading holds up nobody's join or leave.
+void relay(int sender, struct Payload *payload) {
+	pthread_rwlock_rdlock(&CLIENTS.lock);
+	int room = CLIENTS.room[sender];
+
+	if (CLIENTS.room_size[room] == 1) {
+		pthread_rwlock_unlock(&CLIENTS.lock);
+		if (send(CLIENTS.fd[sender], "SERVER\0You are alone, child.", 29, 0) == -1) {
+			perror("Failed to notify client of their lonliness");
+		}
+		return;
+	}
+
+	int *members = malloc(CLIENTS.room_size[room] * sizeof(int));
+	if (!members) {
+		pthread_rwlock_unlock(&CLIENTS.lock);
+		perror("Failed to allocate recipient list");
+		return;
+	}
+	int count = hold_room(room, sender, members);
+	pthread_rwlock_unlock(&CLIENTS.lock);
+
+	// Large payloads go out zerocopy; for small ones the page pinning and completion costs more than the copy
+	int use_zerocopy = zerocopy_threshold > 0 && payload->len >= zerocopy_threshold;
+
+	int64_t fanout_start = chat_monotonic_ns();
+	int deliveries = 0;
+	CHAT_PROBE3(fanout_start, sender, payload->len, count + 1);
+
+	// Only the hot arrays are touched here
+	for (int m = 0; m < count; m++) {
+		int i = members[m];
+
+		// Relay message to current client
+		deliveries++;
+		if (use_zerocopy && (CLIENTS.flags[i] & CONN_ZEROCOPY)) zc_send(i, payload);
+		else {
+			if (send(CLIENTS.fd[i], payload->data, payload->len, 0) == -1)
+				perror("Failed to relay message to client");
+
+			// Free up anything the kernel finished with since the last large message
+			if (CLIENTS.zc_pending[i]) {
+				pthread_mutex_lock(&CLIENTS.meta[i].send_lock);
+				zc_reap(i);
+				pthread_mutex_unlock(&CLIENTS.meta[i].send_lock);
+			}
+		}
+		release_slot(i);
+	}
+	free(members);
+
+	CHAT_PROBE2(fanout_end, sender, deliveries);
+	record_fanout(payload->len, deliveries, chat_monotonic_ns() - fanout_start);
+};
+
+
+// Moves the next message (up to max_message_len bytes) from the client's socket into its relay pipe.
+// Returns the number of bytes now in the pipe, or the recv()-style 0/-1 on close/error
+int splice_recv(int slot) {
+	struct ClientMeta *meta = &CLIENTS.meta[slot];
+
+	if (meta->pipefd[0] == -1 && pipe(meta->pipefd) == -1) {
+		perror("Failed to create relay pipe");
+		return -1;
+	}
+	return splice(CLIENTS.fd[slot], NULL, meta->pipefd[1], NULL, max_message_len, SPLICE_F_MOVE);
+}
+
+
+// Sends the frame header, then moves the piped message body straight to the peer's socket.
+// Whatever could not be delivered is drained so the next message starts clean.
+void splice_send(int sender, int peer, char *header, int bytes_piped) {
+	int pipe_out = CLIENTS.meta[sender].pipefd[0];
+	int bytes_left = bytes_piped;
+
+	if (send(CLIENTS.fd[peer], header, USERNAME_LEN, MSG_MORE) == -1) {
+		perror("Failed to relay message header to client");
+	}
+	else {
+		while (bytes_left > 0) {
+			ssize_t moved = splice(pipe_out, NULL, CLIENTS.fd[peer], NULL, bytes_left, SPLICE_F_MOVE);
+			if (moved < 1) {
+				perror("Failed to splice message to client");
+				break;
+			}
+			bytes_left -= moved;
+		}
+	}
+
+	// Drop anything left in the pipe
+	char discard[4096];
+	while (bytes_left > 0) {
+		ssize_t drained = read(pipe_out, discard, bytes_left < (int)sizeof discard ? bytes_left : (int)sizeof discard);
+		if (drained < 1) break;
+		bytes_left -= drained;
+	}
+};
+
+
+// Disconnect client and handle cleanup
+void disconnect_client(int slot) {
+	struct ClientMeta *meta = &CLIENTS.meta[slot];
+	int sockfd = CLIENTS.fd[slot];
+	int room = CLIENTS.room[slot];
+
+	// Zerocopy sends still in flight own their payloads until the kernel says it's done with them.
+	// Give them a moment; whatever is left keeps the socket open, and the reaper finishes it.
+	pthread_mutex_lock(&meta->send_lock);
+	int64_t drain_until = chat_monotonic_ns() + (int64_t)ZC_DRAIN_MS * 1000000;
+	for (zc_reap(slot); CLIENTS.zc_pending[slot]; zc_reap(slot)) {
+		int64_t left_ms = (drain_until - chat_monotonic_ns()) / 1000000;
+		if (left_ms <= 0) break;
+		struct pollfd errors = { sockfd, 0, 0 }; // error queue readiness shows up as POLLERR
+		poll(&errors, 1, (int)left_ms);
+	}
+	pthread_mutex_unlock(&meta->send_lock);
+
+	// Get disconnect message
+	char discon_message[USERNAME_LEN+20];
+	sprintf(discon_message, "(%s) has disconnected", meta->name);
+
+	// Close relay pipe
+	if (meta->pipefd[0] != -1) {
+		close(meta->pipefd[0]);
+		close(meta->pipefd[1]);
+	}
+
+	// Tell the others before leaving the room: once we're out, whoever joins next could hear about
+	// someone they never met
+	pthread_rwlock_rdlock(&CLIENTS.lock);
+	int *members = malloc(CLIENTS.room_size[room] * sizeof(int));
+	int count = members ? hold_room(room, slot, members) : 0;
+	pthread_rwlock_unlock(&CLIENTS.lock);
+	if (!members) perror("Failed to allocate recipient list");
+
+	for (int m = 0; m < count; m++) {
+		// Notify current client of disconnect
+		if (send(CLIENTS.fd[members[m]], discon_message, USERNAME_LEN+20, 0) == -1 && chat_verbose)
+			perror("Failed to notify of disconnect");
+		release_slot(members[m]);
+	}
+	free(members);
+
+	// Take the client out of the table; the socket closes once no broadcast is still sending to it
+	ct_remove(&CLIENTS, slot);
+	release_slot(slot);
+
+	query_clients();
+};
+
+
+// Wait to receive a message, then relay to the other clients
+void* client_loop(void* args) {
+	// Get this client's slot in the table
+	int slot = (int)(intptr_t)args;
+	struct ClientMeta *meta = &CLIENTS.meta[slot];
+	int sockfd = CLIENTS.fd[slot];
+	memset(meta->name, 0, USERNAME_LEN);
+	
+	
+	// Prompt for client username
+	if (send(sockfd, "SERVER\0Enter your username (up to 6 characters)", 48, 0) == -1) {
+		perror("Failed request username from client");
+		disconnect_client(slot);
+		return NULL;
+	}
+	// Get client username
+	int bytes_recvd = recv(sockfd, meta->name, 6, 0);
+	if (bytes_recvd < 1) {
+		strncpy(meta->name, "ERROR\0", USERNAME_LEN);
+	}
+	else meta->name[bytes_recvd] = '\0'; // Add termination character
+	CHAT_PROBE2(handshake, slot, meta->name);
+	bytes_recvd = -1; // Reset value
+
+
+	// Initialize message buffer
+	struct Payload *payload = payload_new(USERNAME_LEN + max_message_len + 1);
+	if (!payload) {
+		perror("Failed to allocate message buffer");
+		disconnect_client(slot);
+		return NULL;
+	}
+	char *total_buffer = payload->data;
+	char *msg_buffer = total_buffer + USERNAME_LEN;
+	memset(total_buffer, 0, USERNAME_LEN);
+	strncpy(total_buffer, meta->name, USERNAME_LEN);
+
+	// Main loop (recv -> broadcast -> repeat)
+	do {
+		if (splice_relay && ct_peer(&CLIENTS, slot) != -1) {
+			// Two-party room: message bytes never leave the kernel
+			bytes_recvd = splice_recv(slot);
+			if (bytes_recvd < 1) {
+				if (chat_verbose) perror("Failed to recieve message from client");
+				break;
+			}
+
+			// Still only one peer? Forward the piped bytes directly
+			CHAT_PROBE2(frame_received, slot, bytes_recvd);
+			pthread_rwlock_rdlock(&CLIENTS.lock);
+			int peer = ct_peer(&CLIENTS, slot);
+			if (peer != -1) ct_hold(&CLIENTS, peer); // the peer's slot can't be reused until we're done
+			pthread_rwlock_unlock(&CLIENTS.lock);
+			if (peer != -1) {
+				LOG("(%s): <%d bytes spliced>\n", total_buffer, bytes_recvd);
+				CHAT_PROBE3(fanout_start, slot, bytes_recvd + USERNAME_LEN, 2);
+				splice_send(slot, peer, total_buffer, bytes_recvd);
+				CHAT_PROBE2(fanout_end, slot, 1);
+				release_slot(peer);
+				continue;
+			}
+
+			// Someone joined or left while we waited; pull the message up and broadcast normally
+			bytes_recvd = read(meta->pipefd[0], msg_buffer, bytes_recvd);
+			if (bytes_recvd < 1) {
+				perror("Failed to read message from relay pipe");
+				break;
+			}
+		}
+		else {
+			// Recieve a message from this client
+			bytes_recvd = recv(sockfd, msg_buffer, max_message_len, 0);
+			if (bytes_recvd < 1) {
+				if (chat_verbose) perror("Failed to recieve message from client");
+				break;
+			}
+			CHAT_PROBE2(frame_received, slot, bytes_recvd);
+		}
+		// Add termination character		
+		msg_buffer[bytes_recvd] = '\0';
+		
+		LOG("(%s): \"%s\"\n", total_buffer, msg_buffer);
+		
+		// Relay message to other clients
+		payload->len = bytes_recvd + USERNAME_LEN;
+		relay(slot, payload);
+
+		// Zerocopy sends still own this buffer, so the next message goes in a fresh one
+		if (__atomic_load_n(&payload->refs, __ATOMIC_ACQUIRE) > 1) {
+			struct Payload *fresh = payload_new(USERNAME_LEN + max_message_len + 1);
+			if (!fresh) {
+				perror("Failed to allocate message buffer");
+				break;
+			}
+			memcpy(fresh->data, total_buffer, USERNAME_LEN);
+			payload_release(payload);
+			payload = fresh;
+			total_buffer = payload->data;
+			msg_buffer = total_buffer + USERNAME_LEN;
+		}
+		
+	} while (1);
+	
+	payload_release(payload);
+	disconnect_client(slot);
+	return NULL;
+};
+
+// Connects a new client to the chatroom
+void connect_client(int slot) {
+	if (CLIENTS.room_size[CLIENTS.room[slot]] == 1) {
+		LOG("FIRST CLIENT CONNECTING\n");
+	}
+	
+	// Create thread for client, pass in client_loop() as the func, and the client's slot as the parameter
+	int tresult = pthread_create(&CLIENTS.meta[slot].thread_id, NULL, client_loop, (void*)(intptr_t)slot);
+	
+	// If thread creation failed
+	if (tresult != 0) {
+		perror("Error: Could not create thread for client");
+		ct_remove(&CLIENTS, slot);
+		release_slot(slot);
+		return;
+	}
+
+	pthread_detach(CLIENTS.meta[slot].thread_id); // Nobody joins client threads; let them clean up on exit
+	
+	query_clients();
+};
+
+
+int chat_core_init(int max_clients) {
+	if (ct_init(&CLIENTS, max_clients) == -1) return -1;
+
+	pthread_t reaper;
+	if (zerocopy_threshold > 0) {
+		if (pthread_create(&reaper, NULL, zc_reaper, NULL) != 0) {
+			perror("Error: Could not start zerocopy reaper");
+			return -1;
+		}
+		pthread_detach(reaper);
+	}
+	return 0;
+};
+
+
+int chat_core_add(int fd, const char *ip) {
+	int yes = 1;
+
+	// Claim a slot in the connection table
+	int slot = ct_add(&CLIENTS, fd, LOBBY);
+	if (slot == -1) return -1;
+
+	strncpy(CLIENTS.meta[slot].ip, ip, INET6_ADDRSTRLEN - 1);
+	CHAT_PROBE2(accept, slot, fd);
+
+	if (zerocopy_threshold > 0) {
+		if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(int)) == -1)
+			perror("setsockopt SO_ZEROCOPY");
+		else
+			CLIENTS.flags[slot] |= CONN_ZEROCOPY;
+	}
+
+	connect_client(slot);
+	return slot;
+};
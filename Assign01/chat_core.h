@@ -0,0 +1,47 @@
+/*
+** chat_core.h -- client handling for the chat server
+*/
+
+#ifndef CHAT_CORE_H
+#define CHAT_CORE_H
+
+#include <stdint.h>
+
+#include "conn_table.h"
+
+#define MESSAGE_LEN		1024
+#define MAX_CLIENTS		1024 // default connection table size (-c)
+
+// Every client joins this room for now
+#define LOBBY 0
+
+// Running totals since startup
+struct ChatStats {
+	uint64_t messages; // Messages relayed
+	uint64_t bytes; // Bytes per message, header included (not multiplied by recipients)
+	uint64_t deliveries; // Sends to recipients
+	int64_t fanout_ns_total; // Time spent in relay()
+	int64_t fanout_ns_max;
+};
+
+extern struct ConnTable CLIENTS;
+
+// Server options, set before chat_core_init()
+extern int splice_relay;
+extern int zerocopy_threshold;
+extern int max_message_len;
+extern int chat_verbose; // Per-message and per-connection console output
+
+// CLOCK_MONOTONIC in nanoseconds, for the server's own timings
+int64_t chat_monotonic_ns(void);
+
+void chat_stats(struct ChatStats *out);
+
+// Allocates the connection table. Returns 0 on success, -1 if out of memory
+int chat_core_init(int max_clients);
+
+// Hands a connected socket to the server: claims a slot and starts the client's thread.
+// Returns the slot, or -1 if the table is full (the caller still owns fd then)
+int chat_core_add(int fd, const char *ip);
+
+#endif
@@ -0,0 +1,369 @@
+/*
+** chat_harness.c -- in-process performance regression tests for the chat server
+**
+** Drives chat_core directly with no network: every client is one end of a
+** socketpair() whose other end is handed to chat_core_add(). Bot messages all
+** have the pattern's fixed size, which divides MESSAGE_LEN, so even when the
+** server reads several in one recv() the harness can split them back apart
+** and count and time every one on the way out.
+**
+** Each traffic pattern (join storm, chatty bots, slow readers) is a timeline of
+** sends, built from a fixed seed. The timeline only orders the sends: they go
+** out back to back instead of at their scheduled times, so a pattern spanning
+** minutes replays in well under a second, in the same order every run.
+** Throughput and delivery latency are measured in real time and checked
+** against the pattern's budgets; any miss fails the run.
+**
+** build: gcc -O2 -o chat_harness chat_harness.c chat_core.c conn_table.c -pthread
+** usage: chat_harness [-v] [pattern ...]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "chat_core.h"
+
+#define HARNESS_MAGIC	0x43484154 // "CHAT"
+#define ROLL_CALL		0xFFFFFFFF // talker id of the join storm's first broadcast
+#define SETTLE_NS		10000000000L // Give up waiting for deliveries after 10s
+#define PENDING_LEN		65536
+
+
+struct Pattern {
+	const char *name;
+	int clients;
+	int talkers; // The first talkers clients send
+	int messages; // Per talker
+	int interval_us; // Timeline spacing of a talker's messages
+	int slow_readers; // The last slow_readers clients are only drained every slow_drain_us (real time)
+	int slow_drain_us;
+	int msg_bytes;
+
+	// Budgets
+	double max_join_ms; // Every client joined and heard the first broadcast
+	double min_deliveries_per_sec;
+	double max_p50_ms; // Delivery latency to the fast readers
+	double max_p99_ms;
+};
+
+struct Pattern PATTERNS[] = {
+	//  name            clients talkers msgs  interval  slow drain  bytes   join   deliv/s  p50   p99
+	{ "join_storm",     500,    1,      20,   1000,     0,   0,     64,     1000,  50000,   25,   100 },
+	{ "chatty_bots",    40,     10,     300,  2000,     0,   0,     128,    250,   50000,   10,   100 },
+	{ "slow_readers",   24,     6,      300,  5000,     4,   20000, 256,    250,   50000,   50,   250 },
+};
+
+// What each harness message carries after the server's name header
+struct Body {
+	uint32_t magic;
+	uint32_t talker;
+	uint32_t seq;
+	int64_t sent_ns; // Real time, for latency
+};
+
+struct Bot {
+	int fd; // Harness end of the socketpair
+	int slow;
+	int64_t last_drain_ns;
+	int slot; // The server's end
+	char *pending; // Bytes received but not parsed yet
+	int pending_len;
+};
+
+// Size of every bot message in the current pattern
+static int body_bytes;
+
+// Fast-reader delivery latencies for the current pattern
+static int64_t *latencies;
+static long latency_count, latency_capacity;
+
+int cmp_int64(const void *a, const void *b) {
+	int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+	return (x > y) - (x < y);
+}
+
+
+double percentile_ms(double p) {
+	if (latency_count == 0) return 0;
+	long i = (long)(p * (latency_count - 1));
+	return latencies[i] / 1e6;
+}
+
+
+// Reads everything waiting on a bot's socket. Returns the number of harness messages received
+long drain(struct Bot *bot) {
+	long count = 0;
+
+	for (;;) {
+		ssize_t n = recv(bot->fd, bot->pending + bot->pending_len, PENDING_LEN - bot->pending_len, MSG_DONTWAIT);
+		if (n < 1) break;
+		bot->pending_len += n;
+
+		// The stream is name headers, each followed by one or more bodies
+		int pos = 0;
+		int64_t now = chat_monotonic_ns();
+		for (;;) {
+			struct Body body;
+			int left = bot->pending_len - pos;
+			if (left >= (int)sizeof(uint32_t) && memcmp(bot->pending + pos, &(uint32_t){HARNESS_MAGIC}, sizeof(uint32_t)) == 0) {
+				if (left < body_bytes) break;
+				memcpy(&body, bot->pending + pos, sizeof body);
+				if (!bot->slow && body.talker != ROLL_CALL && latency_count < latency_capacity)
+					latencies[latency_count++] = now - body.sent_ns;
+				count++;
+				pos += body_bytes;
+			}
+			else if (left >= USERNAME_LEN) pos += USERNAME_LEN;
+			else break;
+		}
+		memmove(bot->pending, bot->pending + pos, bot->pending_len - pos);
+		bot->pending_len -= pos;
+	}
+
+	bot->last_drain_ns = chat_monotonic_ns();
+	return count;
+}
+
+
+// Drains every fast reader, and any slow reader whose turn has come
+long drain_all(struct Bot *bots, int n, int slow_drain_us) {
+	long count = 0;
+	int64_t now = chat_monotonic_ns();
+
+	for (int i = 0; i < n; i++) {
+		if (bots[i].slow && now - bots[i].last_drain_ns < slow_drain_us * 1000L) continue;
+		count += drain(&bots[i]);
+	}
+	return count;
+}
+
+
+// Sends one message from a bot, draining readers while the server pushes back.
+// Returns the number of messages drained meanwhile
+long bot_send(struct Bot *bots, int n, int from, uint32_t seq, int msg_bytes, int slow_drain_us) {
+	char buffer[65536];
+	struct Body body = { HARNESS_MAGIC, from == -1 ? ROLL_CALL : (uint32_t)from, seq, chat_monotonic_ns() };
+
+	// Small enough to always go out in one piece; a partial send would split a body
+	memset(buffer, 'x', msg_bytes);
+	memcpy(buffer, &body, sizeof body);
+
+	int fd = bots[from == -1 ? 0 : from].fd;
+	long drained = 0;
+	while (send(fd, buffer, msg_bytes, MSG_DONTWAIT) == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			perror("harness: send");
+			break;
+		}
+		drained += drain_all(bots, n, slow_drain_us);
+	}
+	return drained;
+}
+
+
+// Waits until total reaches expected. Returns 0, or -1 on timeout
+int settle(struct Bot *bots, int n, long *total, long expected, int slow_drain_us) {
+	int64_t deadline = chat_monotonic_ns() + SETTLE_NS;
+
+	while (*total < expected) {
+		if (chat_monotonic_ns() > deadline) return -1;
+		*total += drain_all(bots, n, slow_drain_us);
+		if (*total < expected) usleep(200);
+	}
+	return 0;
+}
+
+
+// A single send on the pattern's timeline
+struct Event {
+	int64_t at_ns;
+	int talker;
+	uint32_t seq;
+};
+
+int cmp_event(const void *a, const void *b) {
+	const struct Event *x = a, *y = b;
+	if (x->at_ns != y->at_ns) return (x->at_ns > y->at_ns) - (x->at_ns < y->at_ns);
+	return x->talker - y->talker;
+}
+
+
+// Returns 0 if the pattern stayed within budget
+int run_pattern(struct Pattern *pattern) {
+	struct Bot *bots = calloc(pattern->clients, sizeof(struct Bot));
+	int failed = 0;
+	char name[USERNAME_LEN];
+	char prompt[64];
+
+	// Join storm: every client connects at once
+	int64_t join_start = chat_monotonic_ns();
+	for (int i = 0; i < pattern->clients; i++) {
+		int sv[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+			perror("harness: socketpair");
+			exit(1);
+		}
+		if ((bots[i].slot = chat_core_add(sv[0], "socketpair")) == -1) {
+			fprintf(stderr, "harness: connection table full\n");
+			exit(1);
+		}
+		bots[i].fd = sv[1];
+		bots[i].pending = malloc(PENDING_LEN);
+		bots[i].slow = i >= pattern->clients - pattern->slow_readers;
+	}
+
+	// Username handshake
+	for (int i = 0; i < pattern->clients; i++) {
+		if (recv(bots[i].fd, prompt, sizeof prompt, 0) < 1) {
+			perror("harness: username prompt");
+			exit(1);
+		}
+		snprintf(name, sizeof name, "b%d", i % 100000);
+		send(bots[i].fd, name, strlen(name), 0);
+		fcntl(bots[i].fd, F_SETFL, O_NONBLOCK);
+	}
+
+	body_bytes = pattern->msg_bytes;
+	latency_capacity = (long)pattern->talkers * pattern->messages * pattern->clients;
+	latencies = malloc(latency_capacity * sizeof(int64_t));
+	latency_count = 0;
+
+	// A message sent before the server has read the username would be read as part of it
+	for (int i = 0; i < pattern->clients; i++) {
+		while (__atomic_load_n(&CLIENTS.meta[bots[i].slot].name[0], __ATOMIC_ACQUIRE) == 0) usleep(100);
+	}
+
+	// The first broadcast reaching everyone marks the end of the join
+	long total = bot_send(bots, pattern->clients, -1, 0, pattern->msg_bytes, 0);
+	if (settle(bots, pattern->clients, &total, pattern->clients - 1, 0) == -1) {
+		fprintf(stderr, "%s: roll call never reached everyone (%ld of %d)\n", pattern->name, total, pattern->clients - 1);
+		failed = 1;
+	}
+	double join_ms = (chat_monotonic_ns() - join_start) / 1e6;
+
+	// Build the traffic timeline; talkers start at staggered offsets so their sends interleave
+	int n_events = pattern->talkers * pattern->messages;
+	struct Event *events = malloc(n_events * sizeof(struct Event));
+	srand(528);
+	for (int t = 0, e = 0; t < pattern->talkers; t++) {
+		int64_t offset = (int64_t)(rand() % pattern->interval_us) * 1000;
+		for (int k = 0; k < pattern->messages; k++, e++) {
+			events[e].at_ns = offset + (int64_t)k * pattern->interval_us * 1000;
+			events[e].talker = t;
+			events[e].seq = k;
+		}
+	}
+	qsort(events, n_events, sizeof(struct Event), cmp_event);
+
+	// Replay
+	struct ChatStats before, after;
+	chat_stats(&before);
+	latency_count = 0;
+	total = 0;
+	int64_t replay_start = chat_monotonic_ns();
+
+	for (int e = 0; e < n_events; e++) {
+		total += bot_send(bots, pattern->clients, events[e].talker, events[e].seq, pattern->msg_bytes, pattern->slow_drain_us);
+		total += drain_all(bots, pattern->clients, pattern->slow_drain_us);
+	}
+
+	long expected = (long)n_events * (pattern->clients - 1);
+	if (settle(bots, pattern->clients, &total, expected, pattern->slow_drain_us) == -1) {
+		fprintf(stderr, "%s: only %ld of %ld deliveries arrived\n", pattern->name, total, expected);
+		failed = 1;
+	}
+	double elapsed_s = (chat_monotonic_ns() - replay_start) / 1e9;
+	chat_stats(&after);
+
+	qsort(latencies, latency_count, sizeof(int64_t), cmp_int64);
+	double rate = total / elapsed_s;
+	double p50 = percentile_ms(0.50), p99 = percentile_ms(0.99);
+	double timeline_s = events[n_events - 1].at_ns / 1e9;
+
+	printf("%-13s %4d clients | %6.2fs of traffic in %5.2fs | join %7.1f ms | %8.0f deliveries/s | p50 %6.2f ms | p99 %6.2f ms | server relayed %lu\n",
+		pattern->name, pattern->clients, timeline_s, elapsed_s, join_ms, rate, p50, p99,
+		(unsigned long)(after.messages - before.messages));
+
+	if (join_ms > pattern->max_join_ms) {
+		fprintf(stderr, "%s: join took %.1f ms (budget %.0f ms)\n", pattern->name, join_ms, pattern->max_join_ms);
+		failed = 1;
+	}
+	if (rate < pattern->min_deliveries_per_sec) {
+		fprintf(stderr, "%s: %.0f deliveries/s (budget %.0f)\n", pattern->name, rate, pattern->min_deliveries_per_sec);
+		failed = 1;
+	}
+	if (p50 > pattern->max_p50_ms || p99 > pattern->max_p99_ms) {
+		fprintf(stderr, "%s: latency p50 %.2f ms / p99 %.2f ms (budget %.0f / %.0f ms)\n", pattern->name, p50, p99, pattern->max_p50_ms, pattern->max_p99_ms);
+		failed = 1;
+	}
+
+	// Hang up and wait for the server to forget everyone before the next pattern
+	for (int i = 0; i < pattern->clients; i++) {
+		close(bots[i].fd);
+		free(bots[i].pending);
+	}
+	int64_t deadline = chat_monotonic_ns() + SETTLE_NS;
+	while (CLIENTS.high_water > 0 && chat_monotonic_ns() < deadline) usleep(1000);
+	if (CLIENTS.high_water > 0) {
+		fprintf(stderr, "%s: server still holds %d slots after hangup\n", pattern->name, CLIENTS.high_water);
+		failed = 1;
+	}
+
+	free(events);
+	free(latencies);
+	free(bots);
+	return failed;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	int failures = 0;
+	int ran = 0;
+
+	chat_verbose = 0;
+	while ((opt = getopt(argc, argv, "v")) != -1) {
+		switch (opt) {
+		case 'v': chat_verbose = 1; break;
+		default:
+			fprintf(stderr, "usage: chat_harness [-v] [pattern ...]\n");
+			exit(1);
+		}
+	}
+
+	// Writes to clients that already hung up shouldn't kill the run
+	signal(SIGPIPE, SIG_IGN);
+
+	if (chat_core_init(MAX_CLIENTS) == -1) {
+		fprintf(stderr, "harness: could not allocate connection table\n");
+		exit(1);
+	}
+
+	for (size_t p = 0; p < sizeof PATTERNS / sizeof PATTERNS[0]; p++) {
+		int wanted = optind == argc;
+		for (int a = optind; a < argc; a++) wanted |= strcmp(argv[a], PATTERNS[p].name) == 0;
+		if (!wanted) continue;
+
+		if (MESSAGE_LEN % PATTERNS[p].msg_bytes != 0 || PATTERNS[p].msg_bytes < (int)sizeof(struct Body)) {
+			fprintf(stderr, "%s: message size must divide %d\n", PATTERNS[p].name, MESSAGE_LEN);
+			exit(1);
+		}
+
+		failures += run_pattern(&PATTERNS[p]);
+		ran++;
+	}
+
+	if (ran == 0) {
+		fprintf(stderr, "harness: no such pattern\n");
+		exit(1);
+	}
+	printf("%s: %d of %d patterns within budget\n", failures ? "FAIL" : "PASS", ran - failures, ran);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,138 @@
+/*
+** conn_table.c -- connection table for the chat server
+*/
+
+#define _GNU_SOURCE // pthread_rwlockattr_setkind_np()
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "conn_table.h"
+
+
+static void ct_free_arrays(struct ConnTable *table) {
+	free(table->fd);
+	free(table->room);
+	free(table->zc_pending);
+	free(table->flags);
+	free(table->refs);
+	free(table->meta);
+	free(table->free_next);
+	memset(table, 0, sizeof *table);
+}
+
+
+int ct_init(struct ConnTable *table, int capacity) {
+	memset(table, 0, sizeof *table);
+	table->capacity = capacity;
+
+	table->fd = calloc(capacity, sizeof(int));
+	table->room = calloc(capacity, sizeof(int));
+	table->zc_pending = calloc(capacity, sizeof(struct ZcPending*));
+	table->flags = calloc(capacity, sizeof(uint8_t));
+	table->refs = calloc(capacity, sizeof(int));
+	table->meta = calloc(capacity, sizeof(struct ClientMeta));
+	table->free_next = calloc(capacity, sizeof(int));
+
+	if (!table->fd || !table->room || !table->zc_pending || !table->flags || !table->refs || !table->meta || !table->free_next) {
+		ct_free_arrays(table);
+		return -1;
+	}
+
+	// Low slots first so the table stays packed
+	for (int i = 0; i < capacity; i++) table->free_next[i] = i + 1 < capacity ? i + 1 : -1;
+	table->free_head = capacity > 0 ? 0 : -1;
+
+	for (int i = 0; i < capacity; i++) pthread_mutex_init(&table->meta[i].send_lock, NULL);
+
+	// Walks are short, but they're constant under load; joins and leaves shouldn't wait out all of them
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&table->lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	return 0;
+};
+
+
+void ct_destroy(struct ConnTable *table) {
+	if (table->meta) {
+		for (int i = 0; i < table->capacity; i++) pthread_mutex_destroy(&table->meta[i].send_lock);
+		pthread_rwlock_destroy(&table->lock);
+	}
+	ct_free_arrays(table);
+};
+
+
+int ct_add(struct ConnTable *table, int fd, int room) {
+	pthread_rwlock_wrlock(&table->lock);
+
+	int slot = table->free_head;
+	if (slot == -1 || room < 0 || room >= MAX_ROOMS) {
+		pthread_rwlock_unlock(&table->lock);
+		return -1;
+	}
+	table->free_head = table->free_next[slot];
+
+	// Everything but the send lock, which stays as the table made it
+	struct ClientMeta *meta = &table->meta[slot];
+	meta->thread_id = 0;
+	meta->zc_seq = 0;
+	meta->pipefd[0] = meta->pipefd[1] = -1;
+	memset(meta->ip, 0, sizeof meta->ip);
+	memset(meta->name, 0, sizeof meta->name);
+
+	table->fd[slot] = fd;
+	table->room[slot] = room;
+	table->zc_pending[slot] = NULL;
+	table->refs[slot] = 1; // The client's own
+	table->flags[slot] = CONN_USED; // Set last; broadcasters skip the slot until now
+
+	table->room_size[room]++;
+	if (slot >= table->high_water) table->high_water = slot + 1;
+
+	pthread_rwlock_unlock(&table->lock);
+	return slot;
+};
+
+
+void ct_remove(struct ConnTable *table, int slot) {
+	pthread_rwlock_wrlock(&table->lock);
+
+	table->flags[slot] = 0;
+	table->room_size[table->room[slot]]--;
+
+	// Trim trailing empty slots so iteration doesn't walk them
+	while (table->high_water > 0 && !(table->flags[table->high_water - 1] & CONN_USED)) table->high_water--;
+
+	pthread_rwlock_unlock(&table->lock);
+};
+
+
+void ct_hold(struct ConnTable *table, int slot) {
+	__atomic_add_fetch(&table->refs[slot], 1, __ATOMIC_RELAXED);
+};
+
+
+int ct_release(struct ConnTable *table, int slot) {
+	return __atomic_sub_fetch(&table->refs[slot], 1, __ATOMIC_ACQ_REL) == 0;
+};
+
+
+void ct_free(struct ConnTable *table, int slot) {
+	pthread_rwlock_wrlock(&table->lock);
+	table->free_next[slot] = table->free_head;
+	table->free_head = slot;
+	pthread_rwlock_unlock(&table->lock);
+};
+
+
+int ct_peer(struct ConnTable *table, int slot) {
+	int room = table->room[slot];
+	if (table->room_size[room] != 2) return -1;
+
+	for (int i = 0; i < table->high_water; i++) {
+		if (i != slot && (table->flags[i] & CONN_USED) && table->room[i] == room) return i;
+	}
+	return -1;
+};
@@ -0,0 +1,88 @@
+/*
+** conn_table.h -- connection table for the chat server
+**
+** A broadcast only needs each member's fd, room, pending zerocopy queue and
+** flags, so those live in parallel "hot" arrays indexed by slot. Everything
+** else (ip, name, thread, locks) sits in the "cold" meta array and is only
+** touched on connect/disconnect. Slots never move while a client is connected,
+** so a client's thread can hold on to its slot number.
+**
+** Anything walking the slots holds the table's lock for reading, but only
+** long enough to look: a broadcast takes a reference on each recipient
+** (ct_hold), lets go of the lock, and sends. A client that leaves is taken out
+** of its room at once (ct_remove), while its slot and fd stay until the last
+** reference is released, so a slow send never holds up joins and leaves and a
+** slot is never handed to a new client mid-send. Send locks are made once
+** with the table and outlive the clients that use them.
+*/
+
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#define USERNAME_LEN	7 // Includes termination character
+#define MAX_ROOMS		16
+
+// Hot flags
+#define CONN_USED		0x01 // Slot holds a connected client
+#define CONN_ZEROCOPY	0x02 // SO_ZEROCOPY is enabled on the socket
+
+struct ZcPending;
+
+// Per-client data that broadcast never reads
+struct ClientMeta {
+	pthread_t thread_id;
+	pthread_mutex_t send_lock; // Keeps zerocopy sends and their sequence numbers in order; lives as long as the table
+	uint32_t zc_seq; // Sequence number the kernel will give the next zerocopy send
+	int pipefd[2]; // splice() relay pipe, created on first use
+	char ip[INET6_ADDRSTRLEN];
+	char name[USERNAME_LEN];
+};
+
+struct ConnTable {
+	int capacity;
+	int high_water; // One past the highest slot in use; iteration stops here
+
+	// Hot arrays, one entry per slot
+	int *fd;
+	int *room;
+	struct ZcPending **zc_pending; // Zerocopy sends the kernel has not completed yet
+	uint8_t *flags;
+	int *refs; // The client's own reference, plus one per send in progress to it
+
+	// Cold
+	struct ClientMeta *meta;
+	int room_size[MAX_ROOMS];
+	int *free_next; // Free slot list, most recently freed first
+	int free_head;
+	pthread_rwlock_t lock; // Written while adding/removing clients, read while walking the slots
+};
+
+// Allocates room for capacity clients. Returns 0 on success, -1 if out of memory
+int ct_init(struct ConnTable *table, int capacity);
+void ct_destroy(struct ConnTable *table);
+
+// Claims a slot for a new connection. Returns the slot, or -1 if the table is full
+int ct_add(struct ConnTable *table, int fd, int room);
+
+// Takes the client out of its room; nothing new reaches the slot after this. The slot itself
+// stays until its client's reference and every ct_hold() one are released
+void ct_remove(struct ConnTable *table, int slot);
+
+// Keeps a slot (and its fd) from being freed while the caller sends to it. Hold the lock for reading
+void ct_hold(struct ConnTable *table, int slot);
+
+// Drops a reference. Returns 1 if it was the last: the caller closes the fd, then calls ct_free()
+int ct_release(struct ConnTable *table, int slot);
+
+// Puts a slot whose last reference is gone back on the free list
+void ct_free(struct ConnTable *table, int slot);
+
+// Returns the other member of a two-party room, or -1 if the room doesn't have exactly two members.
+// Hold the lock for reading, and ct_hold() the slot it returns to use it after unlocking
+int ct_peer(struct ConnTable *table, int slot);
+
+#endif
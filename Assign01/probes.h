@@ -0,0 +1,39 @@
+/*
+** probes.h -- USDT tracepoints for the chat server
+**
+** Each CHAT_PROBEn(name, ...) is a single nop plus an ELF note when built
+** against systemtap's <sys/sdt.h> (Debian/Ubuntu: systemtap-sdt-dev). The nop
+** is only patched while perf/bpftrace is attached, so probes cost nothing
+** otherwise. Without the header (or with -DNO_USDT) they compile away.
+**
+**   bpftrace -l 'usdt:./server:chat:*'
+**   bpftrace -e 'usdt:./server:chat:fanout_start { @t[tid] = nsecs; }
+**                usdt:./server:chat:fanout_end /@t[tid]/ { @us = hist((nsecs - @t[tid]) / 1000); delete(@t[tid]); }'
+**
+** Probes (all carry the client's slot first):
+**   accept(slot, fd)
+**   handshake(slot, name)
+**   frame_received(slot, bytes)
+**   fanout_start(slot, bytes, room_size)
+**   fanout_end(slot, deliveries)
+*/
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT 1
+#endif
+#endif
+
+#ifdef HAVE_USDT
+#define CHAT_PROBE2(name, a, b)		DTRACE_PROBE2(chat, name, a, b)
+#define CHAT_PROBE3(name, a, b, c)	DTRACE_PROBE3(chat, name, a, b, c)
+#else
+#define CHAT_PROBE2(name, a, b)		do { } while (0)
+#define CHAT_PROBE3(name, a, b, c)	do { } while (0)
+#endif
+
+#endif
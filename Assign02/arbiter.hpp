@@ -0,0 +1,436 @@
+/*
+** arbiter.hpp -- deciding which AI talks next in a room of several
+**
+** The relay is a two-party ping-pong: each side answers the other. A room
+** holds any number of agents (a name and a persona each) and one transcript,
+** and a policy decides each turn who speaks:
+**
+**   round-robin       everyone in order
+**   addressed         whoever the last line names ("Bob, ..." or "@Bob"),
+**                     otherwise the next in order
+**   bid:K             everyone but the last speaker bids with how close their
+**                     persona is to the last line (embedding similarity); the
+**                     K highest bidders answer
+**   interrupt:TOKENS  addressed, but a speaker still going after TOKENS tokens
+**                     is cut off by whoever they've named so far, or the next
+**                     in order
+**
+** When a policy picks more than one candidate they generate at once and the
+** first to finish takes the turn. The rest are cancelled at their next token:
+** the connection is dropped, so the backend stops too.
+**
+** Rooms are state machines, not threads. A turn's candidates are jobs on a
+** shared worker pool, every generation takes a slot from one scheduler (each
+** room is a flow of its own, so rooms share the backends fairly), and the
+** winner's reply starts the next turn. Hundreds of rooms need only about as
+** many workers as generations the backends can run at once.
+**
+**   talker -n 200 -P bid:2 -c 4 -B http://gpu1:11434,http://gpu2:11434
+*/
+
+#ifndef ARBITER_HPP
+#define ARBITER_HPP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ollama.hpp"
+#include "metrics.hpp"
+#include "backends.hpp"
+#include "scheduler.hpp"
+#include "semantic_cache.hpp"
+#include "worker_pool.hpp"
+#include "telemetry.hpp"
+
+namespace arbiter
+{
+    using clock = std::chrono::steady_clock;
+
+    struct agent {
+        std::string name;
+        std::string persona; // how they talk, for the system prompt
+    };
+
+    struct line {
+        int speaker;
+        std::string text;
+        bool interrupted; // cut off by the next speaker
+    };
+
+    // The agent (other than not_this) named earliest in text as a whole word, case aside; -1 if none
+    inline int named(const std::vector<agent>& agents, const std::string& text, int not_this)
+    {
+        std::string lower = text;
+        for (char& c : lower) c = tolower((unsigned char)c);
+        int found = -1;
+        size_t earliest = std::string::npos;
+        for (int i = 0; i < (int)agents.size(); i++) {
+            if (i == not_this || agents[i].name.empty()) continue;
+            std::string name = agents[i].name;
+            for (char& c : name) c = tolower((unsigned char)c);
+            for (size_t at = lower.find(name); at != std::string::npos && at < earliest; at = lower.find(name, at + 1)) {
+                bool starts = at == 0 || !isalnum((unsigned char)lower[at - 1]);
+                bool ends = at + name.length() == lower.length() || !isalnum((unsigned char)lower[at + name.length()]);
+                if (starts && ends) { earliest = at; found = i; break; }
+            }
+        }
+        return found;
+    }
+
+    class policy {
+        public:
+            policy(const std::string& name): name(name) {}
+            virtual ~policy() {}
+
+            // Who answers next, most preferred first; transcript is never empty. More than one
+            // race for the turn.
+            virtual std::vector<int> candidates(const std::vector<agent>& agents, const std::vector<line>& transcript) = 0;
+
+            // Looks at a reply as it streams in. Returns who cuts in, or -1 to let the speaker go on.
+            virtual int interrupt(const std::vector<agent>&, int /*speaker*/, const std::string& /*partial*/, int /*tokens*/) { return -1; }
+
+            const std::string name;
+
+        protected:
+            static int next_after(const std::vector<agent>& agents, int speaker) { return (speaker + 1) % (int)agents.size(); }
+    };
+
+    class round_robin: public policy {
+        public:
+            round_robin(): policy("round-robin") {}
+            std::vector<int> candidates(const std::vector<agent>& agents, const std::vector<line>& transcript) override
+            {
+                return { next_after(agents, transcript.back().speaker) };
+            }
+    };
+
+    class addressed: public policy {
+        public:
+            addressed(const std::string& name = "addressed"): policy(name) {}
+            std::vector<int> candidates(const std::vector<agent>& agents, const std::vector<line>& transcript) override
+            {
+                int last = transcript.back().speaker;
+                int to = named(agents, transcript.back().text, last);
+                return { to >= 0 ? to : next_after(agents, last) };
+            }
+    };
+
+    class interrupting: public addressed {
+        public:
+            interrupting(int max_tokens): addressed("interrupt"), max_tokens(max_tokens) {}
+            int interrupt(const std::vector<agent>& agents, int speaker, const std::string& partial, int tokens) override
+            {
+                if (tokens < max_tokens) return -1;
+                int to = named(agents, partial, speaker);
+                return to >= 0 ? to : next_after(agents, speaker);
+            }
+        private:
+            int max_tokens;
+    };
+
+    class relevance_bid: public policy {
+        public:
+            relevance_bid(backends::pool& pool, const std::string& model, int fanout):
+                policy("bid"), pool(pool), model(model), fanout(fanout < 1 ? 1 : fanout) {}
+
+            std::vector<int> candidates(const std::vector<agent>& agents, const std::vector<line>& transcript) override
+            {
+                int last = transcript.back().speaker;
+                std::vector<float> topic = embed(transcript.back().text);
+                std::vector<std::pair<float, int>> bids;
+                for (int i = 0; i < (int)agents.size(); i++) {
+                    if (i == last) continue;
+                    std::vector<float> self = persona(agents[i]);
+                    float bid = topic.empty() || self.size() != topic.size() ? 0 : semantic::dot(topic.data(), self.data(), topic.size());
+                    bids.push_back(std::make_pair(bid, i));
+                }
+                // Highest bid first; ties (and failed embeddings) go to whoever is next in order
+                int n = agents.size();
+                std::stable_sort(bids.begin(), bids.end(), [last, n](const std::pair<float, int>& a, const std::pair<float, int>& b) {
+                    if (a.first != b.first) return a.first > b.first;
+                    return (a.second - last + n) % n < (b.second - last + n) % n;
+                });
+                std::vector<int> who;
+                for (int i = 0; i < (int)bids.size() && i < fanout; i++) who.push_back(bids[i].second);
+                return who;
+            }
+
+        private:
+            std::vector<float> embed(const std::string& text)
+            {
+                std::vector<float> v;
+                pool.run(model, -1, [&](Ollama& ollama) {
+                    ollama::response r = ollama.generate_embeddings(model, text);
+                    const nlohmann::json& j = r.as_json();
+                    if (j.contains("embeddings") && j["embeddings"].is_array() && !j["embeddings"].empty())
+                        v = j["embeddings"][0].get<std::vector<float>>();
+                }, nullptr);
+                semantic::normalize(v);
+                return v;
+            }
+
+            std::vector<float> persona(const agent& a)
+            {
+                std::lock_guard<std::mutex> hold(lock);
+                auto it = personas.find(a.name);
+                if (it == personas.end() || it->second.empty()) it = personas.insert_or_assign(a.name, embed(a.name + ". " + a.persona)).first;
+                return it->second;
+            }
+
+            backends::pool& pool;
+            std::string model;
+            int fanout;
+            std::mutex lock;
+            std::map<std::string, std::vector<float>> personas;
+    };
+
+    // round-robin, addressed, bid:K or interrupt:TOKENS; nullptr if the spec is bad. bid embeds with model.
+    inline std::unique_ptr<policy> make(const std::string& spec, backends::pool& pool, const std::string& model)
+    {
+        size_t colon = spec.find(':');
+        std::string kind = spec.substr(0, colon);
+        int arg = colon == std::string::npos ? 0 : atoi(spec.c_str() + colon + 1);
+        if (kind == "round-robin") return std::unique_ptr<policy>(new round_robin());
+        if (kind == "addressed") return std::unique_ptr<policy>(new addressed());
+        if (kind == "bid") return std::unique_ptr<policy>(new relevance_bid(pool, model, arg > 0 ? arg : 1));
+        if (kind == "interrupt" && arg > 0) return std::unique_ptr<policy>(new interrupting(arg));
+        return nullptr;
+    }
+
+    class engine {
+        public:
+            struct settings {
+                std::string model = "llama3.2";
+                nlohmann::json options; // null, or shaped like ollama::options
+                int history = 12; // transcript lines each prompt carries
+                int turns = 20; // generated turns before a room closes
+                sched::priority priority = sched::INTERACTIVE;
+            };
+
+            // Across every room, for reporting
+            struct totals {
+                std::atomic<int64_t> turns{0}, candidates{0}, cancelled{0}, wasted_tokens{0}, interrupts{0}, failed{0};
+            };
+
+            using line_callback = std::function<void(int room, const agent& speaker, const line& said)>;
+
+            // scheduler may be null (no limit on generations at once)
+            engine(backends::pool& pool, sched::scheduler* scheduler, int workers, const settings& s):
+                pool(pool), scheduler(scheduler), s(s), active("arbiter_rooms_active"), workers(workers) {}
+
+            // Opens a room with agents[0] saying opening, and starts its first turn. Returns its id.
+            int open(const std::vector<agent>& agents, std::unique_ptr<policy> p, const std::string& opening, const line_callback& on_line)
+            {
+                std::shared_ptr<room> r = std::make_shared<room>(std::move(p));
+                r->agents = agents;
+                r->on_line = on_line;
+                r->transcript.push_back(line{0, opening, false});
+                {
+                    std::lock_guard<std::mutex> hold(lock);
+                    r->id = next_id++;
+                    open_rooms++;
+                    active.set(open_rooms);
+                }
+                if (on_line) on_line(r->id, r->agents[0], r->transcript.back());
+                workers.submit([this, r]() { begin_turn(r); });
+                return r->id;
+            }
+
+            // Until every room has had its turns (or given up)
+            void wait()
+            {
+                std::unique_lock<std::mutex> hold(lock);
+                closed.wait(hold, [this]() { return open_rooms == 0; });
+            }
+
+            const totals& counters() const { return all; }
+
+        private:
+            struct room {
+                room(std::unique_ptr<policy> p):
+                    arbitration(std::move(p)),
+                    turns("arbiter_turns_total", label()), candidates("arbiter_candidates_total", label()),
+                    cancelled("arbiter_cancelled_total", label()), wasted_tokens("arbiter_wasted_tokens_total", label()),
+                    interrupts("arbiter_interrupts_total", label()), failed("arbiter_failed_turns_total", label()),
+                    turn_ms("arbiter_turn_ms", label()) {}
+
+                std::string label() const { return "policy=\"" + arbitration->name + "\""; }
+
+                int id = 0;
+                std::unique_ptr<policy> arbitration;
+                std::vector<agent> agents;
+                line_callback on_line;
+
+                std::mutex lock;
+                std::vector<line> transcript;
+                int turn = 0; // generated turns so far
+                int cut_in = -1; // takes the next turn: they interrupted the last one
+                int failures = 0; // turns in a row nobody finished
+
+                metrics::counter turns, candidates, cancelled, wasted_tokens, interrupts, failed;
+                metrics::histogram turn_ms;
+            };
+
+            // One turn's race between its candidates
+            struct race {
+                int turn;
+                clock::time_point started;
+                int pending; // candidates still generating; under the room's lock
+                std::atomic<bool> over{false}; // someone won; the rest stop
+            };
+
+            void begin_turn(std::shared_ptr<room> r)
+            {
+                std::vector<int> who;
+                int turn, failures;
+                {
+                    std::lock_guard<std::mutex> hold(r->lock);
+                    turn = r->turn;
+                    failures = r->failures;
+                    if (r->cut_in >= 0) who.push_back(r->cut_in);
+                    r->cut_in = -1;
+                }
+                if (failures > 0) std::this_thread::sleep_for(std::chrono::seconds(failures)); // let the backends recover
+                // The transcript only changes when a turn is won, and this turn hasn't started
+                if (who.empty()) who = r->arbitration->candidates(r->agents, r->transcript);
+                if (who.empty()) who.push_back((r->transcript.back().speaker + 1) % r->agents.size());
+
+                std::shared_ptr<race> t = std::make_shared<race>();
+                t->turn = turn;
+                t->started = clock::now();
+                t->pending = who.size();
+                r->candidates.inc(who.size());
+                all.candidates += who.size();
+                for (int speaker : who) {
+                    std::string request = request_for(*r, speaker);
+                    workers.submit([this, r, t, speaker, request]() { generate(r, t, speaker, request); });
+                }
+            }
+
+            // The persona as the system prompt, the recent transcript as the prompt, ending where the speaker comes in
+            std::string request_for(const room& r, int speaker) const
+            {
+                std::string others;
+                for (int i = 0; i < (int)r.agents.size(); i++) {
+                    if (i == speaker) continue;
+                    others += (others.empty() ? "" : ", ") + r.agents[i].name;
+                }
+                std::string prompt;
+                size_t from = r.transcript.size() > (size_t)s.history ? r.transcript.size() - s.history : 0;
+                for (size_t i = from; i < r.transcript.size(); i++) {
+                    const line& l = r.transcript[i];
+                    prompt += r.agents[l.speaker].name + ": " + l.text + (l.interrupted ? " --" : "") + "\n";
+                }
+                prompt += r.agents[speaker].name + ":";
+
+                ollama::request request(s.model, prompt, s.options, true);
+                request["system"] = r.agents[speaker].persona + " You are " + r.agents[speaker].name + ", in a group conversation with " +
+                                    others + ". Reply with just your next line, a sentence or two, without your name in front.";
+                return request.dump();
+            }
+
+            void generate(std::shared_ptr<room> r, std::shared_ptr<race> t, int speaker, const std::string& request)
+            {
+                std::string reply;
+                int tokens = 0, cut_by = -1;
+                bool ok = false;
+                ollama::response final_chunk;
+                if (!t->over) {
+                    sched::scheduler::slot slot(scheduler, r->id, s.priority);
+                    if (!t->over) ok = pool.run(s.model, slot.backend, [&](Ollama& ollama) {
+                        reply.clear();
+                        tokens = 0;
+                        ollama.generate_serialized(request, [&](const ollama::response& token) {
+                            reply += token.as_simple_string();
+                            tokens++;
+                            if (token.as_json().value("done", false)) final_chunk = token;
+                            if (cut_by < 0) cut_by = r->arbitration->interrupt(r->agents, speaker, reply, tokens);
+                        }, [&]() { return !t->over && cut_by < 0; });
+                    }, [&]() { return tokens > 0; });
+                    if (ok) telemetry::record(final_chunk, r->agents[speaker].name, backends::last_used());
+                }
+                finish(r, t, speaker, ok ? trim(reply) : "", tokens, cut_by);
+            }
+
+            void finish(std::shared_ptr<room> r, std::shared_ptr<race> t, int speaker, const std::string& reply, int tokens, int cut_by)
+            {
+                bool next = false, close = false;
+                {
+                    std::lock_guard<std::mutex> hold(r->lock);
+                    t->pending--;
+                    if (t->over || reply.empty()) {
+                        if (t->over) {
+                            r->cancelled.inc();
+                            r->wasted_tokens.inc(tokens);
+                            all.cancelled++;
+                            all.wasted_tokens += tokens;
+                        }
+                        // Nobody finished: try again, unless it keeps happening
+                        if (t->pending == 0 && !t->over) {
+                            r->failed.inc();
+                            all.failed++;
+                            close = ++r->failures >= 3;
+                            if (close) fprintf(stderr, "arbiter: room %d: closing after %d failed turns\n", r->id, r->failures);
+                            next = !close;
+                        }
+                    }
+                    else {
+                        t->over = true;
+                        r->failures = 0;
+                        r->transcript.push_back(line{speaker, reply, cut_by >= 0});
+                        r->turn++;
+                        r->turns.inc();
+                        all.turns++;
+                        r->turn_ms.observe(std::chrono::duration<double, std::milli>(clock::now() - t->started).count());
+                        if (cut_by >= 0) {
+                            r->cut_in = cut_by;
+                            r->interrupts.inc();
+                            all.interrupts++;
+                        }
+                        if (r->on_line) r->on_line(r->id, r->agents[speaker], r->transcript.back());
+                        close = r->turn >= s.turns;
+                        next = !close;
+                    }
+                }
+                if (next) workers.submit([this, r]() { begin_turn(r); });
+                if (close) {
+                    std::lock_guard<std::mutex> hold(lock);
+                    open_rooms--;
+                    active.set(open_rooms);
+                    closed.notify_all();
+                }
+            }
+
+            static std::string trim(const std::string& text)
+            {
+                size_t start = text.find_first_not_of(" \t\r\n"), end = text.find_last_not_of(" \t\r\n");
+                return start == std::string::npos ? "" : text.substr(start, end - start + 1);
+            }
+
+            backends::pool& pool;
+            sched::scheduler* scheduler;
+            settings s;
+            totals all;
+
+            std::mutex lock;
+            std::condition_variable closed;
+            int next_id = 0;
+            int open_rooms = 0;
+            metrics::gauge active;
+
+            relay::worker_pool workers; // last: its threads finish their jobs before the rest goes away
+    };
+}
+
+#endif
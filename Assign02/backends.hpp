@@ -0,0 +1,318 @@
+/*
+** backends.hpp -- a pool of Ollama backends with health-aware routing
+**
+** Each generation goes to the healthy backend with the fewest requests
+** outstanding, preferring those that already have the model loaded. A health
+** thread probes every backend with is_running() and running_model_json()
+** every couple of seconds. A backend that fails a probe or a request is
+** ejected, and comes back only when it passes a probe after its backoff
+** (1s, doubling up to 60s) has run out. The backoff starts over from 1s only
+** once the backend has passed STABLE_PROBES probes in a row since it came back,
+** so one that keeps falling over soon after readmission stays out longer each time.
+**
+** With shared set, the routing state lives in shared memory, so forked
+** conversation processes balance on the same outstanding counts and the
+** parent's health thread covers all of them. HTTP clients are per process and
+** keep their connections open between requests.
+**
+** Metrics label a backend by its place in the -B list (backend="0", "1", ...),
+** which stays short and quotable whatever the URL; the pool logs which URL
+** each one is when it's made.
+**
+**   server -B http://gpu1:11434,http://gpu2:11434
+*/
+
+#ifndef BACKENDS_HPP
+#define BACKENDS_HPP
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ollama.hpp"
+#include "metrics.hpp"
+
+namespace backends
+{
+    const int MAX_BACKENDS = 16;
+    const int URL_LEN = 256;
+    const int MODELS_LEN = 1024;
+    const int MIN_BACKOFF_MS = 1000, MAX_BACKOFF_MS = 60000;
+    const int STABLE_PROBES = 5; // healthy probes in a row before the backoff is forgotten
+
+    // The metrics label for the pool's backend i
+    inline std::string label(int i) { return std::to_string(i); }
+
+    // label() of the backend that served this thread's last request through a pool (or a hedged race)
+    inline std::string& last_used()
+    {
+        thread_local std::string label;
+        return label;
+    }
+
+    inline int64_t now_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    struct backend_state {
+        char url[URL_LEN];
+        std::atomic<int> outstanding;
+        std::atomic<bool> healthy;
+        std::atomic<int> backoff_ms; // doubles on every ejection, reset once it stays up STABLE_PROBES intervals
+        std::atomic<int> healthy_probes; // in a row, since it was last ejected
+        std::atomic<int64_t> retry_at_ms; // while ejected, don't probe before this
+        std::atomic_flag models_lock;
+        char models[MODELS_LEN]; // loaded models, comma separated
+    };
+
+    struct shared_state {
+        int count;
+        backend_state backends[MAX_BACKENDS];
+    };
+
+    class pool {
+        public:
+            // urls is comma separated. With shared, the routing state is visible to processes forked later.
+            pool(const std::string& urls, bool shared = false)
+            {
+                void* mem;
+                if (shared) {
+                    mem = mmap(nullptr, sizeof(shared_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+                    if (mem == MAP_FAILED) { perror("backends: mmap"); shared = false; }
+                }
+                if (!shared) mem = ::operator new(sizeof(shared_state));
+                s = new (mem) shared_state();
+
+                size_t start = 0;
+                while (start <= urls.length() && s->count < MAX_BACKENDS) {
+                    size_t comma = urls.find(',', start);
+                    std::string url = urls.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+                    if (!url.empty()) {
+                        backend_state& b = s->backends[s->count++];
+                        snprintf(b.url, URL_LEN, "%s", url.c_str());
+                        b.healthy = true; // until a probe or a request says otherwise
+                        b.models_lock.clear();
+                    }
+                    if (comma == std::string::npos) break;
+                    start = comma + 1;
+                }
+                idle.resize(s->count);
+                for (int i = 0; i < s->count; i++) {
+                    fprintf(stderr, "backends: backend=\"%s\" is %s\n", label(i).c_str(), s->backends[i].url);
+                    outstanding_gauges.emplace_back(new metrics::gauge("backend_outstanding", "backend=\"" + label(i) + "\""));
+                    healthy_gauges.emplace_back(new metrics::gauge("backend_healthy", "backend=\"" + label(i) + "\""));
+                    healthy_gauges[i]->set(1);
+                }
+            }
+
+            int size() const { return s->count; }
+            const char* url(int i) const { return s->backends[i].url; }
+            bool healthy(int i) const { return s->backends[i].healthy; }
+
+            // A backend client borrowed for one request
+            class lease {
+                public:
+                    // preferred: a backend the caller would like (e.g. from the scheduler), used if it's healthy.
+                    // avoid: bit i set to stay off backend i, unless nothing else is healthy.
+                    lease(pool& p, const std::string& model, int preferred = -1, unsigned avoid = 0): p(p), index(p.choose(model, preferred, avoid))
+                    {
+                        p.s->backends[index].outstanding++;
+                        p.outstanding_gauges[index]->add(1);
+                        client = p.checkout(index);
+                    }
+                    ~lease()
+                    {
+                        p.checkin(index, client);
+                        p.s->backends[index].outstanding--;
+                        p.outstanding_gauges[index]->add(-1);
+                    }
+                    Ollama* operator->() { return client; }
+
+                    // The request failed: take the backend out of rotation
+                    void failed() { p.eject(index); }
+
+                    pool& p;
+                    const int index;
+                private:
+                    Ollama* client;
+            };
+
+            // Runs request on a backend, failing over to the next while nothing has come back yet
+            // (progress() false). Returns false if it couldn't be completed anywhere.
+            bool run(const std::string& model, int preferred, const std::function<void(Ollama&)>& request, const std::function<bool()>& progress)
+            {
+                for (int attempt = 0; attempt < s->count; attempt++) {
+                    lease backend(*this, model, attempt == 0 ? preferred : -1);
+                    last_used() = label(backend.index);
+                    try {
+                        request(*backend.operator->());
+                        return true;
+                    }
+                    catch (const ollama::exception& e) {
+                        fprintf(stderr, "backends: %s: %s\n", url(backend.index), e.what());
+                        backend.failed();
+                        if (progress && progress()) return false;
+                    }
+                }
+                return false;
+            }
+
+            // Probes every backend every interval_ms from a background thread. Call it in one
+            // process only (the parent, in fork mode).
+            void start_health_checks(int interval_ms = 2000)
+            {
+                std::thread([this, interval_ms]() {
+                    std::vector<std::unique_ptr<Ollama>> probes;
+                    for (int i = 0; i < s->count; i++) {
+                        probes.emplace_back(new Ollama(s->backends[i].url));
+                        probes.back()->setReadTimeout(2);
+                    }
+                    while (true) {
+                        for (int i = 0; i < s->count; i++) probe(i, *probes[i]);
+                        std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+                    }
+                }).detach();
+            }
+
+        private:
+            static bool has_model(const char* models, const std::string& model)
+            {
+                // "llama3.2" matches a loaded "llama3.2:latest"
+                std::string list = std::string(",") + models + ",";
+                return list.find("," + model + ",") != std::string::npos || list.find("," + model + ":") != std::string::npos;
+            }
+
+            int choose(const std::string& model, int preferred, unsigned avoid = 0)
+            {
+                if (preferred >= 0 && preferred < s->count && s->backends[preferred].healthy && !(avoid & (1u << preferred))) return preferred;
+
+                int best = -1;
+                bool best_loaded = false;
+                for (int i = 0; i < s->count; i++) {
+                    backend_state& b = s->backends[i];
+                    if (!b.healthy || (avoid & (1u << i))) continue;
+                    while (b.models_lock.test_and_set(std::memory_order_acquire)) ;
+                    bool loaded = has_model(b.models, model);
+                    b.models_lock.clear(std::memory_order_release);
+
+                    if (best == -1 || (loaded && !best_loaded) ||
+                        (loaded == best_loaded && b.outstanding < s->backends[best].outstanding)) {
+                        best = i;
+                        best_loaded = loaded;
+                    }
+                }
+                if (best != -1) return best;
+                if (avoid) return choose(model, preferred, 0);
+
+                // Everything is ejected: try the one due back soonest rather than fail outright
+                best = 0;
+                for (int i = 1; i < s->count; i++)
+                    if (s->backends[i].retry_at_ms < s->backends[best].retry_at_ms) best = i;
+                return best;
+            }
+
+            Ollama* checkout(int i)
+            {
+                {
+                    std::lock_guard<std::mutex> hold(lock);
+                    if (!idle[i].empty()) {
+                        Ollama* client = idle[i].back().release();
+                        idle[i].pop_back();
+                        return client;
+                    }
+                }
+                Ollama* client = new Ollama(s->backends[i].url);
+                client->setKeepAlive(true);
+                return client;
+            }
+
+            void checkin(int i, Ollama* client)
+            {
+                std::lock_guard<std::mutex> hold(lock);
+                idle[i].emplace_back(client);
+            }
+
+            // Request failures: also drop this process's connections to it, they're likely dead too
+            void eject(int i)
+            {
+                set_down(i);
+                std::lock_guard<std::mutex> hold(lock);
+                idle[i].clear();
+            }
+
+            // Shared state only, so the health thread never holds a lock a fork could copy
+            void set_down(int i)
+            {
+                backend_state& b = s->backends[i];
+                if (!b.healthy.exchange(false)) return;
+                b.healthy_probes = 0;
+                back_off(i);
+                healthy_gauges[i]->set(0);
+                fprintf(stderr, "backends: ejected %s for %d ms\n", b.url, (int)b.backoff_ms);
+            }
+
+            void back_off(int i)
+            {
+                backend_state& b = s->backends[i];
+                int backoff = b.backoff_ms * 2;
+                if (backoff < MIN_BACKOFF_MS) backoff = MIN_BACKOFF_MS;
+                if (backoff > MAX_BACKOFF_MS) backoff = MAX_BACKOFF_MS;
+                b.backoff_ms = backoff;
+                b.retry_at_ms = now_ms() + backoff;
+            }
+
+            void probe(int i, Ollama& client)
+            {
+                backend_state& b = s->backends[i];
+                if (!b.healthy && now_ms() < b.retry_at_ms) return;
+
+                bool ok = false;
+                std::string models;
+                try {
+                    if (client.is_running()) {
+                        ok = true;
+                        nlohmann::json running = client.running_model_json();
+                        for (auto& model : running["models"]) {
+                            if (!models.empty()) models += ",";
+                            models += model.value("name", "");
+                        }
+                    }
+                }
+                catch (const std::exception&) { ok = false; }
+
+                if (!ok) {
+                    if (b.healthy) set_down(i);
+                    else back_off(i); // failed its re-admission probe
+                    return;
+                }
+
+                while (b.models_lock.test_and_set(std::memory_order_acquire)) ;
+                snprintf(b.models, MODELS_LEN, "%s", models.c_str());
+                b.models_lock.clear(std::memory_order_release);
+
+                if (b.healthy) {
+                    if (++b.healthy_probes == STABLE_PROBES) b.backoff_ms = 0; // stayed up long enough to trust again
+                }
+                else if (!b.healthy.exchange(true)) {
+                    healthy_gauges[i]->set(1);
+                    fprintf(stderr, "backends: readmitted %s\n", b.url);
+                }
+            }
+
+            shared_state* s;
+            std::mutex lock;
+            std::vector<std::vector<std::unique_ptr<Ollama>>> idle; // this process's open clients, per backend
+            std::vector<std::unique_ptr<metrics::gauge>> outstanding_gauges, healthy_gauges;
+    };
+}
+
+#endif
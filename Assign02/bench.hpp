@@ -0,0 +1,112 @@
+/*
+** bench.hpp -- what the load tools share
+**
+** Starting the server under test in a process group of its own (so it and
+** every conversation process it forks can be stopped together), connecting
+** to it while it comes up, and summarizing a set of timings as JSON.
+*/
+
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ollama.hpp"
+
+namespace bench
+{
+    using clock = std::chrono::steady_clock;
+
+    inline double since(clock::time_point start, clock::time_point t)
+    {
+        return std::chrono::duration<double>(t - start).count();
+    }
+
+    // Connects to the server on port, retrying while it starts up. -1 if it never answers.
+    inline int connect_server(const char* port, double patience_s)
+    {
+        clock::time_point give_up = clock::now() + std::chrono::milliseconds((int)(patience_s * 1000));
+        struct addrinfo hints, *servinfo, *p;
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        while (clock::now() < give_up) {
+            if (getaddrinfo("localhost", port, &hints, &servinfo) != 0) return -1;
+            for (p = servinfo; p != NULL; p = p->ai_next) {
+                int fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+                if (fd == -1) continue;
+                if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+                    freeaddrinfo(servinfo);
+                    return fd;
+                }
+                close(fd);
+            }
+            freeaddrinfo(servinfo);
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        return -1;
+    }
+
+    // Runs args[0] in its own process group with input on its stdin, quietly unless verbose. -1 on failure.
+    inline pid_t start_server(std::vector<std::string> args, const std::string& input, bool verbose)
+    {
+        int in[2];
+        if (pipe(in) == -1) { perror("pipe"); return -1; }
+        pid_t pid = fork();
+        if (pid == -1) { perror("fork"); return -1; }
+        if (pid == 0) {
+            setpgid(0, 0);
+            dup2(in[0], STDIN_FILENO);
+            close(in[0]);
+            close(in[1]);
+            if (!verbose) {
+                int null = open("/dev/null", O_WRONLY);
+                dup2(null, STDOUT_FILENO);
+                dup2(null, STDERR_FILENO);
+                close(null);
+            }
+            std::vector<char*> argv;
+            for (std::string& arg : args) argv.push_back(&arg[0]);
+            argv.push_back(nullptr);
+            execvp(argv[0], argv.data());
+            perror("bench: exec");
+            _exit(127);
+        }
+        close(in[0]);
+        if (!input.empty() && write(in[1], input.c_str(), input.length()) == -1) perror("bench: write");
+        close(in[1]);
+        return pid;
+    }
+
+    // count, mean, p50, p90, p99 and max
+    inline nlohmann::json distribution(std::vector<double> values)
+    {
+        nlohmann::json j;
+        j["count"] = values.size();
+        if (values.empty()) return j;
+        std::sort(values.begin(), values.end());
+        double sum = 0;
+        for (double v : values) sum += v;
+        auto rank = [&](double q) { return values[std::min(values.size() - 1, (size_t)(q * values.size()))]; };
+        j["mean"] = sum / values.size();
+        j["p50"] = rank(0.50);
+        j["p90"] = rank(0.90);
+        j["p99"] = rank(0.99);
+        j["max"] = values.back();
+        return j;
+    }
+}
+
+#endif
@@ -0,0 +1,91 @@
+/*
+** cancellation.hpp -- stopping generations nobody is waiting for
+**
+** A peer that disconnects mid-turn used to leave its reply generating to the
+** end, holding a backend (and a scheduler slot) that other conversations were
+** queued for. A cancel_token belongs to one conversation and trips when the
+** conversation ends:
+**
+**   - made with the peer's socket, it checks for a hangup itself (fork mode:
+**     the conversation process owns the socket);
+**   - otherwise whoever notices the end calls cancel() (the event loop, when
+**     it closes the connection).
+**
+** It also trips when the turn runs past its deadline (start_turn() arms it;
+** expired() tells the two apart), so a stalled backend costs the turn its
+** deadline rather than the client's 120 s read timeout.
+**
+** keep_going() hands it to Ollama::generate_serialized, which drops the
+** stream at the next chunk, and sched::scheduler::slot gives up its place in
+** the queue. Either way count() records the tokens thrown away in
+** generations_cancelled_total and generation_wasted_tokens_total.
+*/
+
+#ifndef CANCELLATION_HPP
+#define CANCELLATION_HPP
+
+#include <poll.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include "metrics.hpp"
+
+class cancel_token {
+    public:
+        // sockfd: trip when the peer hangs up on it; -1 to leave it to cancel().
+        // deadline_ms: how long each turn gets from start_turn(); 0 for as long as it takes.
+        cancel_token(int sockfd = -1, int deadline_ms = 0): sockfd(sockfd), deadline_ms(deadline_ms) {}
+
+        void cancel() { tripped = true; }
+
+        // A new turn: its deadline runs from now
+        void start_turn()
+        {
+            due_us = deadline_ms > 0 ? now_us() + (int64_t)deadline_ms * 1000 : 0;
+        }
+
+        // The conversation is over
+        bool hung_up() const
+        {
+            if (tripped) return true;
+            if (sockfd < 0) return false;
+            struct pollfd p = { sockfd, POLLRDHUP, 0 };
+            if (poll(&p, 1, 0) > 0 && (p.revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL))) tripped = true;
+            return tripped;
+        }
+
+        // This turn is out of time
+        bool expired() const
+        {
+            int64_t due = due_us;
+            return due > 0 && now_us() >= due;
+        }
+
+        bool cancelled() const { return hung_up() || expired(); }
+        int deadline() const { return deadline_ms; }
+
+        // For generate_serialized and the scheduler; the token must outlive them
+        std::function<bool()> keep_going() const { return [this]() { return !cancelled(); }; }
+        std::function<bool()> check() const { return [this]() { return cancelled(); }; }
+
+        // A generation stopped for reason after streaming tokens chunks (0 if it never started)
+        static void count(const std::string& reason, int tokens)
+        {
+            metrics::counter("generations_cancelled_total", "reason=\"" + reason + "\"").inc();
+            metrics::counter("generation_wasted_tokens_total", "reason=\"" + reason + "\"").inc(tokens);
+        }
+
+    private:
+        static int64_t now_us()
+        {
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        int sockfd;
+        int deadline_ms;
+        std::atomic<int64_t> due_us{0};
+        mutable std::atomic<bool> tripped{false};
+};
+
+#endif
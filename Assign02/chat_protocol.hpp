@@ -0,0 +1,168 @@
+/*
+** chat_protocol.hpp -- framing for token-streamed turns between AI peers
+**
+** A streamed turn is a run of frames, each [type:1][length:4, network order][payload].
+** FRAME_TOKEN carries the next piece of the reply as soon as the model produces
+** it and FRAME_END closes the turn. Anything that doesn't start with a frame
+** type byte is an unframed turn from a peer running without -s, and is handed
+** over whole, the way turns always were.
+**
+** A peer may open with FRAME_SESSION naming its conversation, so the other side
+** can pick up the stored context for it (see session_store.hpp), and with
+** FRAME_OPTION frames ("key=value") describing how it wants to be served.
+*/
+
+#ifndef CHAT_PROTOCOL_HPP
+#define CHAT_PROTOCOL_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <functional>
+#include <map>
+#include <vector>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define FRAME_HEADER_LEN 5
+#define MAX_FRAME_LEN 65536 // anything bigger is a protocol error
+#define FRAME_RECV_LEN 4096
+
+enum frame_type : uint8_t { FRAME_TOKEN = 0x01, FRAME_END = 0x02, FRAME_SESSION = 0x03, FRAME_OPTION = 0x04 };
+
+inline bool is_frame_type(uint8_t type) { return type >= FRAME_TOKEN && type <= FRAME_OPTION; }
+
+// One frame, ready to send
+inline std::string encode_frame(frame_type type, const std::string& payload)
+{
+    uint32_t length = htonl(payload.length());
+    std::string frame(1, (char)type);
+    frame.append((const char*)&length, sizeof length);
+    frame += payload;
+    return frame;
+}
+
+// Sends one frame. Returns false if the peer is gone
+inline bool send_frame(int sockfd, frame_type type, const std::string& payload)
+{
+    std::string frame = encode_frame(type, payload);
+
+    size_t sent = 0;
+    while (sent < frame.length()) {
+        ssize_t n = send(sockfd, frame.data() + sent, frame.length() - sent, MSG_NOSIGNAL);
+        if (n == -1) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Splits received bytes into turns, framed or not, without doing any I/O itself
+class turn_parser {
+    public:
+        // Appends bytes from one recv(). An unframed turn is whatever a single recv() returned.
+        void feed(const char* data, size_t length)
+        {
+            if (!in_frames && buffer.empty() && length > 0 && !is_frame_type(data[0])) {
+                unframed.emplace_back(data, length);
+                return;
+            }
+            buffer.append(data, length);
+        }
+
+        // 1 if a whole turn was moved into `turn`, 0 if more bytes are needed, -1 on a bad frame.
+        // Each piece is passed to on_chunk as it's parsed (an unframed turn is one piece).
+        int next(std::string& turn, const std::function<void(const std::string&)>& on_chunk = nullptr)
+        {
+            if (!unframed.empty() && !in_frames) {
+                turn.swap(unframed.front());
+                unframed.erase(unframed.begin());
+                if (on_chunk) on_chunk(turn);
+                return 1;
+            }
+
+            while (buffer.length() >= FRAME_HEADER_LEN) {
+                uint8_t type = buffer[0];
+                uint32_t length;
+                memcpy(&length, buffer.data() + 1, sizeof length);
+                length = ntohl(length);
+                if (length > MAX_FRAME_LEN || !is_frame_type(type)) return -1;
+                if (buffer.length() < FRAME_HEADER_LEN + length) return 0;
+
+                std::string payload = buffer.substr(FRAME_HEADER_LEN, length);
+                buffer.erase(0, FRAME_HEADER_LEN + length);
+
+                if (type == FRAME_SESSION || type == FRAME_OPTION) {
+                    if (type == FRAME_SESSION) session_id = payload;
+                    else if (payload.find('=') != std::string::npos) options[payload.substr(0, payload.find('='))] = payload.substr(payload.find('=') + 1);
+                    // An unframed peer's first turn can arrive in the same recv()
+                    if (!in_frames && !buffer.empty() && !is_frame_type(buffer[0])) {
+                        unframed.insert(unframed.begin(), buffer);
+                        buffer.clear();
+                        return next(turn, on_chunk);
+                    }
+                    continue;
+                }
+
+                if (type == FRAME_END) {
+                    turn.swap(partial);
+                    partial.clear();
+                    in_frames = false;
+                    return 1;
+                }
+                in_frames = true;
+                partial += payload;
+                if (on_chunk) on_chunk(payload);
+            }
+            return 0;
+        }
+
+        // The conversation id the peer sent, if any
+        const std::string& session() const { return session_id; }
+
+        // An option the peer set, or fallback
+        std::string option(const std::string& key, const std::string& fallback = "") const
+        {
+            auto it = options.find(key);
+            return it == options.end() ? fallback : it->second;
+        }
+
+    private:
+        std::string buffer; // frames received but not yet parsed
+        std::string session_id;
+        std::map<std::string, std::string> options;
+        std::string partial; // the framed turn so far
+        std::vector<std::string> unframed; // whole unframed turns, oldest first
+        bool in_frames = false;
+};
+
+// Reads whole turns off a blocking socket
+class turn_reader {
+    public:
+        turn_reader(int sockfd): sockfd(sockfd) {}
+
+        // Blocks until the peer's next turn is complete. Each piece is passed to on_chunk as it
+        // arrives. Returns false on disconnect or a bad frame.
+        bool read_turn(std::string& turn, const std::function<void(const std::string&)>& on_chunk = nullptr)
+        {
+            turn.clear();
+            while (true) {
+                int got = parser.next(turn, on_chunk);
+                if (got != 0) return got == 1;
+
+                char chunk[FRAME_RECV_LEN];
+                ssize_t n = recv(sockfd, chunk, sizeof chunk, 0);
+                if (n < 1) return false;
+                parser.feed(chunk, n);
+            }
+        }
+
+        const std::string& session() const { return parser.session(); }
+        std::string option(const std::string& key, const std::string& fallback = "") const { return parser.option(key, fallback); }
+
+    private:
+        int sockfd;
+        turn_parser parser;
+};
+
+#endif
@@ -0,0 +1,152 @@
+/*
+** context_window.hpp -- bounded conversation context
+**
+** Passing last_response back into generate() ships the whole context token
+** array every turn, so requests and prompt evaluation keep growing for as long
+** as the conversation runs. A context_window builds each prompt from text
+** instead: a summary of the early conversation followed by as many recent turns
+** as fit in the token budget.
+**
+** Turns that slide out of the window are folded into the summary by a
+** background generation. The turn that pushed them out doesn't wait for it;
+** until the new summary lands, the prompt just goes without those turns.
+**
+** Token counts are estimated at four bytes per token.
+*/
+
+#ifndef CONTEXT_WINDOW_HPP
+#define CONTEXT_WINDOW_HPP
+
+#include <stdio.h>
+#include <deque>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "ollama.hpp"
+#include "metrics.hpp"
+#include "backends.hpp"
+
+class context_window: public std::enable_shared_from_this<context_window> {
+    public:
+        // Runs a job off the conversation's critical path
+        using executor = std::function<void(std::function<void()>)>;
+
+        // Create with std::make_shared; summaries keep the window alive until they finish
+        context_window(backends::pool& pool, const std::string& model, size_t token_budget, executor background = nullptr):
+            pool(pool), model(model), budget(token_budget), summary_budget(token_budget / 4), background(background),
+            prompt_tokens("context_prompt_tokens"), summaries("context_summaries_total"), summary_ms("context_summary_ms")
+        {
+            if (!this->background) this->background = [](std::function<void()> job) { std::thread(job).detach(); };
+        }
+
+        static size_t tokens(const std::string& text) { return (text.length() + 3) / 4; }
+
+        // Records the peer's turn and returns the prompt to answer it with
+        std::string prompt_for(const std::string& peer_turn)
+        {
+            std::lock_guard<std::mutex> hold(lock);
+            push(false, peer_turn);
+            std::string prompt = render();
+            prompt_tokens.observe(tokens(prompt));
+            return prompt;
+        }
+
+        // The prompt prompt_for(peer_turn) would return if nothing slid out of the window, without
+        // recording the turn: for speculating on a turn that's still arriving
+        std::string preview(const std::string& peer_turn)
+        {
+            std::lock_guard<std::mutex> hold(lock);
+            return render() + "Them: " + peer_turn + "\n";
+        }
+
+        void add_reply(const std::string& reply)
+        {
+            std::lock_guard<std::mutex> hold(lock);
+            push(true, reply);
+        }
+
+    private:
+        struct turn {
+            bool ours;
+            std::string text;
+        };
+
+        // Caller holds lock
+        std::string render() const
+        {
+            std::string prompt;
+            if (!summary.empty()) prompt = "[Earlier in this conversation: " + summary + "]\n\n";
+            for (const turn& t : window) prompt += (t.ours ? "You: " : "Them: ") + t.text + "\n";
+            return prompt;
+        }
+
+        // Caller holds lock
+        void push(bool ours, const std::string& text)
+        {
+            window.push_back(turn{ours, text});
+            window_tokens += tokens(text);
+
+            size_t room = budget > tokens(summary) ? budget - tokens(summary) : 0;
+            while (window.size() > 1 && window_tokens > room) {
+                window_tokens -= tokens(window.front().text);
+                evicted.push_back(std::move(window.front()));
+                window.pop_front();
+            }
+            summarize();
+        }
+
+        // Folds evicted turns into the summary, one background job at a time. Caller holds lock.
+        void summarize()
+        {
+            if (summarizing || evicted.empty()) return;
+            summarizing = true;
+
+            std::string request = "Summarize this conversation in at most " + std::to_string(summary_budget * 3 / 4) +
+                                  " words. Keep names, facts, commitments and open questions.\n\n";
+            if (!summary.empty()) request += "Summary so far: " + summary + "\n\n";
+            for (const turn& t : evicted) request += (t.ours ? "You: " : "Them: ") + t.text + "\n";
+            size_t folded = evicted.size();
+
+            std::shared_ptr<context_window> self = shared_from_this();
+            background([self, request, folded]() {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                std::string result;
+                ollama::options options;
+                options["num_predict"] = (int)self->summary_budget;
+                if (!self->pool.run(self->model, -1, [&](Ollama& backend) { result = backend.generate(self->model, request, options).as_simple_string(); }, nullptr))
+                    fprintf(stderr, "context summary failed\n");
+                self->summary_ms.observe(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+
+                std::lock_guard<std::mutex> hold(self->lock);
+                if (!result.empty()) {
+                    self->summary = result;
+                    self->summaries.inc();
+                }
+                // On failure the turns are dropped rather than retried forever
+                self->evicted.erase(self->evicted.begin(), self->evicted.begin() + folded);
+                self->summarizing = false;
+                self->summarize();
+            });
+        }
+
+        backends::pool& pool; // must outlive the window
+        std::string model;
+        size_t budget, summary_budget;
+        executor background;
+
+        std::mutex lock;
+        std::deque<turn> window; // the most recent turns, verbatim
+        size_t window_tokens = 0;
+        std::deque<turn> evicted; // out of the window, not yet in the summary
+        std::string summary;
+        bool summarizing = false;
+
+        metrics::histogram prompt_tokens;
+        metrics::counter summaries;
+        metrics::histogram summary_ms;
+};
+
+#endif
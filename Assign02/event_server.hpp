@@ -0,0 +1,485 @@
+/*
+** event_server.hpp -- every AI conversation in one process
+**
+** The fork-per-connection server gives each conversation a process, an Ollama
+** client and an HTTP connection of its own. Here a conversation is a small
+** state object instead: one epoll loop owns every socket, parses turns and
+** applies pacing with timers, and hands generations to a fixed pool of worker
+** threads. Workers send generations through the shared backend pool (see
+** backends.hpp) and post each reply piece back to the loop through an eventfd.
+**
+**   server -e 8          8 generation workers
+*/
+
+#ifndef EVENT_SERVER_HPP
+#define EVENT_SERVER_HPP
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "ollama.hpp"
+#include "probes.hpp"
+#include "chat_protocol.hpp"
+#include "pacing.hpp"
+#include "metrics.hpp"
+#include "context_window.hpp"
+#include "session_store.hpp"
+#include "scheduler.hpp"
+#include "response_cache.hpp"
+#include "semantic_cache.hpp"
+#include "residency.hpp"
+#include "backends.hpp"
+#include "worker_pool.hpp"
+#include "cancellation.hpp"
+#include "telemetry.hpp"
+#include "tracing.hpp"
+
+namespace relay
+{
+    using clock = pacing::clock;
+
+    struct options {
+        std::string opening; // sent to every new conversation
+        std::string model = "llama3.2";
+        std::string pacing_spec = "none";
+        bool stream = false;
+        int workers = 4;
+        int context_budget = 0; // tokens; 0 sends the session's stored context every turn
+        std::string session_dir; // where sessions are saved; empty keeps them in memory
+        int concurrency = 0; // generations at once on each backend, queued fairly; 0 leaves it to the workers
+        sched::admission admission; // how far to believe the classes and weights conversations ask for
+        nlohmann::json options; // generation options (see response_cache::parse_options); null for the model's defaults
+        int cache_entries = 0; // deterministic replies replayed from memory
+        std::string cache_dir; // and from here
+        double replay_speed = 1;
+        std::string semantic_spec; // semantic cache settings (see semantic::cache::parse); empty for none
+        std::string hedge_spec; // hedging settings (see hedging::parse); empty for none
+        int deadline_ms = 0; // per turn, from when its generation is started; 0 for none
+        std::string persona = "default"; // telemetry's name for our side of every conversation
+        bool verbose = false;
+    };
+
+    // A piece of a reply, produced by a worker and written out by the loop
+    struct output {
+        int conversation;
+        std::string bytes;
+        clock::time_point release_at; // pacing holds it back until then
+        bool end = false; // last piece of the turn
+        bool failed = false; // the backend request failed; drop the conversation
+        clock::duration paced = clock::duration::zero(); // time pacing added after generation finished
+    };
+
+    struct conversation {
+        enum { IDLE, PACING, GENERATING } state = IDLE;
+        int id;
+        int fd;
+        int turn = 0;
+        turn_parser parser;
+        std::deque<std::string> inbox; // peer turns not answered yet
+        std::deque<output> held; // produced, waiting for their release time
+        std::string outbuf; // released, not yet accepted by the socket
+        bool want_write = false;
+        std::string session_id; // the peer's name for the conversation, or ours
+        std::shared_ptr<pacing::policy> pacer;
+        std::shared_ptr<context_window> window; // null without a context budget
+        clock::time_point generate_at;
+        std::shared_ptr<cancel_token> cancel; // tripped when the conversation closes or a turn runs out of time
+    };
+
+    class event_server {
+        public:
+            // backends (already health-checked) and residency (may be null) must outlive the server
+            event_server(int listener, const options& opts, backends::pool& backends, model_residency* residency):
+                listener(listener), opts(opts), backends(backends), residency(residency), sessions(opts.session_dir),
+                cache(opts.cache_entries, opts.cache_dir, opts.replay_speed), hedger(hedging::make(opts.hedge_spec, opts.deadline_ms > 0)),
+                semantic(opts.semantic_spec.empty() ? nullptr : semantic::cache::make(backends, opts.model, opts.semantic_spec)),
+                scheduler(opts.concurrency > 0 ? sched::scheduler::create(backends.size(), opts.concurrency, false) : nullptr),
+                active("conversations_active"), turns("turns_total"), generation_ms("generation_ms"), workers(opts.workers)
+            {
+                if (hedger) hedger->limit(scheduler);
+                cache.hedge(hedger.get());
+            }
+
+            // Runs the loop; only returns if epoll itself fails
+            void run()
+            {
+                epfd = epoll_create1(0);
+                wakefd = eventfd(0, EFD_NONBLOCK);
+                if (epfd == -1 || wakefd == -1) { perror("event_server: epoll/eventfd"); return; }
+                fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+                watch(listener, LISTENER, EPOLLIN, EPOLL_CTL_ADD);
+                watch(wakefd, WAKE, EPOLLIN, EPOLL_CTL_ADD);
+
+                struct epoll_event events[64];
+                while (true) {
+                    int n = epoll_wait(epfd, events, 64, next_timeout_ms());
+                    if (n == -1 && errno != EINTR) { perror("epoll_wait"); return; }
+
+                    for (int i = 0; i < n; i++) {
+                        uint64_t key = events[i].data.u64;
+                        if (key == LISTENER) accept_all();
+                        else if (key == WAKE) collect_outputs();
+                        else on_socket((int)key, events[i].events);
+                    }
+                    run_timers();
+                }
+            }
+
+        private:
+            static const uint64_t LISTENER = 0, WAKE = 1;
+
+            void watch(int fd, uint64_t key, uint32_t events, int op)
+            {
+                struct epoll_event ev;
+                ev.events = events;
+                ev.data.u64 = key;
+                if (epoll_ctl(epfd, op, fd, &ev) == -1) perror("epoll_ctl");
+            }
+
+            conversation* find(int id)
+            {
+                auto it = conversations.find(id);
+                return it == conversations.end() ? nullptr : it->second.get();
+            }
+
+            void accept_all()
+            {
+                while (true) {
+                    struct sockaddr_storage their_addr;
+                    socklen_t sin_size = sizeof their_addr;
+                    int fd = accept4(listener, (struct sockaddr *)&their_addr, &sin_size, SOCK_NONBLOCK);
+                    if (fd == -1) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+                        return;
+                    }
+
+                    char s[INET6_ADDRSTRLEN];
+                    void* addr = their_addr.ss_family == AF_INET ? (void*)&((struct sockaddr_in*)&their_addr)->sin_addr
+                                                                 : (void*)&((struct sockaddr_in6*)&their_addr)->sin6_addr;
+                    inet_ntop(their_addr.ss_family, addr, s, sizeof s);
+                    printf("server: got connection from %s\n", s);
+
+                    // Tokens go out one small frame at a time; don't let Nagle hold them back
+                    int yes = 1;
+                    if (opts.stream && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) == -1)
+                        perror("setsockopt TCP_NODELAY");
+
+                    std::unique_ptr<conversation> c(new conversation());
+                    c->id = next_id++;
+                    c->fd = fd;
+                    c->session_id = "conv-" + std::to_string(getpid()) + "-" + std::to_string(c->id);
+                    c->pacer.reset(pacing::make(opts.pacing_spec).release());
+                    if (opts.context_budget > 0) {
+                        // Summaries share the generation workers
+                        c->window = std::make_shared<context_window>(backends, opts.model, opts.context_budget,
+                            [this](std::function<void()> job) { workers.submit(job); });
+                    }
+                    c->cancel = std::make_shared<cancel_token>(-1, opts.deadline_ms);
+                    c->outbuf = opts.opening;
+                    int id = c->id;
+                    conversations[id] = std::move(c);
+                    active.add(1);
+                    watch(fd, id, EPOLLIN, EPOLL_CTL_ADD);
+                    flush(id);
+                }
+            }
+
+            void close_conversation(int id)
+            {
+                conversation* c = find(id);
+                if (!c) return;
+                if (opts.verbose) printf("[conv %d] closed\n", id);
+                epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+                close(c->fd);
+                sessions.forget(c->session_id); // saved copy (if any) stays for a reconnect
+                c->cancel->cancel(); // a generation still running for it stops at its next token
+                conversations.erase(id);
+                active.add(-1);
+            }
+
+            // Writes as much of outbuf as the socket takes. Returns false if the conversation was closed.
+            bool flush(int id)
+            {
+                conversation* c = find(id);
+                if (!c) return false;
+
+                size_t sent = 0;
+                while (sent < c->outbuf.length()) {
+                    ssize_t n = send(c->fd, c->outbuf.data() + sent, c->outbuf.length() - sent, MSG_NOSIGNAL);
+                    if (n == -1) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                        close_conversation(id);
+                        return false;
+                    }
+                    sent += n;
+                }
+                c->outbuf.erase(0, sent);
+
+                bool want_write = !c->outbuf.empty();
+                if (want_write != c->want_write) {
+                    c->want_write = want_write;
+                    watch(c->fd, id, want_write ? EPOLLIN | EPOLLOUT : EPOLLIN, EPOLL_CTL_MOD);
+                }
+                return true;
+            }
+
+            void on_socket(int id, uint32_t events)
+            {
+                if (events & EPOLLOUT && !flush(id)) return;
+                if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+
+                conversation* c = find(id);
+                if (!c) return;
+                while (true) {
+                    char chunk[FRAME_RECV_LEN];
+                    ssize_t n = recv(c->fd, chunk, sizeof chunk, 0);
+                    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                    if (n < 1) {
+                        if (n == -1 && opts.verbose) perror("Failed to recieve message from client");
+                        close_conversation(id);
+                        return;
+                    }
+                    c->parser.feed(chunk, n);
+                }
+
+                std::string turn;
+                int got;
+                while ((got = c->parser.next(turn)) == 1) {
+                    if (opts.verbose) printf("[conv %d] CLIENT: %s\n", id, turn.c_str());
+                    c->inbox.push_back(std::move(turn));
+                    turn.clear();
+                }
+                if (got == -1) { close_conversation(id); return; }
+                if (!c->parser.session().empty() && c->session_id != c->parser.session())
+                    sessions.restore(c->session_id = c->parser.session()); // the peer named its conversation
+                start_turn(c);
+            }
+
+            // Starts pacing the reply to the oldest unanswered turn, if we're not busy
+            void start_turn(conversation* c)
+            {
+                if (c->state != conversation::IDLE || c->inbox.empty()) return;
+
+                clock::duration d = c->pacer->generate_delay();
+                c->pacer->add_delay(d);
+                c->state = conversation::PACING;
+                c->generate_at = clock::now() + d;
+                if (d > clock::duration::zero()) timers.emplace(c->generate_at, c->id);
+                else start_generation(c);
+            }
+
+            void start_generation(conversation* c)
+            {
+                c->state = conversation::GENERATING;
+                std::string prompt = std::move(c->inbox.front());
+                c->inbox.pop_front();
+                int id = c->id, turn = ++c->turn;
+                std::shared_ptr<pacing::policy> pacer = c->pacer;
+                std::shared_ptr<context_window> window = c->window;
+                std::shared_ptr<cancel_token> cancel = c->cancel;
+                cancel->start_turn(); // queueing for a worker counts against the deadline
+                turns.inc();
+
+                std::string session_id = c->session_id;
+                sched::priority priority = opts.admission.class_for(c->parser.option("priority"));
+                double weight = opts.admission.weight_for(c->parser.option("weight"));
+
+                workers.submit([this, id, turn, prompt, session_id, pacer, window, priority, weight, cancel]() {
+                    generate(id, turn, prompt, session_id, *pacer, window.get(), priority, weight, *cancel);
+                });
+            }
+
+            // Runs on a worker: streams the reply back to the loop piece by piece. With a context window
+            // the prompt carries the conversation; otherwise the session's stored context does.
+            void generate(int id, int turn, const std::string& peer_turn, const std::string& session_id, pacing::policy& pacer, context_window* window,
+                          sched::priority priority, double weight, const cancel_token& cancel)
+            {
+                if (cancel.hung_up()) { cancel_token::count("disconnect", 0); return; } // left while queued for a worker
+                trace::turn_scope traced(id, turn);
+                trace::span whole("generate");
+                clock::time_point start = clock::now(), release = start;
+                std::string reply;
+                int tokens = 0;
+                output last;
+                last.conversation = id;
+                last.end = true;
+
+                ollama::response final_chunk;
+                std::function<void(const ollama::response&)> on_token = [&](const ollama::response& token) {
+                    if (tokens++ == 0) OLLAMA_PROBE2(first_token, id, turn);
+                    const std::string& piece = token.as_simple_string();
+                    reply += piece;
+                    if (token.as_json().value("done", false)) final_chunk = token;
+
+                    if (opts.stream && !piece.empty()) {
+                        release = std::max(release, clock::now() + pacer.send_delay(reply.length(), start));
+                        post(output{id, encode_frame(FRAME_TOKEN, piece), release});
+                    }
+                };
+
+                OLLAMA_PROBE3(generate_start, id, turn, peer_turn.length());
+                trace::span serialized("serialize");
+                std::string prompt = window ? window->prompt_for(peer_turn) : peer_turn;
+                std::string request = window ? ollama::request(opts.model, prompt, opts.options, true).dump()
+                                             : sessions.build_request(session_id, opts.model, prompt, opts.options);
+                std::string cache_key = cache.key_for(opts.model, prompt, opts.options, window ? 0 : sessions.context_hash(session_id));
+                serialized.count(request.length());
+                serialized.end();
+                // Cache hits don't queue for a backend
+                last.failed = !cache.replay(cache_key, on_token);
+                semantic::cache::probe probe;
+                if (last.failed && semantic) last.failed = !semantic->replay(session_id, peer_turn, on_token, probe);
+                if (last.failed) {
+                    if (residency) residency->touch();
+                    trace::span queued("queue");
+                    sched::scheduler::slot slot(scheduler, id, priority, weight, cancel.check());
+                    queued.end();
+                    last.failed = slot.dropped() ||
+                                  !cache.run(backends, opts.model, slot.backend, cache_key, request, on_token, [&]() { return tokens > 0; }, cancel.keep_going());
+                    if (!last.failed && !cancel.cancelled() && semantic) semantic->record(probe, peer_turn, reply);
+                    if (!last.failed && !cancel.cancelled()) {
+                        model_residency::count_turn(final_chunk);
+                        telemetry::record(final_chunk, opts.persona, backends::last_used());
+                    }
+                }
+                // Nobody to send it to; the loop has already forgotten the conversation
+                if (cancel.hung_up()) {
+                    cancel_token::count("disconnect", tokens);
+                    if (opts.verbose) printf("[conv %d] cancelled after %d tokens\n", id, tokens);
+                    return;
+                }
+                // Out of time: the peer gets what there is; with nothing, the turn failed
+                if (cancel.expired()) {
+                    cancel_token::count("deadline", tokens);
+                    fprintf(stderr, "[conv %d] ran past its %d ms deadline; cut off after %d tokens\n", id, cancel.deadline(), tokens);
+                    if (tokens == 0) last.failed = true;
+                }
+                if (last.failed) fprintf(stderr, "[conv %d] generation failed\n", id);
+                OLLAMA_PROBE4(generate_end, id, turn, reply.length(), tokens);
+                if (window && !last.failed) window->add_reply(reply);
+                if (!window && !last.failed) sessions.update(session_id, final_chunk);
+
+                clock::time_point done = clock::now();
+                generation_ms.observe(std::chrono::duration<double, std::milli>(done - start).count());
+                if (!opts.stream) release = done + pacer.send_delay(reply.length(), start);
+                last.release_at = std::max(release, done);
+                last.paced = last.release_at - done;
+                last.bytes = opts.stream ? encode_frame(FRAME_END, "") : reply;
+                if (opts.verbose) printf("[conv %d] SERVER: %s\n", id, reply.c_str());
+                post(std::move(last));
+            }
+
+            // Hands a reply piece to the loop (any thread)
+            void post(output&& piece)
+            {
+                {
+                    std::lock_guard<std::mutex> hold(outputs_lock);
+                    outputs.push_back(std::move(piece));
+                }
+                uint64_t one = 1;
+                if (write(wakefd, &one, sizeof one) == -1 && errno != EAGAIN) perror("eventfd write");
+            }
+
+            void collect_outputs()
+            {
+                uint64_t count;
+                if (read(wakefd, &count, sizeof count) == -1 && errno != EAGAIN) perror("eventfd read");
+
+                std::vector<output> ready;
+                {
+                    std::lock_guard<std::mutex> hold(outputs_lock);
+                    ready.swap(outputs);
+                }
+                for (output& piece : ready) {
+                    conversation* c = find(piece.conversation);
+                    if (!c) continue; // peer left while we were generating
+                    if (!c->held.empty()) piece.release_at = std::max(piece.release_at, c->held.back().release_at);
+                    c->held.push_back(std::move(piece));
+                    release_held(c->id);
+                }
+            }
+
+            // Moves held pieces whose time has come into outbuf
+            void release_held(int id)
+            {
+                conversation* c = find(id);
+                clock::time_point now = clock::now();
+                while (c && !c->held.empty() && c->held.front().release_at <= now) {
+                    output piece = std::move(c->held.front());
+                    c->held.pop_front();
+                    if (piece.failed) { close_conversation(id); return; }
+
+                    c->outbuf += piece.bytes;
+                    if (piece.end) {
+                        c->pacer->add_delay(piece.paced);
+                        c->pacer->turn_done();
+                        c->state = conversation::IDLE;
+                    }
+                }
+                if (!flush(id)) return;
+                if (!c->held.empty()) timers.emplace(c->held.front().release_at, id);
+                else start_turn(c);
+            }
+
+            int next_timeout_ms()
+            {
+                if (timers.empty()) return -1;
+                auto wait = timers.begin()->first - clock::now();
+                if (wait <= clock::duration::zero()) return 0;
+                return (int)std::chrono::duration_cast<std::chrono::milliseconds>(wait).count() + 1;
+            }
+
+            void run_timers()
+            {
+                clock::time_point now = clock::now();
+                while (!timers.empty() && timers.begin()->first <= now) {
+                    int id = timers.begin()->second;
+                    timers.erase(timers.begin());
+
+                    conversation* c = find(id);
+                    if (!c) continue;
+                    if (c->state == conversation::PACING && c->generate_at <= now) start_generation(c);
+                    else release_held(id);
+                }
+            }
+
+            int listener, epfd = -1, wakefd = -1;
+            int next_id = 2; // 0 and 1 are the listener and wake keys
+            options opts;
+            backends::pool& backends;
+            model_residency* residency;
+            session_store sessions;
+            response_cache cache;
+            std::unique_ptr<hedging::hedger> hedger; // null without a hedge spec or deadlines
+            std::unique_ptr<semantic::cache> semantic; // shared by every conversation, each matching only its own turns
+            sched::scheduler* scheduler; // null without a concurrency limit; lives as long as the process
+            std::unordered_map<int, std::unique_ptr<conversation>> conversations;
+            std::multimap<clock::time_point, int> timers; // stale entries are skipped
+            std::mutex outputs_lock;
+            std::vector<output> outputs;
+            metrics::gauge active;
+            metrics::counter turns;
+            metrics::histogram generation_ms;
+            worker_pool workers; // last, so it's joined before anything its jobs touch goes away
+    };
+}
+
+#endif
@@ -0,0 +1,264 @@
+/*
+** hedging.hpp -- a second backend for requests that are slow to start
+**
+** When one backend stalls, a turn waits on it until the client's read timeout
+** (120 s) runs out. A hedger runs a streaming generation the way
+** backends::pool::run does, but if no token has come back by the time most
+** requests have produced their first one -- the `quantile` of
+** generation_ttft_ms, which every conversation process feeds -- it sends the
+** same request to a second backend too. Whichever streams first gives the
+** reply and the other is dropped. Under a concurrency limit (-c) the hedge
+** needs a scheduler slot of its own, taken only if one is free right then,
+** and held until the hedge's request ends; with none free it's skipped
+** (hedge_skipped_total). A request that fails before streaming
+** anything moves on to the next backend, as with pool.run.
+**
+** The caller's keep_going (a cancel_token with a deadline, say) is polled
+** while waiting, so a stalled stream gives up when the turn runs out of time
+** rather than on the read timeout; the stuck request finishes in the
+** background. A hedger made for deadlines alone does just that, one backend
+** at a time.
+**
+** hedge_fired_total against hedge_requests_total (and hedge_fired_permille)
+** says how often it fires, hedge_wins_total how often the hedge gave the
+** reply. To say what it buys, a first backend that lost the race is watched
+** until its first token before it's dropped: generation_ttft_unhedged_ms is
+** the time to first token without hedging, and hedge_p99_saved_ms how far
+** hedging brings the p99 down from it.
+**
+**   server -H quantile=0.95,min=100 -T 30000
+*/
+
+#ifndef HEDGING_HPP
+#define HEDGING_HPP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ollama.hpp"
+#include "metrics.hpp"
+#include "backends.hpp"
+#include "scheduler.hpp"
+#include "tracing.hpp"
+
+namespace hedging
+{
+    const int COLD_SAMPLES = 20; // first tokens seen before the quantile is worth trusting
+    const int COLD_THRESHOLD_MS = 2000; // hedge after this until then
+    const int POLL_MS = 50; // how often the caller's keep_going is asked while waiting
+
+    struct settings {
+        double quantile = 0.95; // hedge a request once it's slower to start than this fraction of them
+        int min_ms = 100; // but never sooner than this
+        bool hedge = true; // false: one backend at a time, only enforcing deadlines
+    };
+
+    // "quantile=Q,min=MS", either of them. False if the spec is bad.
+    inline bool parse(const std::string& spec, settings& s)
+    {
+        size_t start = 0;
+        while (start < spec.length()) {
+            size_t comma = spec.find(',', start);
+            std::string field = spec.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+            size_t eq = field.find('=');
+            if (eq == std::string::npos) return false;
+            std::string key = field.substr(0, eq), value = field.substr(eq + 1);
+            if (key == "quantile") s.quantile = atof(value.c_str());
+            else if (key == "min") s.min_ms = atoi(value.c_str());
+            else return false;
+            if (comma == std::string::npos) break;
+            start = comma + 1;
+        }
+        return s.quantile > 0 && s.quantile < 1 && s.min_ms >= 0;
+    }
+
+    class hedger {
+        public:
+            using token_callback = std::function<void(const ollama::response&)>;
+
+            hedger(const settings& s):
+                s(s), ttft("generation_ttft_ms"), unhedged("generation_ttft_unhedged_ms"), requests("hedge_requests_total"),
+                fired("hedge_fired_total"), skipped("hedge_skipped_total"), wins("hedge_wins_total"),
+                fired_permille("hedge_fired_permille"), p99_saved_ms("hedge_p99_saved_ms") {}
+
+            // Hedges take their own slot from s, when it has one free (null: no limit to keep)
+            void limit(sched::scheduler* s) { scheduler = s; }
+
+            // How long a request gets to produce its first token before it's hedged
+            double threshold_ms() const
+            {
+                if (ttft.count() < COLD_SAMPLES) return COLD_THRESHOLD_MS;
+                return std::max((double)s.min_ms, ttft.quantile(s.quantile));
+            }
+
+            // Generates request (streaming) into on_token, from one backend only. keep_going as for
+            // generate_serialized. False if it couldn't be completed anywhere.
+            bool run(backends::pool& pool, const std::string& model, int preferred, const std::string& request,
+                     const token_callback& on_token, const std::function<bool()>& keep_going = nullptr)
+            {
+                std::shared_ptr<race> r = std::make_shared<race>(*this);
+                r->request = request;
+                r->on_token = on_token;
+                r->keep_going = keep_going;
+                r->start = clock::now();
+                clock::time_point hedge_at = r->start + std::chrono::microseconds((int64_t)(threshold_ms() * 1000));
+                if (s.hedge) requests.inc();
+
+                std::unique_lock<std::mutex> hold(r->lock);
+                launch(pool, model, preferred, r);
+                bool hedged = false, stopped = false;
+                int hedge = -1; // the attempt that hedged, if one did
+                while (true) {
+                    if (r->winner >= 0 && r->attempts[r->winner].done) break;
+                    if (r->winner < 0 && r->running == 0) {
+                        // Everything so far failed before streaming: on to a backend we haven't tried
+                        if (!launch(pool, model, -1, r)) break;
+                        continue;
+                    }
+                    if (keep_going && !keep_going()) { stopped = true; break; }
+                    if (s.hedge && r->winner < 0 && !hedged && clock::now() >= hedge_at) {
+                        hedged = true;
+                        std::shared_ptr<sched::scheduler::slot> extra;
+                        if (scheduler) extra = std::make_shared<sched::scheduler::slot>(scheduler, r->tried);
+                        if (extra && extra->dropped()) skipped.inc(); // every backend is busy enough already
+                        else if (launch(pool, model, extra ? extra->backend : -1, r, extra)) {
+                            hedge = r->attempts.size() - 1;
+                            fired.inc();
+                        }
+                    }
+                    clock::time_point wake = clock::now() + std::chrono::milliseconds(POLL_MS);
+                    r->changed.wait_until(hold, hedged ? wake : std::min(wake, hedge_at));
+                }
+                r->abandoned = true; // attempts still running never call back into the caller from here on
+
+                int winner = r->winner;
+                if (winner >= 0) backends::last_used() = backends::label(r->attempts[winner].backend);
+                if (winner >= 0 && winner == hedge) wins.inc();
+                if (s.hedge) fired_permille.set(fired.value() * 1000 / std::max<int64_t>(1, requests.value()));
+                if (winner >= 0 && r->attempts[winner].done) return !r->attempts[winner].failed;
+                return stopped;
+            }
+
+        private:
+            using clock = std::chrono::steady_clock;
+
+            struct attempt {
+                int backend;
+                bool first = false; // has produced a token
+                bool done = false, failed = false;
+            };
+
+            // One request's attempts, shared with their threads, which can outlive run()
+            struct race {
+                race(hedger& h): ttft(h.ttft), unhedged(h.unhedged), p99_saved_ms(h.p99_saved_ms) {}
+
+                std::string request;
+                token_callback on_token;
+                std::function<bool()> keep_going;
+                clock::time_point start;
+
+                std::mutex lock;
+                std::condition_variable changed;
+                std::vector<attempt> attempts; // [0] is the backend the request would have gone to anyway
+                unsigned tried = 0; // backends, as a bit set
+                int running = 0;
+                int winner = -1; // the attempt giving the reply
+                bool abandoned = false; // run() has returned
+
+                metrics::histogram ttft, unhedged;
+                metrics::gauge p99_saved_ms;
+
+                double ms() const { return std::chrono::duration<double, std::milli>(clock::now() - start).count(); }
+                void saved() { p99_saved_ms.set((int64_t)(unhedged.quantile(0.99) - ttft.quantile(0.99))); }
+            };
+
+            // Starts another attempt on a backend the race hasn't used, holding extra (if any) until it
+            // ends. False if there's none. Holds r->lock.
+            static bool launch(backends::pool& pool, const std::string& model, int preferred, const std::shared_ptr<race>& r,
+                               const std::shared_ptr<sched::scheduler::slot>& extra = nullptr)
+            {
+                std::shared_ptr<backends::pool::lease> backend = std::make_shared<backends::pool::lease>(pool, model, preferred, r->tried);
+                if (r->tried & (1u << backend->index)) return false;
+                r->tried |= 1u << backend->index;
+                int n = r->attempts.size();
+                r->attempts.push_back(attempt());
+                r->attempts.back().backend = backend->index;
+                r->running++;
+                trace::context traced = trace::current(); // the attempt's spans belong to the caller's turn
+                std::thread([r, n, backend, traced, extra]() {
+                    trace::turn_scope scope(traced);
+                    contend(r, n, *backend);
+                }).detach();
+                return true;
+            }
+
+            static void contend(const std::shared_ptr<race>& r, int n, backends::pool::lease& backend)
+            {
+                bool failed = false;
+                try {
+                    trace::generate(*backend.operator->(), r->request, [&](const ollama::response& token) {
+                        std::lock_guard<std::mutex> hold(r->lock);
+                        attempt& a = r->attempts[n];
+                        if (!a.first) {
+                            a.first = true;
+                            double ms = r->ms();
+                            if (r->winner < 0) {
+                                r->winner = n;
+                                r->ttft.observe(ms);
+                                if (r->attempts[0].failed) r->unhedged.observe(ms); // no hedging would have failed over too
+                                r->changed.notify_all();
+                            }
+                            if (n == 0) r->unhedged.observe(ms);
+                            r->saved();
+                        }
+                        if (r->winner == n && !r->abandoned) r->on_token(token);
+                    }, [&]() {
+                        std::lock_guard<std::mutex> hold(r->lock);
+                        // Lost the race: dropped, though the first backend only once it's shown how long it would have taken
+                        if (r->winner >= 0 && r->winner != n) return n == 0 && !r->attempts[0].first;
+                        if (r->abandoned) return false;
+                        return !r->keep_going || r->keep_going();
+                    });
+                }
+                catch (const ollama::exception& e) {
+                    fprintf(stderr, "hedging: %s: %s\n", backend.p.url(backend.index), e.what());
+                    backend.failed();
+                    failed = true;
+                }
+
+                std::lock_guard<std::mutex> hold(r->lock);
+                attempt& a = r->attempts[n];
+                a.done = true;
+                a.failed = failed;
+                r->running--;
+                r->changed.notify_all();
+            }
+
+            settings s;
+            sched::scheduler* scheduler = nullptr;
+            metrics::histogram ttft, unhedged;
+            metrics::counter requests, fired, skipped, wins;
+            metrics::gauge fired_permille, p99_saved_ms;
+    };
+
+    // A hedger from a spec as parse() takes it; null if it's bad. An empty spec makes one that doesn't
+    // hedge if there are deadlines to keep, and none otherwise.
+    inline std::unique_ptr<hedger> make(const std::string& spec, bool deadlines = false)
+    {
+        settings s;
+        if (spec.empty() && !deadlines) return nullptr;
+        if (spec.empty()) s.hedge = false;
+        else if (!parse(spec, s)) return nullptr;
+        return std::unique_ptr<hedger>(new hedger(s));
+    }
+}
+
+#endif
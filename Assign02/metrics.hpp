@@ -0,0 +1,207 @@
+/*
+** metrics.hpp -- counters, gauges and histograms with a Prometheus text endpoint
+**
+** The registry is a fixed table in one MAP_SHARED anonymous mapping. Call
+** metrics::init_shared() before the server starts forking and every
+** conversation process updates the same numbers, which the parent serves on
+** /metrics. Without it each process just gets a private registry.
+**
+** Metrics are found by name + labels on first use; keep the returned handle
+** around instead of looking it up every time.
+**
+**   static metrics::histogram delay("pacing_delay_ms", "policy=\"typing\"");
+**   delay.observe(12.5);
+*/
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <new>
+#include "ollama.hpp"
+
+namespace metrics
+{
+    const int MAX_METRICS = 512;
+    const int NAME_LEN = 64;
+    const int LABELS_LEN = 128;
+
+    // Histogram bucket upper bounds: 1-2.5-5 steps from 0.1 to 1e6 (+Inf is implied)
+    const double BOUNDS[] = { 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000,
+                              10000, 25000, 50000, 100000, 250000, 500000, 1000000 };
+    const int BUCKETS = sizeof(BOUNDS) / sizeof(BOUNDS[0]) + 1;
+
+    enum class kind : int { counter, gauge, histogram };
+
+    struct metric {
+        char name[NAME_LEN];
+        char labels[LABELS_LEN];
+        kind type;
+        std::atomic<int64_t> value; // counter/gauge value, histogram observation count
+        std::atomic<int64_t> sum_micros; // histogram sum, in millionths
+        std::atomic<int64_t> buckets[BUCKETS];
+    };
+
+    struct registry {
+        std::atomic_flag lock = ATOMIC_FLAG_INIT;
+        int count = 0;
+        metric slots[MAX_METRICS];
+    };
+
+    inline registry*& current() { static registry* r = nullptr; return r; }
+
+    inline registry* get()
+    {
+        if (!current()) current() = new registry();
+        return current();
+    }
+
+    // Moves the registry into memory shared with every process forked after this call
+    inline bool init_shared()
+    {
+        void* mem = mmap(nullptr, sizeof(registry), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) { perror("metrics: mmap"); return false; }
+        current() = new (mem) registry();
+        return true;
+    }
+
+    // Finds or creates a metric. Returns nullptr once the table is full, or if the name or labels don't
+    // fit (cut short, they could run into another metric's).
+    inline metric* find(const std::string& name, const std::string& labels, kind type)
+    {
+        if (name.length() >= NAME_LEN || labels.length() >= LABELS_LEN) {
+            fprintf(stderr, "metrics: %s{%s} doesn't fit; not recording it\n", name.c_str(), labels.c_str());
+            return nullptr;
+        }
+        registry* r = get();
+        while (r->lock.test_and_set(std::memory_order_acquire)) ;
+
+        metric* found = nullptr;
+        for (int i = 0; i < r->count && !found; i++) {
+            if (name == r->slots[i].name && labels == r->slots[i].labels) found = &r->slots[i];
+        }
+        if (!found && r->count < MAX_METRICS) {
+            found = &r->slots[r->count];
+            snprintf(found->name, NAME_LEN, "%s", name.c_str());
+            snprintf(found->labels, LABELS_LEN, "%s", labels.c_str());
+            found->type = type;
+            r->count++;
+        }
+
+        r->lock.clear(std::memory_order_release);
+        return found;
+    }
+
+    class counter {
+        public:
+            counter(const std::string& name, const std::string& labels = ""): m(find(name, labels, kind::counter)) {}
+            void inc(int64_t n = 1) { if (m) m->value.fetch_add(n, std::memory_order_relaxed); }
+            int64_t value() const { return m ? m->value.load(std::memory_order_relaxed) : 0; }
+        private:
+            metric* m;
+    };
+
+    class gauge {
+        public:
+            gauge(const std::string& name, const std::string& labels = ""): m(find(name, labels, kind::gauge)) {}
+            void set(int64_t v) { if (m) m->value.store(v, std::memory_order_relaxed); }
+            void add(int64_t n) { if (m) m->value.fetch_add(n, std::memory_order_relaxed); }
+            int64_t value() const { return m ? m->value.load(std::memory_order_relaxed) : 0; }
+        private:
+            metric* m;
+    };
+
+    class histogram {
+        public:
+            histogram(const std::string& name, const std::string& labels = ""): m(find(name, labels, kind::histogram)) {}
+            void observe(double v)
+            {
+                if (!m) return;
+                int b = 0;
+                while (b < BUCKETS - 1 && v > BOUNDS[b]) b++;
+                m->buckets[b].fetch_add(1, std::memory_order_relaxed);
+                m->sum_micros.fetch_add((int64_t)(v * 1e6), std::memory_order_relaxed);
+                m->value.fetch_add(1, std::memory_order_relaxed);
+            }
+            int64_t count() const { return m ? m->value.load(std::memory_order_relaxed) : 0; }
+            double sum() const { return m ? m->sum_micros.load(std::memory_order_relaxed) / 1e6 : 0; }
+
+            // Estimated from the buckets (upper bound of the bucket holding the q-th observation)
+            double quantile(double q) const
+            {
+                int64_t total = count();
+                if (total == 0) return 0;
+                int64_t rank = (int64_t)(q * total + 0.5), seen = 0;
+                for (int b = 0; b < BUCKETS - 1; b++) {
+                    seen += m->buckets[b].load(std::memory_order_relaxed);
+                    if (seen >= rank) return BOUNDS[b];
+                }
+                return BOUNDS[BUCKETS - 2];
+            }
+        private:
+            metric* m;
+    };
+
+    // Prometheus text exposition of every metric
+    inline std::string render()
+    {
+        registry* r = get();
+        std::string out;
+        char line[512];
+
+        for (int i = 0; i < r->count; i++) {
+            const metric& m = r->slots[i];
+            bool first_of_name = true;
+            for (int j = 0; j < i && first_of_name; j++) first_of_name = strcmp(r->slots[j].name, m.name) != 0;
+            if (first_of_name) {
+                const char* type = m.type == kind::counter ? "counter" : m.type == kind::gauge ? "gauge" : "histogram";
+                snprintf(line, sizeof line, "# TYPE %s %s\n", m.name, type);
+                out += line;
+            }
+
+            std::string labels = m.labels;
+            std::string braces = labels.empty() ? "" : "{" + labels + "}";
+            if (m.type != kind::histogram) {
+                snprintf(line, sizeof line, "%s%s %lld\n", m.name, braces.c_str(), (long long)m.value.load());
+                out += line;
+                continue;
+            }
+
+            int64_t cumulative = 0;
+            std::string sep = labels.empty() ? "" : ",";
+            for (int b = 0; b < BUCKETS; b++) {
+                cumulative += m.buckets[b].load();
+                if (b < BUCKETS - 1) snprintf(line, sizeof line, "%s_bucket{%s%sle=\"%g\"} %lld\n", m.name, labels.c_str(), sep.c_str(), BOUNDS[b], (long long)cumulative);
+                else snprintf(line, sizeof line, "%s_bucket{%s%sle=\"+Inf\"} %lld\n", m.name, labels.c_str(), sep.c_str(), (long long)cumulative);
+                out += line;
+            }
+            snprintf(line, sizeof line, "%s_sum%s %g\n%s_count%s %lld\n", m.name, braces.c_str(), m.sum_micros.load() / 1e6,
+                     m.name, braces.c_str(), (long long)m.value.load());
+            out += line;
+        }
+        return out;
+    }
+
+    // Serves GET /metrics on the given port from a background thread, along with whatever
+    // routes extra adds (admin commands, say)
+    inline void serve(int port, const std::function<void(httplib::Server&)>& extra = nullptr)
+    {
+        std::thread([port, extra]() {
+            httplib::Server server;
+            server.Get("/metrics", [](const httplib::Request&, httplib::Response& res) {
+                res.set_content(render(), "text/plain; version=0.0.4");
+            });
+            if (extra) extra(server);
+            if (!server.listen("0.0.0.0", port)) fprintf(stderr, "metrics: could not listen on port %d\n", port);
+        }).detach();
+    }
+}
+
+#endif
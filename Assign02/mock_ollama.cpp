@@ -0,0 +1,53 @@
+/*
+** mock_ollama.cpp -- a fake Ollama with a configurable latency profile
+**
+**   mock_ollama -P 11435 -t 15 -l normal:60:20 -e 200 -f 0.01
+**   server -B http://localhost:11435
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include "mock_ollama.hpp"
+
+int main(int argc, char* argv[])
+{
+    mock::profile profile;
+    int port = 11434;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "P:n:L:e:k:t:j:l:f:T:D:x:d:s:M:")) != -1) {
+        switch (opt) {
+        case 'P': port = atoi(optarg); break;
+        case 'n': profile.parallel = atoi(optarg); break; // generations at once; 0 for no limit
+        case 'L': profile.load_ms = atoi(optarg); break; // loading a model that isn't loaded
+        case 'e': profile.prompt_eval_ms = atoi(optarg); break; // prompt evaluation before the first token,
+        case 'k': profile.prompt_token_us = atof(optarg); break; // plus this many microseconds per prompt token
+        case 't': profile.token_ms = atoi(optarg); break; // between tokens,
+        case 'j': profile.token_jitter_ms = atoi(optarg); break; // give or take this much
+        case 'l': profile.lengths = optarg; break; // reply tokens: N, fixed:N, uniform:MIN:MAX or normal:MEAN:SD
+        case 'f': profile.error_rate = atof(optarg); break; // fraction of generations answered with a 500
+        case 'T': profile.timeout_rate = atof(optarg); break; // fraction that stall before replying,
+        case 'x': profile.stall_ms = atoi(optarg); break; // for this long
+        case 'D': profile.drop_rate = atof(optarg); break; // fraction whose connection drops mid-reply
+        case 'd': profile.embed_dim = atoi(optarg); break; // embedding dimensions
+        case 's': profile.seed = strtoull(optarg, nullptr, 10); break;
+        case 'M': profile.models = optarg; break; // comma-separated model names to serve
+        default:
+            fprintf(stderr, "usage: mock_ollama [-P port] [-n parallel] [-L load_ms] [-e prompt_ms] [-k us_per_prompt_token] "
+                            "[-t token_ms] [-j jitter_ms] [-l lengths] [-f error_rate] [-T timeout_rate [-x stall_ms]] "
+                            "[-D drop_rate] [-d embed_dim] [-s seed] [-M model,...]\n");
+            exit(1);
+        }
+    }
+
+    mock::backend backend(profile);
+    printf("mock_ollama: serving %s on port %d\n", profile.models.c_str(), port);
+    fflush(stdout);
+    if (!backend.listen("0.0.0.0", port)) {
+        fprintf(stderr, "mock_ollama: could not listen on port %d\n", port);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,612 @@
+/*
+** mock_ollama.hpp -- a stand-in Ollama for benchmarks and tests
+**
+** Speaks enough of the Ollama API for everything in this directory:
+** /api/generate and /api/chat (streamed as NDJSON, or whole), /api/embed,
+** /api/ps, /api/tags, /api/version and GET /. Replies are filler words, but the
+** timing is shaped like a real model's:
+**
+**   queue    at most `parallel` generations run at once; the rest wait
+**   load     a model that isn't loaded (or whose keep_alive ran out) costs load_ms
+**   prompt   prompt_eval_ms plus prompt_token_us per prompt token
+**   tokens   token_ms (+/- token_jitter_ms) between tokens, reply length drawn
+**            from `lengths` and capped by options.num_predict
+**
+** A reply depends only on the seed and the request, so the same prompt gets the
+** same words and timings on every run. Faults (500s, stalls, connections dropped
+** mid-stream) are drawn in arrival order from the same seed.
+**
+** Embeddings hash each word to a signed dimension, so texts sharing words come
+** out close in cosine similarity and unrelated ones near orthogonal.
+*/
+
+#ifndef MOCK_OLLAMA_HPP
+#define MOCK_OLLAMA_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include <math.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ollama.hpp"
+#include "metrics.hpp"
+
+namespace mock
+{
+    using clock = std::chrono::steady_clock;
+
+    struct profile {
+        int parallel = 4;            // generations at once, like OLLAMA_NUM_PARALLEL
+        int load_ms = 0;             // loading a cold model
+        int prompt_eval_ms = 0;      // before the first token,
+        double prompt_token_us = 0;  // plus this per prompt token
+        int token_ms = 20;
+        int token_jitter_ms = 0;
+        std::string lengths = "uniform:20:80"; // reply tokens: N, fixed:N, uniform:MIN:MAX or normal:MEAN:SD
+        double error_rate = 0;       // answer 500
+        double timeout_rate = 0;     // sit on the request for stall_ms first
+        double drop_rate = 0;        // close the connection halfway through the reply
+        int stall_ms = 60000;
+        int embed_dim = 384;
+        uint64_t seed = 1;
+        std::string models = "llama3.2:latest"; // comma separated, what /api/tags lists
+    };
+
+    // Sets one profile field by name, e.g. set(p, "token_ms", "15"). False for an unknown name.
+    inline bool set(profile& p, const std::string& key, const std::string& value)
+    {
+        const char* v = value.c_str();
+        if (key == "parallel") p.parallel = atoi(v);
+        else if (key == "load_ms") p.load_ms = atoi(v);
+        else if (key == "prompt_eval_ms") p.prompt_eval_ms = atoi(v);
+        else if (key == "prompt_token_us") p.prompt_token_us = atof(v);
+        else if (key == "token_ms") p.token_ms = atoi(v);
+        else if (key == "token_jitter_ms") p.token_jitter_ms = atoi(v);
+        else if (key == "lengths") p.lengths = value;
+        else if (key == "error_rate") p.error_rate = atof(v);
+        else if (key == "timeout_rate") p.timeout_rate = atof(v);
+        else if (key == "drop_rate") p.drop_rate = atof(v);
+        else if (key == "stall_ms") p.stall_ms = atoi(v);
+        else if (key == "embed_dim") p.embed_dim = atoi(v);
+        else if (key == "seed") p.seed = strtoull(v, nullptr, 10);
+        else return false;
+        return true;
+    }
+
+    // Totals since start, for callers embedding a backend in-process
+    struct totals {
+        std::atomic<int64_t> generations{0};   // /api/generate and /api/chat requests
+        std::atomic<int64_t> request_bytes{0}; // their bodies
+        std::atomic<int64_t> tokens{0};
+        std::atomic<int64_t> disconnects{0};
+    };
+
+    // splitmix64: small, fast, and the same sequence on every platform
+    class rng {
+        public:
+            explicit rng(uint64_t seed): state(seed) {}
+            uint64_t next()
+            {
+                uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                return z ^ (z >> 31);
+            }
+            double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); } // [0, 1)
+            int between(int lo, int hi) { return hi <= lo ? lo : lo + (int)(next() % (uint64_t)(hi - lo + 1)); }
+            double normal(double mean, double sd)
+            {
+                double u = uniform(), v = uniform();
+                return mean + sd * sqrt(-2 * log(u > 0 ? u : 1e-300)) * cos(2 * M_PI * v);
+            }
+        private:
+            uint64_t state;
+    };
+
+    inline uint64_t hash(const std::string& text, uint64_t h = 0xcbf29ce484222325ULL)
+    {
+        for (unsigned char ch : text) { h ^= ch; h *= 0x100000001b3ULL; }
+        return h;
+    }
+
+    inline int64_t now_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(clock::now().time_since_epoch()).count();
+    }
+
+    inline std::string timestamp(int64_t offset_ms = 0)
+    {
+        std::chrono::system_clock::time_point t = std::chrono::system_clock::now() + std::chrono::milliseconds(offset_ms);
+        time_t secs = std::chrono::system_clock::to_time_t(t);
+        int micros = std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count() % 1000000;
+        struct tm utc;
+        gmtime_r(&secs, &utc);
+        char buf[64];
+        size_t n = strftime(buf, sizeof buf, "%Y-%m-%dT%H:%M:%S", &utc);
+        snprintf(buf + n, sizeof buf - n, ".%06dZ", micros);
+        return buf;
+    }
+
+    // Same estimate as context_window: four bytes a token
+    inline int tokens(const std::string& text) { return (int)((text.length() + 3) / 4); }
+
+    // "llama3.2" means "llama3.2:latest"
+    inline std::string full_name(const std::string& model)
+    {
+        return model.find(':') == std::string::npos ? model + ":latest" : model;
+    }
+
+    // Ollama's keep_alive: seconds as a number, or "30s", "5m", "1h", "500ms"; negative keeps it forever
+    inline int64_t keep_alive_ms(const nlohmann::json& value)
+    {
+        if (value.is_number()) return (int64_t)(value.get<double>() * 1000);
+        if (!value.is_string()) return 5 * 60 * 1000;
+        std::string text = value.get<std::string>();
+        char* unit;
+        double amount = strtod(text.c_str(), &unit);
+        std::string u = unit;
+        if (u == "ms") return (int64_t)amount;
+        if (u == "m") return (int64_t)(amount * 60 * 1000);
+        if (u == "h") return (int64_t)(amount * 3600 * 1000);
+        return (int64_t)(amount * 1000);
+    }
+
+    class backend {
+        public:
+            backend(const profile& p): p(p), faults(p.seed ^ 0x5eed), active(0),
+                queue_wait_ms("mock_queue_wait_ms"), inflight("mock_inflight"), tokens_out("mock_tokens_total"),
+                disconnects("mock_disconnects_total")
+            {
+                size_t start = 0;
+                while (start <= p.models.length()) {
+                    size_t comma = p.models.find(',', start);
+                    std::string name = p.models.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+                    if (!name.empty()) available.push_back(full_name(name));
+                    if (comma == std::string::npos) break;
+                    start = comma + 1;
+                }
+                if (available.empty()) available.push_back("llama3.2:latest");
+
+                server.new_task_queue = [] { return new httplib::ThreadPool(256); }; // one per open stream
+                server.Get("/", [](const httplib::Request&, httplib::Response& res) { res.set_content("Ollama is running", "text/plain"); });
+                server.Get("/api/version", [](const httplib::Request&, httplib::Response& res) { res.set_content("{\"version\":\"0.0.0-mock\"}", "application/json"); });
+                server.Get("/api/tags", [this](const httplib::Request&, httplib::Response& res) { tags(res); });
+                server.Get("/api/ps", [this](const httplib::Request&, httplib::Response& res) { ps(res); });
+                server.Post("/api/generate", [this](const httplib::Request& req, httplib::Response& res) { generate(req, res, false); });
+                server.Post("/api/chat", [this](const httplib::Request& req, httplib::Response& res) { generate(req, res, true); });
+                server.Post("/api/embed", [this](const httplib::Request& req, httplib::Response& res) { embed(req, res); });
+                server.Get("/metrics", [](const httplib::Request&, httplib::Response& res) {
+                    res.set_content(metrics::render(), "text/plain; version=0.0.4");
+                });
+            }
+
+            // Blocks serving until stop()
+            bool listen(const std::string& host, int port) { return server.listen(host, port); }
+
+            // Serves from a background thread; returns once it's accepting
+            void start(const std::string& host, int port)
+            {
+                std::thread([this, host, port]() {
+                    if (!server.listen(host, port)) fprintf(stderr, "mock: could not listen on %s:%d\n", host.c_str(), port);
+                }).detach();
+                server.wait_until_ready();
+            }
+
+            void stop() { server.stop(); }
+
+            const totals& counters() const { return count; }
+
+            // Unit vector for text; see the top of the file
+            static std::vector<float> embedding(const std::string& text, int dim, uint64_t seed)
+            {
+                std::vector<float> v(dim > 0 ? dim : 1, 0.0f);
+                std::string word;
+                for (size_t i = 0; i <= text.length(); i++) {
+                    if (i < text.length() && isalnum((unsigned char)text[i])) { word += (char)tolower((unsigned char)text[i]); continue; }
+                    if (word.empty()) continue;
+                    uint64_t h = hash(word, seed ^ 0xcbf29ce484222325ULL);
+                    v[h % v.size()] += (h >> 63) ? 1.0f : -1.0f;
+                    word.clear();
+                }
+                double norm = 0;
+                for (float x : v) norm += x * x;
+                if (norm == 0) { v[seed % v.size()] = 1; return v; }
+                for (float& x : v) x /= sqrt(norm);
+                return v;
+            }
+
+        private:
+            // Everything about one reply, fixed up front from the seed and the request
+            struct plan {
+                std::vector<std::string> words;
+                std::vector<int> delays_ms; // before each word
+                int prompt_tokens = 0;
+                int prompt_ms = 0;
+                int drop_at = -1; // close the connection before this word
+            };
+
+            struct timing {
+                int64_t load_ns = 0, prompt_ns = 0, eval_ns = 0, total_ns = 0;
+            };
+
+            enum fault { NONE, ERROR, TIMEOUT, DROP };
+
+            fault draw_fault()
+            {
+                std::lock_guard<std::mutex> hold(lock);
+                double u = faults.uniform();
+                if (u < p.error_rate) return ERROR;
+                if ((u -= p.error_rate) < p.timeout_rate) return TIMEOUT;
+                if ((u -= p.timeout_rate) < p.drop_rate) return DROP;
+                return NONE;
+            }
+
+            int reply_length(rng& r, int num_predict)
+            {
+                std::string kind = p.lengths.substr(0, p.lengths.find(':'));
+                std::string args = p.lengths.find(':') == std::string::npos ? "" : p.lengths.substr(p.lengths.find(':') + 1);
+                double a = atof(args.c_str());
+                double b = args.find(':') == std::string::npos ? a : atof(args.c_str() + args.find(':') + 1);
+
+                int n;
+                if (kind == "uniform") n = r.between((int)a, (int)b);
+                else if (kind == "normal") n = (int)lround(r.normal(a, b));
+                else if (kind == "fixed") n = (int)a;
+                else n = atoi(p.lengths.c_str());
+                if (n < 1) n = 1;
+                if (num_predict > 0 && n > num_predict) n = num_predict;
+                return n;
+            }
+
+            plan make_plan(const std::string& model, const std::string& prompt, size_t context_tokens, int num_predict, fault f)
+            {
+                static const char* vocabulary[] = {
+                    "the", "a", "and", "of", "to", "in", "that", "it", "is", "was", "for", "on", "with", "as", "you",
+                    "I", "we", "they", "think", "about", "really", "time", "people", "because", "would", "could",
+                    "something", "good", "new", "first", "idea", "question", "maybe", "actually", "interesting",
+                    "know", "see", "make", "more", "just", "like", "what", "when", "how", "why", "there", "here",
+                    "world", "story", "music", "weather", "coffee", "book", "travel", "work", "friend", "today",
+                    "tomorrow", "always", "never", "sometimes", "probably", "agree", "sure" };
+                const int vocabulary_size = sizeof(vocabulary) / sizeof(vocabulary[0]);
+
+                rng r(hash(full_name(model) + '\0' + prompt, p.seed) ^ context_tokens);
+                plan out;
+                int n = reply_length(r, num_predict);
+                int sentence_left = 0; // words before the next full stop; sentences run 6-16 words
+                for (int i = 0; i < n; i++) {
+                    std::string word = vocabulary[r.next() % vocabulary_size];
+                    if (sentence_left == 0) {
+                        word[0] = toupper((unsigned char)word[0]);
+                        sentence_left = 6 + r.next() % 11;
+                    }
+                    bool stop = --sentence_left == 0 || i == n - 1;
+                    out.words.push_back((i ? " " : "") + word + (stop ? "." : ""));
+                    out.delays_ms.push_back(p.token_ms + (p.token_jitter_ms ? r.between(-p.token_jitter_ms, p.token_jitter_ms) : 0));
+                    if (out.delays_ms.back() < 0) out.delays_ms.back() = 0;
+                }
+                out.prompt_tokens = tokens(prompt);
+                out.prompt_ms = p.prompt_eval_ms + (int)(out.prompt_tokens * p.prompt_token_us / 1000);
+                if (f == DROP) out.drop_at = n / 2;
+                return out;
+            }
+
+            // Waits for a generation slot; the reply runs while it's held
+            void acquire()
+            {
+                clock::time_point queued = clock::now();
+                std::unique_lock<std::mutex> hold(lock);
+                room.wait(hold, [this] { return p.parallel <= 0 || active < p.parallel; });
+                active++;
+                hold.unlock();
+                inflight.add(1);
+                queue_wait_ms.observe(std::chrono::duration<double, std::milli>(clock::now() - queued).count());
+            }
+
+            void release()
+            {
+                {
+                    std::lock_guard<std::mutex> hold(lock);
+                    active--;
+                }
+                inflight.add(-1);
+                room.notify_one();
+            }
+
+            // Loads the model if it's cold and renews its keep_alive. Returns the time spent loading.
+            int64_t load(const std::string& model, int64_t keep_alive)
+            {
+                bool cold;
+                {
+                    std::lock_guard<std::mutex> hold(lock);
+                    auto it = loaded.find(model);
+                    cold = it == loaded.end() || (it->second >= 0 && it->second < now_ms());
+                }
+                clock::time_point start = clock::now();
+                if (cold && p.load_ms > 0) std::this_thread::sleep_for(std::chrono::milliseconds(p.load_ms));
+
+                std::lock_guard<std::mutex> hold(lock);
+                if (keep_alive == 0) loaded.erase(model);
+                else loaded[model] = keep_alive < 0 ? -1 : now_ms() + keep_alive;
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+            }
+
+            // Runs a plan, handing each word to emit. Returns false if the reply was cut short.
+            bool play(const std::string& model, int64_t keep_alive, const plan& reply, timing& t, const std::function<bool(const std::string&)>& emit)
+            {
+                clock::time_point start = clock::now();
+                acquire();
+                t.load_ns = load(model, keep_alive);
+
+                clock::time_point prompt_start = clock::now();
+                std::this_thread::sleep_for(std::chrono::milliseconds(reply.prompt_ms));
+                clock::time_point eval_start = clock::now();
+                t.prompt_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(eval_start - prompt_start).count();
+
+                bool complete = true;
+                for (size_t i = 0; i < reply.words.size() && complete; i++) {
+                    if ((int)i == reply.drop_at) { complete = false; break; }
+                    if (i) std::this_thread::sleep_for(std::chrono::milliseconds(reply.delays_ms[i]));
+                    tokens_out.inc();
+                    count.tokens++;
+                    if (!emit(reply.words[i])) {
+                        disconnects.inc();
+                        count.disconnects++;
+                        complete = false;
+                    }
+                }
+                clock::time_point end = clock::now();
+                t.eval_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - eval_start).count();
+                t.total_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+                release();
+                return complete;
+            }
+
+            // The fields Ollama puts on its last chunk
+            static void add_stats(nlohmann::json& j, const plan& reply, const timing& t)
+            {
+                j["done_reason"] = "stop";
+                j["total_duration"] = t.total_ns;
+                j["load_duration"] = t.load_ns;
+                j["prompt_eval_count"] = reply.prompt_tokens;
+                j["prompt_eval_duration"] = t.prompt_ns;
+                j["eval_count"] = reply.words.size();
+                j["eval_duration"] = t.eval_ns;
+            }
+
+            void error(httplib::Response& res, int status, const std::string& message)
+            {
+                nlohmann::json j;
+                j["error"] = message;
+                res.status = status;
+                res.set_content(j.dump(), "application/json");
+            }
+
+            bool known(const std::string& model)
+            {
+                for (const std::string& name : available) if (name == model) return true;
+                return false;
+            }
+
+            void generate(const httplib::Request& req, httplib::Response& res, bool chat)
+            {
+                static metrics::counter requests[2] = {
+                    metrics::counter("mock_requests_total", "endpoint=\"generate\""),
+                    metrics::counter("mock_requests_total", "endpoint=\"chat\"") };
+                requests[chat].inc();
+                count.generations++;
+                count.request_bytes += req.body.length();
+
+                nlohmann::json body = nlohmann::json::parse(req.body, nullptr, false);
+                if (body.is_discarded() || !body.is_object()) return error(res, 400, "invalid JSON body");
+                std::string model = full_name(body.value("model", ""));
+                if (!known(model)) return error(res, 404, "model \"" + body.value("model", "") + "\" not found, try pulling it first");
+
+                bool stream = body.value("stream", true);
+                int64_t keep_alive = keep_alive_ms(body.contains("keep_alive") ? body["keep_alive"] : nlohmann::json());
+                int num_predict = 0, num_ctx = 2048;
+                if (body.contains("options") && body["options"].is_object()) {
+                    num_predict = body["options"].value("num_predict", 0);
+                    num_ctx = body["options"].value("num_ctx", 2048);
+                }
+
+                // The text the reply is seeded from and the prompt is costed on
+                std::string prompt;
+                std::vector<int> context;
+                if (chat) {
+                    if (body.contains("messages") && body["messages"].is_array())
+                        for (const nlohmann::json& m : body["messages"]) prompt += m.value("role", "") + ": " + m.value("content", "") + "\n";
+                }
+                else {
+                    prompt = body.value("system", "") + body.value("prompt", "");
+                    if (body.contains("context") && body["context"].is_array())
+                        for (const nlohmann::json& token : body["context"]) context.push_back(token.get<int>());
+                }
+
+                // An empty prompt only loads the model (or unloads it, with keep_alive 0)
+                if (prompt.empty()) {
+                    int64_t load_ns = load(model, keep_alive);
+                    nlohmann::json j;
+                    j["model"] = model;
+                    j["created_at"] = timestamp();
+                    if (chat) j["message"] = { {"role", "assistant"}, {"content", ""} };
+                    else j["response"] = "";
+                    j["done"] = true;
+                    j["done_reason"] = keep_alive == 0 ? "unload" : "load";
+                    j["load_duration"] = load_ns;
+                    res.set_content(j.dump(), "application/json");
+                    return;
+                }
+
+                fault f = draw_fault();
+                if (f == ERROR) {
+                    static metrics::counter errors("mock_faults_total", "fault=\"error\"");
+                    errors.inc();
+                    return error(res, 500, "mock: injected failure");
+                }
+                if (f == TIMEOUT) {
+                    static metrics::counter stalls("mock_faults_total", "fault=\"timeout\"");
+                    stalls.inc();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(p.stall_ms));
+                }
+                if (f == DROP) {
+                    static metrics::counter drops("mock_faults_total", "fault=\"drop\"");
+                    drops.inc();
+                }
+
+                std::shared_ptr<plan> reply = std::make_shared<plan>(make_plan(model, prompt, context.size(), num_predict, f));
+
+                // Context handed back: what came in, then the prompt and the reply, trimmed to num_ctx
+                std::shared_ptr<std::vector<int>> context_out = std::make_shared<std::vector<int>>(context);
+                if (!chat) {
+                    for (int i = 0; i < reply->prompt_tokens; i++) context_out->push_back((int)(hash(prompt.substr(i * 4, 4), p.seed) % 32000));
+                    for (const std::string& word : reply->words) context_out->push_back((int)(hash(word, p.seed) % 32000));
+                    if (num_ctx > 0 && (int)context_out->size() > num_ctx)
+                        context_out->erase(context_out->begin(), context_out->end() - num_ctx);
+                }
+
+                auto chunk = [model, chat](const std::string& text, bool done) {
+                    nlohmann::json j;
+                    j["model"] = model;
+                    j["created_at"] = timestamp();
+                    if (chat) j["message"] = { {"role", "assistant"}, {"content", text} };
+                    else j["response"] = text;
+                    j["done"] = done;
+                    return j;
+                };
+
+                if (!stream) {
+                    std::string text;
+                    timing t;
+                    if (!play(model, keep_alive, *reply, t, [&](const std::string& word) { text += word; return true; })) {
+                        res.status = 500;
+                        return; // a dropped connection, as near as a whole reply can get
+                    }
+                    nlohmann::json j = chunk(text, true);
+                    add_stats(j, *reply, t);
+                    if (!chat) j["context"] = *context_out;
+                    res.set_content(j.dump(), "application/json");
+                    return;
+                }
+
+                res.set_chunked_content_provider("application/x-ndjson",
+                    [this, model, keep_alive, reply, context_out, chunk, chat](size_t, httplib::DataSink& sink) {
+                        timing t;
+                        bool complete = play(model, keep_alive, *reply, t, [&](const std::string& word) {
+                            std::string line = chunk(word, false).dump() + "\n";
+                            return sink.write(line.data(), line.length());
+                        });
+                        if (!complete) return false; // drops the connection without the final chunk
+
+                        nlohmann::json j = chunk("", true);
+                        add_stats(j, *reply, t);
+                        if (!chat) j["context"] = *context_out;
+                        std::string line = j.dump() + "\n";
+                        sink.write(line.data(), line.length());
+                        sink.done();
+                        return true;
+                    });
+            }
+
+            void embed(const httplib::Request& req, httplib::Response& res)
+            {
+                static metrics::counter requests("mock_requests_total", "endpoint=\"embed\"");
+                requests.inc();
+
+                nlohmann::json body = nlohmann::json::parse(req.body, nullptr, false);
+                if (body.is_discarded() || !body.is_object()) return error(res, 400, "invalid JSON body");
+                std::string model = full_name(body.value("model", ""));
+                if (!known(model)) return error(res, 404, "model \"" + body.value("model", "") + "\" not found, try pulling it first");
+
+                std::vector<std::string> inputs;
+                if (body.contains("input") && body["input"].is_string()) inputs.push_back(body["input"].get<std::string>());
+                else if (body.contains("input") && body["input"].is_array())
+                    for (const nlohmann::json& input : body["input"]) if (input.is_string()) inputs.push_back(input.get<std::string>());
+
+                clock::time_point start = clock::now();
+                int64_t load_ns = load(model, keep_alive_ms(body.contains("keep_alive") ? body["keep_alive"] : nlohmann::json()));
+                int prompt_tokens = 0;
+                nlohmann::json embeddings = nlohmann::json::array();
+                for (const std::string& input : inputs) {
+                    prompt_tokens += tokens(input);
+                    embeddings.push_back(embedding(input, p.embed_dim, p.seed));
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds((int64_t)(prompt_tokens * p.prompt_token_us)));
+
+                nlohmann::json j;
+                j["model"] = model;
+                j["embeddings"] = embeddings;
+                j["total_duration"] = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+                j["load_duration"] = load_ns;
+                j["prompt_eval_count"] = prompt_tokens;
+                res.set_content(j.dump(), "application/json");
+            }
+
+            static nlohmann::json describe(const std::string& model)
+            {
+                nlohmann::json j;
+                j["name"] = model;
+                j["model"] = model;
+                j["size"] = 2019393189;
+                j["digest"] = std::to_string(hash(model));
+                j["details"] = { {"format", "gguf"}, {"family", "mock"}, {"parameter_size", "0B"}, {"quantization_level", "none"} };
+                return j;
+            }
+
+            void tags(httplib::Response& res)
+            {
+                nlohmann::json j;
+                j["models"] = nlohmann::json::array();
+                for (const std::string& model : available) {
+                    nlohmann::json m = describe(model);
+                    m["modified_at"] = timestamp();
+                    j["models"].push_back(m);
+                }
+                res.set_content(j.dump(), "application/json");
+            }
+
+            void ps(httplib::Response& res)
+            {
+                nlohmann::json j;
+                j["models"] = nlohmann::json::array();
+                std::lock_guard<std::mutex> hold(lock);
+                int64_t now = now_ms();
+                for (auto it = loaded.begin(); it != loaded.end(); ) {
+                    if (it->second >= 0 && it->second < now) { it = loaded.erase(it); continue; }
+                    nlohmann::json m = describe(it->first);
+                    m["size_vram"] = m["size"];
+                    m["expires_at"] = it->second < 0 ? "2318-01-01T00:00:00Z" : timestamp(it->second - now);
+                    j["models"].push_back(m);
+                    ++it;
+                }
+                res.set_content(j.dump(), "application/json");
+            }
+
+            profile p;
+            httplib::Server server;
+            std::vector<std::string> available;
+
+            std::mutex lock;
+            std::condition_variable room;
+            rng faults;
+            int active;
+            totals count;
+            std::map<std::string, int64_t> loaded; // model -> keep_alive expiry in now_ms() terms, -1 forever
+
+            metrics::histogram queue_wait_ms;
+            metrics::gauge inflight;
+            metrics::counter tokens_out, disconnects;
+    };
+}
+
+#endif
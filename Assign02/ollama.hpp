@@ -35130,6 +35130,26 @@ namespace ollama
                 return error_string;
             }
 
+            // Token counts and timings (in nanoseconds) Ollama puts on the final chunk of a reply; 0 where it didn't send one
+            bool has_timings() const { return json_data.contains("eval_count") || json_data.contains("prompt_eval_count"); }
+            int64_t total_duration() const { return get_number("total_duration"); }
+            int64_t load_duration() const { return get_number("load_duration"); }
+            int64_t prompt_eval_count() const { return get_number("prompt_eval_count"); }
+            int64_t prompt_eval_duration() const { return get_number("prompt_eval_duration"); }
+            int64_t eval_count() const { return get_number("eval_count"); }
+            int64_t eval_duration() const { return get_number("eval_duration"); }
+
+            // Prefill and decode speed, in tokens per second; 0 without the counts behind them
+            double prompt_tokens_per_second() const
+            {
+                return prompt_eval_duration() > 0 ? prompt_eval_count() * 1e9 / prompt_eval_duration() : 0;
+            }
+
+            double eval_tokens_per_second() const
+            {
+                return eval_duration() > 0 ? eval_count() * 1e9 / eval_duration() : 0;
+            }
+
             friend std::ostream& operator<<(std::ostream& os, const ollama::response& response) { os << response.as_simple_string(); return os; }
 
             const message_type& get_type() const
@@ -35144,6 +35164,12 @@ namespace ollama
 
         private:
 
+        int64_t get_number(const char* key) const
+        {
+            if ( !json_data.contains(key) || !json_data[key].is_number() ) return 0;
+            return json_data[key].get<int64_t>();
+        }
+
         std::string json_string;
         std::string simple_string;
         std::string error_string;
@@ -35227,14 +35253,24 @@ class Ollama
     bool generate(ollama::request& request, std::function<void(const ollama::response&)> on_receive_token)
     {
         request["stream"] = true;
+        return generate_serialized(request.dump(), on_receive_token);
+    }
 
-        std::string request_string = request.dump();
+    // Same, for a request body the caller already serialized (with "stream":true).
+    // keep_going, if given, is asked before each chunk; returning false drops the connection, which stops
+    // the generation on the server, and generate_serialized returns false without throwing.
+    bool generate_serialized(const std::string& request_string, std::function<void(const ollama::response&)> on_receive_token,
+                             std::function<bool()> keep_going = nullptr)
+    {
         if (ollama::log_requests) std::cout << request_string << std::endl;
 
         std::shared_ptr<std::vector<std::string>> partial_responses = std::make_shared<std::vector<std::string>>();
+        std::shared_ptr<std::string> error = std::make_shared<std::string>();
+        std::shared_ptr<bool> stopped = std::make_shared<bool>(false);
 
-        auto stream_callback = [on_receive_token, partial_responses](const char *data, size_t data_length)->bool{
+        auto stream_callback = [on_receive_token, partial_responses, error, keep_going, stopped](const char *data, size_t data_length)->bool{
             
+            if ( keep_going && !keep_going() ) { *stopped = true; return false; }
             std::string message(data, data_length);
             if (ollama::log_replies) std::cout << message << std::endl;
             try 
@@ -35243,6 +35279,8 @@ class Ollama
                 std::string total_response = std::accumulate(partial_responses->begin(), partial_responses->end(), std::string(""));                
                 ollama::response response(total_response);
                 partial_responses->clear();  
+                // An error body (e.g. a 500) isn't a token; stop reading and report it below
+                if ( response.has_error() ) { *error = response.get_error(); return false; }
                 on_receive_token(response); 
             }
             catch (const ollama::invalid_json_exception& e) { /* Partial response was received. Will do nothing and attempt to concatenate with the next response. */ }
@@ -35250,7 +35288,10 @@ class Ollama
             return true;
         };
 
-        if (auto res = this->cli->Post("/api/generate", request_string, "application/json", stream_callback)) { return true; }
+        auto res = this->cli->Post("/api/generate", request_string, "application/json", stream_callback);
+        if ( !error->empty() ) { if (ollama::use_exceptions) throw ollama::exception("Ollama response returned error: "+*error); return false; }
+        if ( *stopped ) { return false; }
+        if (res) { return true; }
         else { if (ollama::use_exceptions) throw ollama::exception( "No response from server returned at URL"+this->server_url+" Error: "+httplib::to_string( res.error() ) ); } 
 
         return false;
@@ -35377,10 +35418,12 @@ class Ollama
 
     }
 
-    bool load_model(const std::string& model)
+    // keep_alive_duration (e.g. "30m", "-1" for forever) sets how long it stays loaded; empty leaves Ollama's default
+    bool load_model(const std::string& model, const std::string& keep_alive_duration="")
     {
         json request;
         request["model"] = model;
+        if (!keep_alive_duration.empty()) request["keep_alive"] = keep_alive_duration;
         std::string request_string = request.dump();
         if (ollama::log_requests) std::cout << request_string << std::endl;
 
@@ -35400,6 +35443,29 @@ class Ollama
         return false;                
     }
 
+    // Asks the server to drop the model from memory now rather than when its keep_alive runs out
+    bool unload_model(const std::string& model)
+    {
+        json request;
+        request["model"] = model;
+        request["keep_alive"] = 0;
+        std::string request_string = request.dump();
+        if (ollama::log_requests) std::cout << request_string << std::endl;
+
+        if (auto res = this->cli->Post("/api/generate", request_string, "application/json"))
+        {
+            if (ollama::log_replies) std::cout << res->body << std::endl;
+            json response = json::parse(res->body);
+            return response.value("done", false);
+        }
+        else
+        {
+            if (ollama::use_exceptions) throw ollama::exception("No response returned from server when unloading model: "+httplib::to_string( res.error() ) );
+        }
+
+        return false;
+    }
+
     bool is_running()
     {
         auto res = cli->Get("/");
@@ -35659,6 +35725,12 @@ class Ollama
         this->cli->set_write_timeout(seconds);
     }
 
+    // Reuse one HTTP connection across requests instead of reconnecting for each
+    void setKeepAlive(const bool on)
+    {
+        this->cli->set_keep_alive(on);
+    }
+
     private:
 
 /*
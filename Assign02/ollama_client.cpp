@@ -9,10 +9,23 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <fstream>
 #include <string>
 #include "ollama.hpp"
+#include "chat_protocol.hpp"
+#include "pacing.hpp"
+#include "backends.hpp"
+#include "context_window.hpp"
+#include "session_store.hpp"
+#include "response_cache.hpp"
+#include "semantic_cache.hpp"
+#include "speculation.hpp"
+#include "cancellation.hpp"
+#include "telemetry.hpp"
+#include "tracing.hpp"
+#include "metrics.hpp"
 
 #include <arpa/inet.h>
 
@@ -31,43 +44,152 @@ void *get_in_addr(struct sockaddr *sa)
 }
 
 
-void chat(int sockfd){
-    Ollama my_server("http://localhost:11434");
+void chat(int sockfd, bool stream, pacing::policy& pacer, backends::pool& backends, std::shared_ptr<context_window> window, session_store& sessions, std::string session_id,
+          response_cache& cache, const nlohmann::json& options, semantic::cache* semantic, speculator* speculation, int deadline_ms){
     // Initialize message buffer
-	char server_response[MESSAGE_LEN];
-	memset (server_response, MESSAGE_LEN, 0);
+    turn_reader reader(sockfd);
+    std::string server_response;
+    cancel_token cancel(sockfd, deadline_ms); // stops our generation if the server goes away or the turn runs out of time
 
-    ollama::response last_response;
+    speculator::generator generate = [&](const std::string& request, const speculator::token_callback& on_token, const std::function<bool()>& keep_going) {
+        int received = 0;
+        return backends.run("llama3.2", -1, [&](Ollama& ollama) {
+            trace::generate(ollama, request, [&](const ollama::response& token) { received++; on_token(token); },
+                                       [&]() { return keep_going() && !cancel.cancelled(); });
+        }, [&]() { return received > 0; });
+    };
+    // What we'd send for a reply to turn, without recording anything
+    std::function<std::string(const std::string&)> speculative_request = [&](const std::string& partial_turn) {
+        return window ? ollama::request("llama3.2", window->preview(partial_turn), options, true).dump()
+                      : sessions.build_request(session_id, "llama3.2", partial_turn, options);
+    };
+
+
+    // Tokens go out one small frame at a time; don't let Nagle hold them back
+    int yes = 1;
+    if (stream && setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) == -1)
+        perror("setsockopt TCP_NODELAY");
 
     // Main loop (recv -> broadcast -> repeat)
+    int turn = 0;
 	do {
-		// Recieve a response from the server
-		int bytes_recvd = recv(sockfd, server_response, MESSAGE_LEN-1, 0);
-		if (bytes_recvd < 1) {
+        trace::turn_scope traced(0, ++turn);
+        trace::span whole("turn");
+		// Recieve a response from the server, printing it as it streams in
+        printf("%s\n", "--------------------------------------------------------------");
+        printf("SERVER: ");
+        std::string so_far;
+        trace::span received("recv");
+		if (!reader.read_turn(server_response, [&](const std::string& chunk) {
+                fputs(chunk.c_str(), stdout);
+                fflush(stdout);
+                so_far += chunk;
+                // Start on our reply while the rest of theirs arrives
+                if (speculation) speculation->partial(so_far, speculative_request, generate);
+            })) {
 			perror("Failed to recieve message from client");
 			break;
 		}
-		// Add termination character		
-	    server_response[bytes_recvd] = '\0';
-		
-        // Print server's response
-        printf("%s\n", "--------------------------------------------------------------");
-		printf("SERVER: %s\n", server_response);
-        printf("%s\n", "--------------------------------------------------------------");
+        received.count(server_response.length());
+        received.end();
+        printf("\n%s\n", "--------------------------------------------------------------");
 
-        sleep(2);
+        {
+            trace::span paced("pace");
+            pacer.before_generate();
+        }
+        cancel.start_turn();
         // Generate client response from server response
-        last_response = my_server.generate("llama3.2", server_response, last_response);
-		std::string output = last_response.as_json()["response"];
-
-        // Print server response
-        printf("%s\n", "--------------------------------------------------------------");
-        printf("CLIENT: %s\n", output.c_str());
         printf("%s\n", "--------------------------------------------------------------");
+        printf("CLIENT: ");
+        std::string output;
+        pacing::clock::time_point generation_start = pacing::clock::now();
+        int tokens = 0; // streamed chunks, as the server counts them
+        ollama::response final_chunk;
+        int64_t stream_send_us = 0, frames = 0; // traced turns: time in send_frame, summed over the tokens
+        bool traced_sends = trace::sampled();
+        // Streaming: the server sees each token as soon as the pacing policy lets it out
+        pacing::paced_sender sender(pacer, generation_start, [&](const std::string& piece) {
+            int64_t send_start = traced_sends ? trace::now_us() : 0;
+            bool ok = send_frame(sockfd, FRAME_TOKEN, piece);
+            if (traced_sends) { stream_send_us += trace::now_us() - send_start; frames++; }
+            fputs(piece.c_str(), stdout);
+            fflush(stdout);
+            return ok;
+        });
+        std::function<void(const ollama::response&)> on_token = [&](const ollama::response& token) {
+            tokens++;
+            const std::string& piece = token.as_simple_string();
+            output += piece;
+            if (token.as_json().value("done", false)) final_chunk = token;
+            if (stream && !piece.empty()) sender.push(piece, output.length());
+        };
+        // With a context window the prompt carries the conversation; otherwise the session's stored context does
+        trace::span serialized("serialize");
+        std::string prompt = window ? window->prompt_for(server_response) : server_response;
+        std::string request = window ? ollama::request("llama3.2", prompt, options, true).dump()
+                                     : sessions.build_request(session_id, "llama3.2", prompt, options);
+        std::string cache_key = cache.key_for("llama3.2", prompt, options, window ? 0 : sessions.context_hash(session_id));
+        serialized.count(request.length());
+        serialized.end();
+        semantic::cache::probe probe;
+        bool generated = cache.replay(cache_key, on_token) || (semantic && semantic->replay(session_id, server_response, on_token, probe));
+        // A reply started early on most of the turn stands in for one to all of it
+        bool speculated = false;
+        size_t speculated_from = 0; // bytes of the turn a speculation saw
+        if (speculation && generated) speculation->cancel();
+        else if (speculation) {
+            speculated = speculation->finish(server_response, on_token, generated, speculated_from);
+            if (speculated && generated) telemetry::record(final_chunk, "client", backends::last_used());
+        }
+        if (!generated && !speculated) {
+            generated = cache.run(backends, "llama3.2", -1, cache_key, request, on_token, [&]() { return !output.empty(); }, cancel.keep_going());
+            if (generated && !cancel.cancelled() && semantic) semantic->record(probe, server_response, output);
+            if (generated && !cancel.cancelled()) telemetry::record(final_chunk, "client", backends::last_used());
+        }
+        if (cancel.hung_up()) {
+            cancel_token::count("disconnect", tokens);
+            fprintf(stderr, "\nServer left mid-turn; generation cancelled\n");
+            break;
+        }
+        // Out of time: the server gets what there is, if there's anything
+        if (cancel.expired()) {
+            cancel_token::count("deadline", tokens);
+            fprintf(stderr, "\nTurn ran past its %d ms deadline; cut off\n", cancel.deadline());
+            if (output.empty()) generated = false;
+        }
+
+        if (generated && window) window->add_reply(output);
+        else if (generated) {
+            sessions.update(session_id, final_chunk);
+            if (speculated) sessions.carry(session_id, server_response.substr(speculated_from)); // what the speculation's context lacks
+        }
+        if (!generated) {
+            fprintf(stderr, "Failed to generate a reply on any backend\n");
+            break;
+        }
 
-		// Relay message to current client
-		if (send(sockfd, output.c_str(), output.length(), 0) == -1)
+        // Print client response (streamed: once the last paced token is out)
+        bool streamed = !stream || sender.finish();
+        if (!stream) printf("%s", output.c_str());
+        printf("\n%s\n", "--------------------------------------------------------------");
+
+		if (!stream) {
+            trace::span paced("pace");
+            pacer.before_send(output.length(), generation_start);
+        }
+        // Streamed tokens went out during decode; this is the total of those sends
+        if (frames > 0) trace::record("send.stream", std::chrono::duration_cast<std::chrono::microseconds>(generation_start.time_since_epoch()).count(), stream_send_us, frames);
+
+		// Relay message to the server (or close off the streamed turn)
+        trace::span sent("send", stream ? 0 : output.length());
+		if (stream) {
+			if (!streamed || !send_frame(sockfd, FRAME_END, ""))
+				perror("Failed to relay message to client");
+		}
+		else if (send(sockfd, output.c_str(), output.length(), 0) == -1)
 			perror("Failed to relay message to client");
+		pacer.turn_done();
 		
 	} while (1);
 }
@@ -80,16 +202,96 @@ int main(int argc, char *argv[])
 	int rv;
 	char s[INET6_ADDRSTRLEN];
 
-	if (argc != 2) {
-	    fprintf(stderr,"usage: client hostname\n");
+	int opt;
+	bool stream = false;
+	std::string pacing_spec = "none";
+	int metrics_port = 0;
+	int context_budget = 0; // 0: ship the full context array every turn
+	std::string session_id, session_dir;
+	std::string priority, weight;
+	std::string backend_urls = "http://localhost:11434";
+	std::string options_spec; // generation options, e.g. temperature=0,seed=42
+	int cache_entries = 0;
+	std::string cache_dir;
+	double replay_speed = 1;
+	std::string semantic_spec;
+	std::string speculation_spec;
+	std::string hedge_spec;
+	int deadline_ms = 0;
+	std::string trace_spec;
+
+	while ((opt = getopt(argc, argv, "sp:m:w:i:d:q:W:B:O:C:K:r:S:X:H:T:t:")) != -1) {
+		switch (opt) {
+		case 's': stream = true; break; // stream tokens to the server as they're generated
+		case 'p': pacing_spec = optarg; break; // none, gap:MS, typing:CPS or budget:TPS (see pacing.hpp)
+		case 'm': metrics_port = atoi(optarg); break; // serve /metrics on this port
+		case 'w': context_budget = atoi(optarg); break; // cap the context at this many tokens, summarizing older turns
+		case 'i': session_id = optarg; break; // name the conversation so the server can resume it
+		case 'd': session_dir = optarg; break; // save our side's context here, restore it next time
+		case 'q': priority = optarg; break; // ask the server for interactive or batch scheduling
+		case 'W': weight = optarg; break; // our share of the backend relative to other conversations
+		case 'B': backend_urls = optarg; break; // comma-separated Ollama URLs to balance across
+		case 'O': options_spec = optarg; break; // generation options as key=value,...
+		case 'C': cache_entries = atoi(optarg); break; // replay deterministic replies, keeping this many in memory
+		case 'K': cache_dir = optarg; break; // and keep them on disk here too
+		case 'r': replay_speed = atof(optarg); break; // cached replies play back at this multiple of their original speed; 0 at once
+		case 'S': semantic_spec = optarg; break; // reuse replies to similar turns: threshold=T,budget_mb=MB,model=NAME,audit=RATE
+		case 'X': speculation_spec = optarg; break; // start replying to a streamed turn early: after=SENTENCES,diverge=FRACTION
+		case 'H': hedge_spec = optarg; break; // race a second backend when the first is slow to start: quantile=Q,min=MS
+		case 'T': deadline_ms = atoi(optarg); break; // give up on a turn's generation after this many ms
+		case 't': trace_spec = optarg; break; // time each turn's stages, GET /trace on the metrics port: sample=N,every=S,dir=PATH
+		default:
+			fprintf(stderr,"usage: client [-s] [-p pacing] [-m metrics_port] [-w context_tokens] [-i session_id] [-d session_dir] [-q priority] [-W weight] [-B url,...] [-O key=value,...] [-C cache_entries] [-K cache_dir] [-r replay_speed] [-S semantic_spec] [-X speculation_spec] [-H hedge_spec] [-T deadline_ms] [-t trace_spec] hostname\n");
+			exit(1);
+		}
+	}
+
+	if (argc - optind != 1) {
+	    fprintf(stderr,"usage: client [-s] [-p pacing] [-m metrics_port] [-w context_tokens] [-i session_id] [-d session_dir] [-q priority] [-W weight] [-B url,...] [-O key=value,...] [-C cache_entries] [-K cache_dir] [-r replay_speed] [-S semantic_spec] [-X speculation_spec] [-H hedge_spec] [-T deadline_ms] [-t trace_spec] hostname\n");
 	    exit(1);
 	}
 
+	std::unique_ptr<pacing::policy> pacer = pacing::make(pacing_spec);
+	if (!pacer) {
+		fprintf(stderr, "client: unknown pacing policy %s\n", pacing_spec.c_str());
+		exit(1);
+	}
+	semantic::cache::settings semantic_settings;
+	if (!semantic_spec.empty() && !semantic::cache::parse(semantic_spec, semantic_settings)) {
+		fprintf(stderr, "client: bad semantic cache spec %s\n", semantic_spec.c_str());
+		exit(1);
+	}
+	hedging::settings hedge_settings;
+	if (!hedge_spec.empty() && !hedging::parse(hedge_spec, hedge_settings)) {
+		fprintf(stderr, "client: bad hedge spec %s\n", hedge_spec.c_str());
+		exit(1);
+	}
+	speculator::settings speculation_settings;
+	if (!speculation_spec.empty() && !speculator::parse(speculation_spec, speculation_settings)) {
+		fprintf(stderr, "client: bad speculation spec %s\n", speculation_spec.c_str());
+		exit(1);
+	}
+	trace::settings trace_settings;
+	if (!trace_spec.empty() && !trace::parse(trace_spec, trace_settings)) {
+		fprintf(stderr, "client: bad trace spec %s\n", trace_spec.c_str());
+		exit(1);
+	}
+	if (!trace_spec.empty()) {
+		trace::init(trace_settings, false);
+		trace::start_dumps(trace_settings);
+	}
+	if (metrics_port) metrics::serve(metrics_port, [](httplib::Server& server) {
+		server.Get("/trace", [](const httplib::Request& req, httplib::Response& res) {
+			int64_t since = req.has_param("since") ? atoll(req.get_param_value("since").c_str()) : 0;
+			res.set_content(trace::chrome_json(since), "application/json");
+		});
+	});
+
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 
-	if ((rv = getaddrinfo(argv[1], PORT, &hints, &servinfo)) != 0) {
+	if ((rv = getaddrinfo(argv[optind], PORT, &hints, &servinfo)) != 0) {
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
 		return 1;
 	}
@@ -122,7 +324,24 @@ int main(int argc, char *argv[])
 
 	freeaddrinfo(servinfo); // all done with this structure
 	
-	chat(sockfd);
+	backends::pool backends(backend_urls);
+	backends.start_health_checks();
+	std::shared_ptr<context_window> window;
+	if (context_budget > 0) window = std::make_shared<context_window>(backends, "llama3.2", context_budget);
+	if (!session_id.empty() && !send_frame(sockfd, FRAME_SESSION, session_id)) perror("send");
+	if (!priority.empty() && !send_frame(sockfd, FRAME_OPTION, "priority=" + priority)) perror("send");
+	if (!weight.empty() && !send_frame(sockfd, FRAME_OPTION, "weight=" + weight)) perror("send");
+	session_store sessions(session_dir);
+	if (!session_id.empty()) sessions.restore(session_id); // ours to pick up again with the same -i
+	response_cache cache(cache_entries, cache_dir, replay_speed);
+	std::unique_ptr<hedging::hedger> hedger = hedging::make(hedge_spec, deadline_ms > 0);
+	cache.hedge(hedger.get());
+	std::unique_ptr<semantic::cache> semantic;
+	if (!semantic_spec.empty()) semantic = semantic::cache::make(backends, "llama3.2", semantic_spec);
+	std::unique_ptr<speculator> speculation;
+	if (!speculation_spec.empty()) speculation.reset(new speculator(speculation_settings));
+	chat(sockfd, stream, *pacer, backends, window, sessions, session_id.empty() ? "client-" + std::to_string(getpid()) : session_id,
+	     cache, response_cache::parse_options(options_spec), semantic.get(), speculation.get(), deadline_ms);
 
 	close(sockfd);
 
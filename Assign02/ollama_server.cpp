@@ -10,53 +10,215 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include "ollama.hpp"
+#include "probes.hpp"
+#include "chat_protocol.hpp"
+#include "pacing.hpp"
+#include "backends.hpp"
+#include "context_window.hpp"
+#include "session_store.hpp"
+#include "scheduler.hpp"
+#include "response_cache.hpp"
+#include "semantic_cache.hpp"
+#include "residency.hpp"
+#include "speculation.hpp"
+#include "cancellation.hpp"
+#include "telemetry.hpp"
+#include "tracing.hpp"
+#include "startup.hpp"
+#include "metrics.hpp"
+#include "event_server.hpp"
 
 #define PORT "3490"  // the port users will be connecting to
-#define MESSAGE_LEN 4096
 #define BACKLOG 10   // how many pending connections queue will hold
 
-void chat(int sockfd){
-    Ollama my_server("http://localhost:11434");
+void chat(int sockfd, bool stream, pacing::policy& pacer, backends::pool& backends, std::shared_ptr<context_window> window, session_store& sessions, std::string session_id,
+          sched::scheduler* scheduler, const sched::admission& admission, response_cache& cache, const nlohmann::json& options,
+          semantic::cache* semantic, model_residency* residency, speculator* speculation, int deadline_ms,
+          const std::string& persona){
     // Initialize message buffer
-	char client_response[MESSAGE_LEN];
-	memset (client_response, MESSAGE_LEN, 0);
-
-    ollama::response last_response;
+    turn_reader reader(sockfd);
+    std::string client_response;
+
+    int conversation = getpid(); // One process per conversation
+    int turn = 0;
+    cancel_token cancel(sockfd, deadline_ms); // stops our generation (or our place in the queue) if the client leaves or the turn runs out of time
+
+    // Takes a scheduler slot in class p with weight w and generates on a backend, the way every reply is
+    // generated. p and w are read by the caller, before the speculation thread that may run this starts.
+    auto generate_as = [&](sched::priority p, double w) -> speculator::generator {
+        return [&, p, w](const std::string& request, const speculator::token_callback& on_token, const std::function<bool()>& keep_going) {
+            if (residency) residency->touch();
+            // Gives up its place in the queue as soon as the speculation is dropped, not just when the turn is
+            sched::scheduler::slot slot(scheduler, conversation, p, w, [&]() { return !keep_going() || cancel.cancelled(); });
+            if (slot.dropped()) return false;
+            int received = 0;
+            return backends.run("llama3.2", slot.backend, [&](Ollama& ollama) {
+                trace::generate(ollama, request, [&](const ollama::response& token) { received++; on_token(token); },
+                                           [&]() { return keep_going() && !cancel.cancelled(); });
+            }, [&]() { return received > 0; });
+        };
+    };
+    // What we'd send for a reply to turn, without recording anything
+    std::function<std::string(const std::string&)> speculative_request = [&](const std::string& partial_turn) {
+        std::string id = session_id;
+        if (!reader.session().empty()) sessions.restore(id = reader.session());
+        return window ? ollama::request("llama3.2", window->preview(partial_turn), options, true).dump()
+                      : sessions.build_request(id, "llama3.2", partial_turn, options);
+    };
+
+    // Tokens go out one small frame at a time; don't let Nagle hold them back
+    int yes = 1;
+    if (stream && setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) == -1)
+        perror("setsockopt TCP_NODELAY");
 
     // Main loop (recv -> broadcast -> repeat)
 	do {
-		// Recieve a response from this_client
-		int bytes_recvd = recv(sockfd, client_response, MESSAGE_LEN-1, 0);
-		if (bytes_recvd < 1) {
+        trace::turn_scope traced(conversation, turn + 1);
+        trace::span whole("turn");
+		// Recieve a response from this_client, printing it as it streams in
+        printf("%s\n", "--------------------------------------------------------------");
+        printf("CLIENT: ");
+        std::string so_far;
+        trace::span received("recv");
+		if (!reader.read_turn(client_response, [&](const std::string& chunk) {
+                fputs(chunk.c_str(), stdout);
+                fflush(stdout);
+                so_far += chunk;
+                // Start on our reply while the rest of theirs arrives
+                if (speculation) speculation->partial(so_far, speculative_request, generate_as(admission.class_for(reader.option("priority")),
+                                                                                               admission.weight_for(reader.option("weight"))));
+            })) {
 			perror("Failed to recieve message from client");
 			break;
 		}
-		// Add termination character		
-	    client_response[bytes_recvd] = '\0';
-		
-        // Print client's response
-        printf("%s\n", "--------------------------------------------------------------");
-		printf("CLIENT: %s\n", client_response);
+        received.count(client_response.length());
+        received.end();
+        printf("\n%s\n", "--------------------------------------------------------------");
+        if (!reader.session().empty()) sessions.restore(session_id = reader.session()); // the client named its conversation
+
+        {
+            trace::span paced("pace");
+            pacer.before_generate();
+        }
+        cancel.start_turn();
+        // Generate server response from client response. Streamed so the first token is observable;
+        // the final chunk carries the context for the next turn.
+        turn++;
+        OLLAMA_PROBE3(generate_start, conversation, turn, client_response.length());
         printf("%s\n", "--------------------------------------------------------------");
+        printf("SERVER: ");
+        std::string output;
+        pacing::clock::time_point generation_start = pacing::clock::now();
+        int tokens = 0;
+        ollama::response final_chunk;
+        int64_t stream_send_us = 0, frames = 0; // traced turns: time in send_frame, summed over the tokens
+        bool traced_sends = trace::sampled();
+        // Streaming: the client sees each token as soon as the pacing policy lets it out
+        pacing::paced_sender sender(pacer, generation_start, [&](const std::string& piece) {
+            int64_t send_start = traced_sends ? trace::now_us() : 0;
+            bool ok = send_frame(sockfd, FRAME_TOKEN, piece);
+            if (traced_sends) { stream_send_us += trace::now_us() - send_start; frames++; }
+            fputs(piece.c_str(), stdout);
+            fflush(stdout);
+            return ok;
+        });
+        std::function<void(const ollama::response&)> on_token = [&](const ollama::response& token) {
+            if (tokens++ == 0) OLLAMA_PROBE2(first_token, conversation, turn);
+            const std::string& piece = token.as_simple_string();
+            output += piece;
+            if (token.as_json().value("done", false)) final_chunk = token;
+            if (stream && !piece.empty()) sender.push(piece, output.length());
+        };
+        // With a context window the prompt carries the conversation; otherwise the session's stored context does
+        trace::span serialized("serialize");
+        std::string prompt = window ? window->prompt_for(client_response) : client_response;
+        std::string request = window ? ollama::request("llama3.2", prompt, options, true).dump()
+                                     : sessions.build_request(session_id, "llama3.2", prompt, options);
+        std::string cache_key = cache.key_for("llama3.2", prompt, options, window ? 0 : sessions.context_hash(session_id));
+        serialized.count(request.length());
+        serialized.end();
+        // A deterministic request seen before is replayed without touching the backend
+        bool generated = cache.replay(cache_key, on_token);
+        // and a turn close enough to one answered before gets the same answer
+        semantic::cache::probe probe;
+        if (!generated && semantic) generated = semantic->replay(session_id, client_response, on_token, probe);
+        // A reply started early on most of the turn stands in for one to all of it
+        bool speculated = false;
+        size_t speculated_from = 0; // bytes of the turn a speculation saw
+        if (speculation && generated) speculation->cancel();
+        else if (speculation && speculation->finish(client_response, on_token, generated, speculated_from)) {
+            speculated = true;
+            if (generated) {
+                model_residency::count_turn(final_chunk);
+                telemetry::record(final_chunk, persona, backends::last_used());
+            }
+        }
+        if (!generated && !speculated) {
+            // Wait our turn for the backend (no-op without -c)
+            if (residency) residency->touch();
+            trace::span queued("queue");
+            sched::scheduler::slot slot(scheduler, conversation, admission.class_for(reader.option("priority")),
+                                        admission.weight_for(reader.option("weight")), cancel.check());
+            queued.end();
+            generation_start = pacing::clock::now();
+            generated = !slot.dropped() &&
+                        cache.run(backends, "llama3.2", slot.backend, cache_key, request, on_token, [&]() { return tokens > 0; }, cancel.keep_going());
+            if (generated && !cancel.cancelled() && semantic) semantic->record(probe, client_response, output);
+            if (generated && !cancel.cancelled()) {
+                model_residency::count_turn(final_chunk);
+                telemetry::record(final_chunk, persona, backends::last_used());
+            }
+        }
+        // Nobody left to send it to: whatever we generated is thrown away, and so is the conversation
+        if (cancel.hung_up()) {
+            cancel_token::count("disconnect", tokens);
+            fprintf(stderr, "\nClient left mid-turn; generation cancelled after %d tokens\n", tokens);
+            break;
+        }
+        // Out of time: the client gets what there is, if there's anything
+        if (cancel.expired()) {
+            cancel_token::count("deadline", tokens);
+            fprintf(stderr, "\nTurn ran past its %d ms deadline; cut off after %d tokens\n", cancel.deadline(), tokens);
+            if (tokens == 0) generated = false;
+        }
+        if (generated && window) window->add_reply(output);
+        else if (generated) {
+            sessions.update(session_id, final_chunk);
+            if (speculated) sessions.carry(session_id, client_response.substr(speculated_from)); // what the speculation's context lacks
+        }
+        OLLAMA_PROBE4(generate_end, conversation, turn, output.length(), tokens);
+        if (!generated) {
+            fprintf(stderr, "Failed to generate a reply on any backend\n");
+            break;
+        }
 
-        sleep(2);
-        // Generate server response from client response
-        last_response = my_server.generate("llama3.2", client_response, last_response);
-		std::string output = last_response.as_json()["response"];
-
-        // Print server response
-        printf("%s\n", "--------------------------------------------------------------");
-        printf("SERVER: %s\n", output.c_str());
-        printf("%s\n", "--------------------------------------------------------------");
+        // Print server response (streamed: once the last paced token is out)
+        bool streamed = !stream || sender.finish();
+        if (!stream) printf("%s", output.c_str());
+        printf("\n%s\n", "--------------------------------------------------------------");
 
-		// Relay message to current client
-		if (send(sockfd, output.c_str(), output.length(), 0) == -1)
+		if (!stream) {
+            trace::span paced("pace");
+            pacer.before_send(output.length(), generation_start);
+        }
+        // Streamed tokens went out during decode; this is the total of those sends
+        if (frames > 0) trace::record("send.stream", std::chrono::duration_cast<std::chrono::microseconds>(generation_start.time_since_epoch()).count(), stream_send_us, frames);
+
+		// Relay message to current client (or close off the streamed turn)
+        trace::span sent("send", stream ? 0 : output.length());
+		if (stream) {
+			if (!streamed || !send_frame(sockfd, FRAME_END, ""))
+				perror("Failed to relay message to client");
+		}
+		else if (send(sockfd, output.c_str(), output.length(), 0) == -1)
 			perror("Failed to relay message to client");
+		pacer.turn_done();
 		
 	} while (1);
 }
@@ -82,15 +244,12 @@ void *get_in_addr(struct sockaddr *sa)
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-int main(void)
+// Binds and listens on port; -1 if it can't
+int listen_on(const char* port)
 {
-    int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd
     struct addrinfo hints, *servinfo, *p;
-    struct sockaddr_storage their_addr; // connector's address information
-    socklen_t sin_size;
-    struct sigaction sa;
+    int sockfd = -1;
     int yes=1;
-    char s[INET6_ADDRSTRLEN];
     int rv;
 
     memset(&hints, 0, sizeof hints);
@@ -98,18 +257,9 @@ int main(void)
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE; // use my IP
 
-    char startingMessage[1000];
-    // Get first message
-	do {
-        printf("Starting Message: ");
-
-		if (fgets(startingMessage, sizeof(startingMessage), stdin)) break; // Get message
-
-	} while(1);
-
-    if ((rv = getaddrinfo(NULL, PORT, &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
+        return -1;
     }
 
     // loop through all the results and bind to the first we can
@@ -123,7 +273,8 @@ int main(void)
         if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes,
                 sizeof(int)) == -1) {
             perror("setsockopt");
-            exit(1);
+            close(sockfd);
+            return -1;
         }
 
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
@@ -139,13 +290,195 @@ int main(void)
 
     if (p == NULL)  {
         fprintf(stderr, "server: failed to bind\n");
-        exit(1);
+        return -1;
     }
 
     if (listen(sockfd, BACKLOG) == -1) {
         perror("listen");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+int main(int argc, char *argv[])
+{
+    startup::began();
+    int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd
+    struct sockaddr_storage their_addr; // connector's address information
+    socklen_t sin_size;
+    struct sigaction sa;
+    char s[INET6_ADDRSTRLEN];
+    int opt;
+    bool stream = false;
+    std::string pacing_spec = "none";
+    int metrics_port = 0;
+    int context_budget = 0; // 0: ship the full context array every turn
+    std::string session_dir; // empty: sessions live only as long as their conversation
+    int concurrency = 0; // 0: conversations hit the backend whenever they like
+    sched::admission admission;
+    int workers = 0; // 0: fork a process per conversation
+    std::string backend_urls = "http://localhost:11434";
+    bool verbose = false;
+    std::string options_spec; // generation options, e.g. temperature=0,seed=42
+    int cache_entries = 0;
+    std::string cache_dir;
+    double replay_speed = 1;
+    std::string semantic_spec; // empty: no semantic cache
+    std::string residency_spec; // empty: leave loading and unloading to Ollama
+    std::string opening_text; // empty: from the persona, an admin command or the terminal
+    std::string persona_file;
+    std::string speculation_spec; // empty: wait for the whole turn
+    std::string hedge_spec; // empty: one backend per request
+    int deadline_ms = 0; // 0: a turn takes as long as it takes
+    std::string trace_spec; // empty: no tracing
+
+    while ((opt = getopt(argc, argv, "sp:m:w:d:c:q:RW:B:e:vO:C:K:r:S:L:o:f:X:H:T:t:")) != -1) {
+        switch (opt) {
+        case 's': stream = true; break; // stream tokens to the client as they're generated
+        case 'p': pacing_spec = optarg; break; // none, gap:MS, typing:CPS or budget:TPS (see pacing.hpp)
+        case 'm': metrics_port = atoi(optarg); break; // serve /metrics on this port
+        case 'w': context_budget = atoi(optarg); break; // cap the context at this many tokens, summarizing older turns
+        case 'd': session_dir = optarg; break; // save each conversation's context here, restore it on reconnect
+        case 'c': concurrency = atoi(optarg); break; // generations allowed at once on the backend; the rest queue fairly
+        case 'q': admission.default_class = sched::parse_priority(optarg); break; // class for conversations that don't pick one: interactive or batch
+        case 'R': admission.allow_raise = true; break; // let a client ask for a better class than -q
+        case 'W': admission.max_weight = atof(optarg); break; // clamp the weights clients ask for to [1/W, W] (default 8)
+        case 'B': backend_urls = optarg; break; // comma-separated Ollama URLs to balance across
+        case 'e': workers = atoi(optarg); break; // one event-driven process with this many generation workers
+        case 'v': verbose = true; break; // event-driven mode: print every turn
+        case 'O': options_spec = optarg; break; // generation options as key=value,...
+        case 'C': cache_entries = atoi(optarg); break; // replay deterministic replies, keeping this many in memory
+        case 'K': cache_dir = optarg; break; // and keep them on disk here too
+        case 'r': replay_speed = atof(optarg); break; // cached replies play back at this multiple of their original speed; 0 at once
+        case 'S': semantic_spec = optarg; break; // reuse replies to similar turns: threshold=T,budget_mb=MB,model=NAME,audit=RATE
+        case 'L': residency_spec = optarg; break; // preload the model, keep it loaded this long while in use: KEEP_ALIVE[:IDLE_S]
+        case 'o': opening_text = optarg; break; // opening message, instead of asking for one
+        case 'f': persona_file = optarg; break; // opening= and options= lines; the flags above win
+        case 'X': speculation_spec = optarg; break; // start replying to a streamed turn early: after=SENTENCES,diverge=FRACTION
+        case 'H': hedge_spec = optarg; break; // race a second backend when the first is slow to start: quantile=Q,min=MS
+        case 'T': deadline_ms = atoi(optarg); break; // give up on a turn's generation after this many ms
+        case 't': trace_spec = optarg; break; // time each turn's stages, GET /trace on the metrics port: sample=N,every=S,dir=PATH
+        default:
+            fprintf(stderr, "usage: server [-s] [-p pacing] [-m metrics_port] [-w context_tokens] [-d session_dir] [-c concurrency] [-q priority [-R]] [-W max_weight] [-B url,...] "
+                            "[-O key=value,...] [-C cache_entries] [-K cache_dir] [-r replay_speed] [-S semantic_spec] [-L keep_alive[:idle_s]] "
+                            "[-o opening] [-f persona_file] [-X speculation_spec] [-H hedge_spec] [-T deadline_ms] [-t trace_spec] [-e workers [-v]]\n");
+            exit(1);
+        }
+    }
+    startup::persona persona;
+    if (!persona_file.empty() && !startup::load_persona(persona_file, persona)) exit(1);
+    if (opening_text.empty()) opening_text = persona.opening;
+    if (options_spec.empty()) options_spec = persona.options;
+    if (!(admission.max_weight >= 1)) {
+        fprintf(stderr, "server: -W wants a weight of at least 1\n");
+        exit(1);
+    }
+    if (!pacing::make(pacing_spec)) {
+        fprintf(stderr, "server: unknown pacing policy %s\n", pacing_spec.c_str());
+        exit(1);
+    }
+    semantic::cache::settings semantic_settings;
+    if (!semantic_spec.empty() && !semantic::cache::parse(semantic_spec, semantic_settings)) {
+        fprintf(stderr, "server: bad semantic cache spec %s\n", semantic_spec.c_str());
         exit(1);
     }
+    speculator::settings speculation_settings;
+    if (!speculation_spec.empty() && !speculator::parse(speculation_spec, speculation_settings)) {
+        fprintf(stderr, "server: bad speculation spec %s\n", speculation_spec.c_str());
+        exit(1);
+    }
+    if (!speculation_spec.empty() && workers > 0) {
+        fprintf(stderr, "server: speculation (-X) needs a process per conversation; drop -e\n");
+        exit(1);
+    }
+    hedging::settings hedge_settings;
+    if (!hedge_spec.empty() && !hedging::parse(hedge_spec, hedge_settings)) {
+        fprintf(stderr, "server: bad hedge spec %s\n", hedge_spec.c_str());
+        exit(1);
+    }
+    trace::settings trace_settings;
+    if (!trace_spec.empty() && !trace::parse(trace_spec, trace_settings)) {
+        fprintf(stderr, "server: bad trace spec %s\n", trace_spec.c_str());
+        exit(1);
+    }
+    std::string keep_alive;
+    int idle_s = 0;
+    if (!residency_spec.empty() && !model_residency::parse(residency_spec, keep_alive, idle_s)) {
+        fprintf(stderr, "server: bad residency spec %s\n", residency_spec.c_str());
+        exit(1);
+    }
+
+    // Conversation processes share the metrics, the global pacing budget and the scheduler with us,
+    metrics::init_shared();
+    pacing::init_shared();
+    // and the trace rings, which we export
+    if (!trace_spec.empty()) {
+        trace::init(trace_settings, workers == 0);
+        trace::start_dumps(trace_settings);
+    }
+    // and route on the same backend state, which only we health-check
+    backends::pool* backends = new backends::pool(backend_urls, workers == 0);
+    backends->start_health_checks();
+    sched::scheduler* scheduler = nullptr;
+    if (workers == 0 && concurrency > 0) scheduler = sched::scheduler::create(backends->size(), concurrency, true);
+    model_residency* residency = nullptr;
+    if (!residency_spec.empty()) residency = new model_residency(*backends, "llama3.2", keep_alive, idle_s, workers == 0);
+
+    // The opening message: from the flags or persona if we have it, otherwise from whichever of
+    // the terminal and POST /admin/opening answers first
+    startup::opening* greeting = new startup::opening();
+    greeting->set(opening_text);
+    if (metrics_port) metrics::serve(metrics_port, [greeting](httplib::Server& server) {
+        server.Post("/admin/opening", [greeting](const httplib::Request& req, httplib::Response& res) {
+            if (greeting->set(req.body)) res.set_content("ok\n", "text/plain");
+            else {
+                res.status = 409;
+                res.set_content("opening message already set\n", "text/plain");
+            }
+        });
+        server.Get("/trace", [](const httplib::Request& req, httplib::Response& res) {
+            int64_t since = req.has_param("since") ? atoll(req.get_param_value("since").c_str()) : 0;
+            res.set_content(trace::chrome_json(since), "application/json");
+        });
+    });
+    if (opening_text.empty()) greeting->read_from_terminal();
+
+    // Listen, load the model and wait for the opening message all at once
+    std::string startingMessage;
+    startup::pipeline boot;
+    boot.stage("listen", [&sockfd]() { return (sockfd = listen_on(PORT)) != -1; });
+    if (residency) boot.stage("model", [residency]() {
+        residency->warm_up();
+        residency->start(10000, false);
+        return true;
+    });
+    boot.stage("opening", [&]() { startingMessage = greeting->wait(); return true; });
+    if (!boot.run()) exit(1);
+
+    if (workers > 0) {
+        relay::options opts;
+        opts.opening = startingMessage;
+        opts.pacing_spec = pacing_spec;
+        opts.stream = stream;
+        opts.workers = workers;
+        opts.verbose = verbose;
+        opts.context_budget = context_budget;
+        opts.session_dir = session_dir;
+        opts.concurrency = concurrency;
+        opts.admission = admission;
+        opts.options = response_cache::parse_options(options_spec);
+        opts.cache_entries = cache_entries;
+        opts.cache_dir = cache_dir;
+        opts.replay_speed = replay_speed;
+        opts.semantic_spec = semantic_spec;
+        opts.hedge_spec = hedge_spec;
+        opts.deadline_ms = deadline_ms;
+        opts.persona = persona.name;
+        printf("server: waiting for connections (%d workers)...\n", opts.workers);
+        relay::event_server(sockfd, opts, *backends, residency).run();
+        return 1;
+    }
 
     sa.sa_handler = sigchld_handler; // reap all dead processes
     sigemptyset(&sa.sa_mask);
@@ -174,11 +507,24 @@ int main(void)
             close(sockfd); // child doesn't need the listener
             // Print first message
             printf("%s\n", "--------------------------------------------------------------");
-		    printf("SERVER: %s\n", startingMessage);
+		    printf("SERVER: %s\n", startingMessage.c_str());
             printf("%s\n", "--------------------------------------------------------------");
-            if (send(new_fd, startingMessage, strlen(startingMessage), 0) == -1)
+            if (send(new_fd, startingMessage.c_str(), startingMessage.length(), 0) == -1)
                 perror("send");
-            chat(new_fd);
+            std::unique_ptr<pacing::policy> pacer = pacing::make(pacing_spec); // each conversation paces itself
+            std::shared_ptr<context_window> window;
+            if (context_budget > 0) window = std::make_shared<context_window>(*backends, "llama3.2", context_budget);
+            session_store sessions(session_dir);
+            response_cache cache(cache_entries, cache_dir, replay_speed);
+            std::unique_ptr<hedging::hedger> hedger = hedging::make(hedge_spec, deadline_ms > 0);
+            if (hedger) hedger->limit(scheduler); // a hedge is one more generation under -c
+            cache.hedge(hedger.get());
+            std::unique_ptr<semantic::cache> semantic;
+            if (!semantic_spec.empty()) semantic = semantic::cache::make(*backends, "llama3.2", semantic_spec);
+            std::unique_ptr<speculator> speculation;
+            if (!speculation_spec.empty()) speculation.reset(new speculator(speculation_settings));
+            chat(new_fd, stream, *pacer, *backends, window, sessions, "conv-" + std::to_string(getpid()), scheduler, admission,
+                 cache, response_cache::parse_options(options_spec), semantic.get(), residency, speculation.get(), deadline_ms, persona.name);
             close(new_fd);
             exit(0);
         }
@@ -0,0 +1,248 @@
+/*
+** pacing.hpp -- how long an AI peer waits before and while replying
+**
+** Replaces the fixed sleep(2) before every generation. Each conversation owns
+** its own policy, built from a spec string:
+**
+**   none         reply as soon as possible
+**   gap:MS       keep at least MS milliseconds between the end of our turns
+**   typing:CPS   let the reply out no faster than CPS characters per second,
+**                as if someone were typing it (generation time counts)
+**   budget:TPS   all conversations together start at most TPS turns per
+**                second, evenly spaced, to smooth the load on the backend
+**
+** The total delay a policy adds to each turn goes into the
+** pacing_delay_ms{policy="..."} histogram.
+**
+** A streamed reply goes out through a paced_sender, which holds back the
+** tokens the policy isn't ready to let out on a thread of its own: the
+** generation producing them, and the backend and queue slot it holds, finish
+** at the backend's speed however slowly the reply is "typed".
+*/
+
+#ifndef PACING_HPP
+#define PACING_HPP
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "metrics.hpp"
+
+namespace pacing
+{
+    using clock = std::chrono::steady_clock;
+    using std::chrono::milliseconds;
+
+    class policy {
+        public:
+            policy(const std::string& name): name(name), delay_ms("pacing_delay_ms", "policy=\"" + name + "\"") {}
+            virtual ~policy() {}
+
+            // Sleeps for however long the policy wants before generating the next reply
+            void before_generate() { wait(generate_delay()); }
+
+            // Sleeps until reply_bytes of the reply may go out, given when generation started.
+            // Call once with the whole reply, or once per streamed token with the running total.
+            void before_send(size_t reply_bytes, clock::time_point generation_start) { wait(send_delay(reply_bytes, generation_start)); }
+
+            // For callers that schedule the waits themselves instead of sleeping: how long to hold
+            // off generating, or sending reply_bytes, and the extra time that actually cost the turn
+            virtual clock::duration generate_delay() { return clock::duration::zero(); }
+            virtual clock::duration send_delay(size_t, clock::time_point) { return clock::duration::zero(); }
+            void add_delay(clock::duration d) { if (d > clock::duration::zero()) turn_delay += d; }
+
+            // The whole reply is out; records this turn's delay
+            void turn_done()
+            {
+                last_turn_end = clock::now();
+                delay_ms.observe(std::chrono::duration<double, std::milli>(turn_delay).count());
+                turn_delay = clock::duration::zero();
+            }
+
+            const std::string name;
+
+        protected:
+            clock::time_point last_turn_end;
+
+        private:
+            void wait(clock::duration d)
+            {
+                if (d <= clock::duration::zero()) return;
+                add_delay(d);
+                std::this_thread::sleep_for(d);
+            }
+
+            metrics::histogram delay_ms;
+            clock::duration turn_delay = clock::duration::zero();
+    };
+
+    class no_delay: public policy {
+        public:
+            no_delay(): policy("none") {}
+    };
+
+    class min_gap: public policy {
+        public:
+            min_gap(int ms): policy("gap"), gap(ms) {}
+            clock::duration generate_delay() override
+            {
+                if (last_turn_end == clock::time_point()) return clock::duration::zero();
+                return last_turn_end + gap - clock::now();
+            }
+        private:
+            milliseconds gap;
+    };
+
+    class typing: public policy {
+        public:
+            typing(double chars_per_second): policy("typing"), cps(chars_per_second > 0 ? chars_per_second : 1) {}
+            clock::duration send_delay(size_t reply_bytes, clock::time_point generation_start) override
+            {
+                auto typed_by = generation_start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(reply_bytes / cps));
+                return typed_by - clock::now();
+            }
+        private:
+            double cps;
+    };
+
+    // Sends one streamed reply's pieces no sooner than policy p lets them out, without making the
+    // caller wait: pieces that are due go out at once, the rest from a thread of its own, in order.
+    class paced_sender {
+        public:
+            using send_fn = std::function<bool(const std::string&)>;
+
+            // generation_start is read as each piece is paced, so it can still be moved once queueing is over
+            paced_sender(policy& p, const clock::time_point& generation_start, send_fn send):
+                p(p), generation_start(generation_start), send(send) {}
+            ~paced_sender() { stop(true); }
+
+            // The reply so far is reply_bytes long, piece included
+            void push(const std::string& piece, size_t reply_bytes)
+            {
+                std::unique_lock<std::mutex> hold(lock);
+                if (failed || abandoned) return;
+                if (queue.empty() && !sending && p.send_delay(reply_bytes, generation_start) <= clock::duration::zero()) {
+                    sending = true;
+                    hold.unlock();
+                    bool ok = send(piece);
+                    hold.lock();
+                    sending = false;
+                    failed = failed || !ok;
+                    changed.notify_all();
+                    return;
+                }
+                queue.push_back(std::make_pair(piece, reply_bytes));
+                if (!worker.joinable()) worker = std::thread([this]() { run(); });
+                changed.notify_all();
+            }
+
+            // Waits for everything pushed to go out. False if a send failed.
+            bool finish() { stop(false); return !failed; }
+
+            // Drops whatever hasn't gone out yet
+            void abandon() { stop(true); }
+
+        private:
+            void stop(bool drop)
+            {
+                {
+                    std::lock_guard<std::mutex> hold(lock);
+                    if (drop) { abandoned = true; queue.clear(); }
+                    done = true;
+                    changed.notify_all();
+                }
+                if (worker.joinable()) worker.join();
+            }
+
+            void run()
+            {
+                std::unique_lock<std::mutex> hold(lock);
+                while (true) {
+                    changed.wait(hold, [&]() { return (!queue.empty() && !sending) || done; });
+                    if (queue.empty() || abandoned) return;
+                    std::pair<std::string, size_t> next = queue.front();
+                    queue.pop_front();
+                    sending = true;
+                    hold.unlock();
+                    clock::duration d = p.send_delay(next.second, generation_start);
+                    if (d > clock::duration::zero()) {
+                        p.add_delay(d);
+                        std::this_thread::sleep_for(d);
+                    }
+                    bool ok = !abandoned && send(next.first);
+                    hold.lock();
+                    sending = false;
+                    if (!ok) { failed = true; queue.clear(); }
+                }
+            }
+
+            policy& p;
+            const clock::time_point& generation_start;
+            send_fn send;
+
+            std::mutex lock;
+            std::condition_variable changed;
+            std::deque<std::pair<std::string, size_t>> queue;
+            std::thread worker;
+            bool sending = false, done = false, failed = false;
+            std::atomic<bool> abandoned{false};
+    };
+
+    // Next free turn start, shared by every conversation (and, after init_shared(), every process)
+    inline std::atomic<int64_t>*& budget_slot() { static std::atomic<int64_t>* slot = nullptr; return slot; }
+
+    // Call before forking so budget:TPS is enforced across all conversation processes
+    inline bool init_shared()
+    {
+        void* mem = mmap(nullptr, sizeof(std::atomic<int64_t>), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) { perror("pacing: mmap"); return false; }
+        budget_slot() = new (mem) std::atomic<int64_t>(0);
+        return true;
+    }
+
+    class global_budget: public policy {
+        public:
+            global_budget(double turns_per_second): policy("budget"),
+                interval_ns((int64_t)(1e9 / (turns_per_second > 0 ? turns_per_second : 1)))
+            {
+                if (!budget_slot()) budget_slot() = new std::atomic<int64_t>(0);
+            }
+            // Claims the next evenly spaced start time
+            clock::duration generate_delay() override
+            {
+                int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now().time_since_epoch()).count();
+                int64_t next = budget_slot()->load();
+                int64_t start;
+                do {
+                    start = next > now ? next : now;
+                } while (!budget_slot()->compare_exchange_weak(next, start + interval_ns));
+                return std::chrono::nanoseconds(start - now);
+            }
+        private:
+            int64_t interval_ns;
+    };
+
+    // Builds a policy from its spec; nullptr if the spec isn't recognised
+    inline std::unique_ptr<policy> make(const std::string& spec)
+    {
+        std::string kind = spec.substr(0, spec.find(':'));
+        std::string arg = spec.find(':') == std::string::npos ? "" : spec.substr(spec.find(':') + 1);
+
+        if (kind == "none") return std::unique_ptr<policy>(new no_delay());
+        if (arg.empty()) return nullptr;
+        if (kind == "gap") return std::unique_ptr<policy>(new min_gap(atoi(arg.c_str())));
+        if (kind == "typing") return std::unique_ptr<policy>(new typing(atof(arg.c_str())));
+        if (kind == "budget") return std::unique_ptr<policy>(new global_budget(atof(arg.c_str())));
+        return nullptr;
+    }
+}
+
+#endif
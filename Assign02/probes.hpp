@@ -0,0 +1,37 @@
+/*
+** probes.hpp -- USDT tracepoints for the AI relay
+**
+** Same scheme as Assign01/probes.h: with systemtap's <sys/sdt.h> each probe is
+** a nop that perf/bpftrace patch only while attached; without it (or with
+** -DNO_USDT) the macros compile away.
+**
+**   bpftrace -e 'usdt:./server:ollama_relay:generate_start { @s[arg0, arg1] = nsecs; }
+**                usdt:./server:ollama_relay:first_token { @ttft_ms = hist((nsecs - @s[arg0, arg1]) / 1000000); }'
+**
+** Probes (conversation is the handling process's pid, turn counts from 1):
+**   generate_start(conversation, turn, prompt_bytes)
+**   first_token(conversation, turn)
+**   generate_end(conversation, turn, reply_bytes, tokens)
+*/
+
+#ifndef PROBES_HPP
+#define PROBES_HPP
+
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT 1
+#endif
+#endif
+
+#ifdef HAVE_USDT
+#define OLLAMA_PROBE2(name, a, b)           DTRACE_PROBE2(ollama_relay, name, a, b)
+#define OLLAMA_PROBE3(name, a, b, c)        DTRACE_PROBE3(ollama_relay, name, a, b, c)
+#define OLLAMA_PROBE4(name, a, b, c, d)     DTRACE_PROBE4(ollama_relay, name, a, b, c, d)
+#else
+#define OLLAMA_PROBE2(name, a, b)           do { } while (0)
+#define OLLAMA_PROBE3(name, a, b, c)        do { } while (0)
+#define OLLAMA_PROBE4(name, a, b, c, d)     do { } while (0)
+#endif
+
+#endif
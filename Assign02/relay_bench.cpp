@@ -0,0 +1,375 @@
+/*
+** relay_bench.cpp -- end-to-end benchmark of the AI relay
+**
+** Starts the server binary (with whatever flags are under test) against a
+** backend -- by default a mock Ollama running inside this process -- and plays
+** the client side of N conversations over the real socket protocol, replying
+** to each server turn through a backend the way ollama_client does. Every
+** server turn is timed from the moment our turn went out:
+**
+**   ttft_ms   until the first piece of the reply arrives (meaningful with -s)
+**   turn_ms   until the reply is complete
+**
+** and, with the mock, the bytes of the server's generate requests are counted
+** at the backend. With several conversations in flight a turn is charged the
+** mean request size over its own duration; with one it's exact.
+**
+** Scenarios:
+**   steady  every conversation starts at once; measured for -D seconds after -W of warmup
+**   ramp    conversations start evenly over -R seconds; measured from then until -D after the last
+**   long    each conversation runs -u turns; results also broken down by turn number
+**
+** Results are JSON with sorted keys, so runs from two builds diff cleanly:
+**
+**   relay_bench -x steady -c 16 -s -a "-e 4" -m token_ms=10,lengths=normal:40:10 > after.json
+**
+** The server listens on its fixed port, so only one benchmark can run at a time.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ollama.hpp"
+#include "chat_protocol.hpp"
+#include "backends.hpp"
+#include "mock_ollama.hpp"
+#include "bench.hpp"
+
+#define PORT "3490" // where the server under test listens
+
+using bench_clock = bench::clock;
+
+struct config {
+    std::string scenario = "steady";
+    int conversations = 4;
+    double duration_s = 10;
+    double ramp_s = 5;
+    double warmup_s = 2;
+    int turns = 20;
+    std::string server_path = "./server";
+    std::string server_args;
+    bool stream = false;
+    std::string backend_url; // empty: run the mock in-process
+    std::string mock_spec;
+    mock::profile profile;
+    int mock_port = 11600;
+    std::string opening = "Hello! What should we talk about today?";
+    bool verbose = false;
+};
+
+// One server turn, as the client side saw it
+struct sample {
+    int conversation;
+    int turn;         // from 1
+    double end_s;     // since the benchmark started
+    double ttft_ms;
+    double turn_ms;
+    int tokens;
+    size_t bytes;
+    double request_bytes; // -1 when the backend isn't ours to count
+};
+
+struct run_state {
+    bench_clock::time_point start;
+    std::atomic<bool> stop{false};
+    mock::backend* server_mock = nullptr;
+    std::unique_ptr<backends::pool> peer_backends;
+
+    std::mutex lock;
+    std::vector<sample> samples;
+    std::vector<int> fds;
+    int failures = 0;
+};
+
+// The client side of one conversation
+static void converse(int index, double start_at_s, const config& cfg, run_state& state)
+{
+    std::this_thread::sleep_until(state.start + std::chrono::milliseconds((int)(start_at_s * 1000)));
+    if (state.stop) return;
+
+    int fd = bench::connect_server(PORT, 10);
+    if (fd == -1) {
+        fprintf(stderr, "relay_bench: conversation %d could not connect\n", index);
+        std::lock_guard<std::mutex> hold(state.lock);
+        state.failures++;
+        return;
+    }
+    int yes = 1;
+    if (cfg.stream && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) == -1) perror("setsockopt TCP_NODELAY");
+    {
+        std::lock_guard<std::mutex> hold(state.lock);
+        state.fds.push_back(fd);
+    }
+
+    turn_reader reader(fd);
+    std::string server_turn;
+    bool ok = reader.read_turn(server_turn); // the opening message, nothing generated yet
+
+    for (int turn = 1; ok && !state.stop && (cfg.scenario != "long" || turn <= cfg.turns); turn++) {
+        // Our reply, generated the way ollama_client does
+        std::string output;
+        bool peer_gone = false;
+        bool generated = state.peer_backends->run("llama3.2", -1, [&](Ollama& ollama) {
+            ollama.generate("llama3.2", server_turn, [&](const ollama::response& token) {
+                const std::string& piece = token.as_simple_string();
+                output += piece;
+                if (cfg.stream && !piece.empty() && !peer_gone && !send_frame(fd, FRAME_TOKEN, piece)) peer_gone = true;
+            });
+        }, [&]() { return !output.empty(); });
+        if (!generated) { fprintf(stderr, "relay_bench: conversation %d: peer generation failed\n", index); ok = false; break; }
+        if (cfg.stream) ok = !peer_gone && send_frame(fd, FRAME_END, "");
+        else ok = send(fd, output.c_str(), output.length(), MSG_NOSIGNAL) != -1;
+        if (!ok) break;
+
+        // The server's turn
+        bench_clock::time_point sent = bench_clock::now(), first;
+        int64_t generations = state.server_mock ? state.server_mock->counters().generations.load() : 0;
+        int64_t request_bytes = state.server_mock ? state.server_mock->counters().request_bytes.load() : 0;
+        int chunks = 0;
+        ok = reader.read_turn(server_turn, [&](const std::string&) { if (chunks++ == 0) first = bench_clock::now(); });
+        if (!ok) break;
+        bench_clock::time_point end = bench_clock::now();
+
+        sample s;
+        s.conversation = index;
+        s.turn = turn;
+        s.end_s = bench::since(state.start, end);
+        s.ttft_ms = std::chrono::duration<double, std::milli>((chunks ? first : end) - sent).count();
+        s.turn_ms = std::chrono::duration<double, std::milli>(end - sent).count();
+        s.tokens = cfg.stream ? chunks : (int)((server_turn.length() + 3) / 4); // a frame per token when streamed
+        s.bytes = server_turn.length();
+        s.request_bytes = -1;
+        if (state.server_mock) {
+            int64_t n = state.server_mock->counters().generations.load() - generations;
+            s.request_bytes = n > 0 ? (double)(state.server_mock->counters().request_bytes.load() - request_bytes) / n : 0;
+        }
+        std::lock_guard<std::mutex> hold(state.lock);
+        state.samples.push_back(s);
+    }
+
+    if (!ok && !state.stop) {
+        std::lock_guard<std::mutex> hold(state.lock);
+        state.failures++;
+    }
+    shutdown(fd, SHUT_RDWR);
+}
+
+// Resident set of a process and all its descendants (forked conversations included)
+static long tree_rss_kb(pid_t pid, int& processes)
+{
+    processes++;
+    long kb = 0;
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    for (std::string line; std::getline(status, line); )
+        if (line.compare(0, 6, "VmRSS:") == 0) kb = atol(line.c_str() + 6);
+
+    std::ifstream children("/proc/" + std::to_string(pid) + "/task/" + std::to_string(pid) + "/children");
+    for (pid_t child; children >> child; ) kb += tree_rss_kb(child, processes);
+    return kb;
+}
+
+static nlohmann::json report(const config& cfg, const run_state& state, double from_s, double to_s,
+                             const std::vector<std::vector<long>>& rss)
+{
+    std::vector<double> ttft, turn_ms, request_bytes;
+    int64_t tokens = 0;
+    std::map<int, std::vector<const sample*>> by_turn;
+    for (const sample& s : state.samples) {
+        if (s.end_s < from_s || s.end_s > to_s) continue;
+        ttft.push_back(s.ttft_ms);
+        turn_ms.push_back(s.turn_ms);
+        if (s.request_bytes >= 0) request_bytes.push_back(s.request_bytes);
+        tokens += s.tokens;
+        by_turn[s.turn].push_back(&s);
+    }
+    double window = to_s > from_s ? to_s - from_s : 0;
+
+    nlohmann::json j;
+    j["benchmark"] = "relay_bench";
+    j["config"] = {
+        {"scenario", cfg.scenario}, {"conversations", cfg.conversations}, {"stream", cfg.stream},
+        {"server_args", cfg.server_args}, {"backend", cfg.backend_url.empty() ? "mock" : cfg.backend_url},
+        {"mock", cfg.backend_url.empty() ? cfg.mock_spec : ""} };
+    if (cfg.scenario == "long") j["config"]["turns"] = cfg.turns;
+    else j["config"]["duration_s"] = cfg.duration_s;
+    if (cfg.scenario == "ramp") j["config"]["ramp_s"] = cfg.ramp_s;
+    if (cfg.scenario == "steady") j["config"]["warmup_s"] = cfg.warmup_s;
+
+    j["window_s"] = window;
+    j["turns"] = turn_ms.size();
+    j["failures"] = state.failures;
+    j["turns_per_sec"] = window > 0 ? turn_ms.size() / window : 0;
+    j["tokens_per_sec"] = window > 0 ? tokens / window : 0;
+    j["ttft_ms"] = bench::distribution(ttft);
+    j["turn_ms"] = bench::distribution(turn_ms);
+    j["request_bytes_per_turn"] = request_bytes.empty() ? nlohmann::json() : bench::distribution(request_bytes);
+
+    long peak = 0;
+    nlohmann::json samples = nlohmann::json::array();
+    for (const std::vector<long>& r : rss) {
+        peak = std::max(peak, r[1]);
+        samples.push_back({ r[0] / 1000.0, r[1], r[2] }); // [seconds, kB, processes]
+    }
+    j["rss_kb"] = { {"peak", peak}, {"samples", samples} };
+
+    if (cfg.scenario == "long") {
+        nlohmann::json turns = nlohmann::json::array();
+        for (auto& entry : by_turn) {
+            std::vector<double> t, bytes;
+            for (const sample* s : entry.second) {
+                t.push_back(s->turn_ms);
+                if (s->request_bytes >= 0) bytes.push_back(s->request_bytes);
+            }
+            nlohmann::json row = { {"turn", entry.first}, {"turn_ms", bench::distribution(t)} };
+            if (!bytes.empty()) row["request_bytes"] = bench::distribution(bytes)["mean"];
+            turns.push_back(row);
+        }
+        j["by_turn"] = turns;
+    }
+    return j;
+}
+
+int main(int argc, char* argv[])
+{
+    config cfg;
+    std::string output;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "x:c:D:R:W:u:S:a:sB:m:P:o:v")) != -1) {
+        switch (opt) {
+        case 'x': cfg.scenario = optarg; break; // steady, ramp or long
+        case 'c': cfg.conversations = atoi(optarg); break;
+        case 'D': cfg.duration_s = atof(optarg); break; // measured seconds (steady, ramp)
+        case 'R': cfg.ramp_s = atof(optarg); break; // seconds to bring every conversation up (ramp)
+        case 'W': cfg.warmup_s = atof(optarg); break; // seconds left out of the results (steady)
+        case 'u': cfg.turns = atoi(optarg); break; // server turns per conversation (long)
+        case 'S': cfg.server_path = optarg; break; // server binary under test
+        case 'a': cfg.server_args = optarg; break; // extra server flags, e.g. "-e 4 -w 512"
+        case 's': cfg.stream = true; break; // stream both sides (passes -s to the server)
+        case 'B': cfg.backend_url = optarg; break; // a real Ollama instead of the in-process mock
+        case 'm': cfg.mock_spec = optarg; break; // mock profile as key=value,... (see mock_ollama.hpp)
+        case 'P': cfg.mock_port = atoi(optarg); break; // mock for the server here, the peer's on the next port
+        case 'o': output = optarg; break; // write the JSON here instead of stdout
+        case 'v': cfg.verbose = true; break; // let the server's output through
+        default:
+            fprintf(stderr, "usage: relay_bench [-x steady|ramp|long] [-c conversations] [-D seconds] [-R ramp_seconds] [-W warmup_seconds] "
+                            "[-u turns] [-S server] [-a server_args] [-s] [-B url | -m key=value,...] [-P mock_port] [-o file] [-v]\n");
+            exit(1);
+        }
+    }
+    if (cfg.scenario != "steady" && cfg.scenario != "ramp" && cfg.scenario != "long") {
+        fprintf(stderr, "relay_bench: unknown scenario %s\n", cfg.scenario.c_str());
+        exit(1);
+    }
+    std::istringstream fields(cfg.mock_spec);
+    for (std::string field; std::getline(fields, field, ','); ) {
+        size_t eq = field.find('=');
+        if (eq == std::string::npos || !mock::set(cfg.profile, field.substr(0, eq), field.substr(eq + 1))) {
+            fprintf(stderr, "relay_bench: bad mock setting %s\n", field.c_str());
+            exit(1);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // Backends: the server's mock is the one we count requests on; the peer gets its own
+    std::unique_ptr<mock::backend> server_mock, peer_mock;
+    std::string server_url = cfg.backend_url, peer_url = cfg.backend_url;
+    if (cfg.backend_url.empty()) {
+        server_mock.reset(new mock::backend(cfg.profile));
+        peer_mock.reset(new mock::backend(cfg.profile));
+        server_mock->start("127.0.0.1", cfg.mock_port);
+        peer_mock->start("127.0.0.1", cfg.mock_port + 1);
+        server_url = "http://127.0.0.1:" + std::to_string(cfg.mock_port);
+        peer_url = "http://127.0.0.1:" + std::to_string(cfg.mock_port + 1);
+    }
+
+    run_state state;
+    state.server_mock = server_mock.get();
+    state.peer_backends.reset(new backends::pool(peer_url));
+
+    // The server in its own process group, opening message on stdin
+    std::vector<std::string> args = { cfg.server_path, "-B", server_url };
+    if (cfg.stream) args.push_back("-s");
+    std::istringstream extra(cfg.server_args);
+    for (std::string arg; extra >> arg; ) args.push_back(arg); // later flags win, so these can override the above
+    pid_t server = bench::start_server(args, cfg.opening + "\n", cfg.verbose);
+    if (server == -1) exit(1);
+    state.start = bench_clock::now();
+
+    // Resident memory of the server (and its conversation processes) every half second
+    std::vector<std::vector<long>> rss;
+    std::thread sampler([&]() {
+        while (!state.stop) {
+            int processes = 0;
+            long kb = tree_rss_kb(server, processes);
+            long ms = (long)(bench::since(state.start, bench_clock::now()) * 1000);
+            {
+                std::lock_guard<std::mutex> hold(state.lock);
+                rss.push_back({ ms, kb, processes });
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        }
+    });
+
+    std::vector<std::thread> conversations;
+    for (int i = 0; i < cfg.conversations; i++) {
+        double start_at = cfg.scenario == "ramp" && cfg.conversations > 1 ? cfg.ramp_s * i / (cfg.conversations - 1) : 0;
+        conversations.emplace_back(converse, i, start_at, std::cref(cfg), std::ref(state));
+    }
+
+    double from_s = 0, to_s;
+    if (cfg.scenario == "long") {
+        for (std::thread& t : conversations) t.join();
+        to_s = bench::since(state.start, bench_clock::now());
+        state.stop = true;
+    }
+    else {
+        if (cfg.scenario == "steady") from_s = cfg.warmup_s;
+        to_s = from_s + (cfg.scenario == "ramp" ? cfg.ramp_s : 0) + cfg.duration_s;
+        std::this_thread::sleep_until(state.start + std::chrono::milliseconds((int)(to_s * 1000)));
+        state.stop = true;
+        {
+            // Wake conversations blocked on the server
+            std::lock_guard<std::mutex> hold(state.lock);
+            for (int fd : state.fds) shutdown(fd, SHUT_RDWR);
+        }
+        for (std::thread& t : conversations) t.join();
+    }
+    sampler.join();
+    for (int fd : state.fds) close(fd);
+
+    kill(-server, SIGTERM);
+    waitpid(server, NULL, 0);
+    if (server_mock) server_mock->stop();
+    if (peer_mock) peer_mock->stop();
+
+    std::string json = report(cfg, state, from_s, to_s, rss).dump(2) + "\n";
+    if (output.empty()) fputs(json.c_str(), stdout);
+    else {
+        std::ofstream out(output);
+        out << json;
+        if (!out) { perror("relay_bench: write"); return 1; }
+    }
+    return 0;
+}
@@ -0,0 +1,553 @@
+/*
+** replay_bench.cpp -- recorded conversations replayed as load
+**
+** Reads transcripts (see transcript.hpp) and plays them against a server,
+** keeping each turn's timing and size, then reports how the server kept up
+** compared with the recording. -c plays every transcript that many times at
+** once, started -R seconds apart; -z compresses the recorded timing, so
+** -z 10 has the replayed side answer ten times as fast as it did.
+**
+** Targets:
+**   relay  the AI relay (ollama_server). We're the client side, sending its
+**          recorded turns after its recorded delays; the server generates
+**          its side live. Each server turn's turn_ms and ttft_ms are set
+**          against how long the recorded server took, and its reply size
+**          against the recorded one. The backend is a mock fitted to the
+**          transcripts (reply lengths and token rate from the server's
+**          recorded turns; -m overrides it) unless -B names a real one. The
+**          server's opening message is the first transcript's.
+**   chat   the Assign01 chat server. Every speaker of every copy is a client
+**          in the lobby, sending its recorded messages on the recorded
+**          (compressed) schedule; each message is timed until the others in
+**          its copy have it (delivery_ms), and against when the recording
+**          says it appeared (lag_ms). Every copy shares the lobby, so each
+**          message fans out to all of them.
+**
+**   replay_bench -x relay -t demo.txt -c 20 -z 4 -S ./server -a "-e 4" -s > relay.json
+**   replay_bench -x chat -t demo.txt -c 100 -z 20 -S ../Assign01/server
+**
+** Results are JSON with sorted keys, as relay_bench's are.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ollama.hpp"
+#include "chat_protocol.hpp"
+#include "mock_ollama.hpp"
+#include "transcript.hpp"
+#include "bench.hpp"
+
+#define PORT "3490" // where the server under test listens
+
+#define CHAT_NAME_LEN    6    // the chat server reads a username of up to this many bytes
+#define CHAT_HEADER_LEN  7    // and puts it, NUL padded, in front of every message it relays
+#define CHAT_MESSAGE_LEN 1024 // the most it reads of a message (its -m)
+
+struct config {
+    std::string target = "relay";
+    std::vector<std::string> transcripts;
+    int copies = 1;
+    double compression = 1;
+    double stagger_s = 0;
+    double chars_per_s = transcript::CHARS_PER_S;
+    std::string server_path = "./server";
+    std::string server_args;
+    bool stream = false;
+    std::string backend_url; // empty: run the mock in-process
+    std::string mock_spec;
+    mock::profile profile;
+    int mock_port = 11600;
+    bool verbose = false;
+};
+
+// One replayed turn next to the recording of it
+struct sample {
+    int copy;
+    int turn;
+    double end_s;        // since the replay started
+    double recorded_ms;  // how long the recorded speaker took
+    double ttft_ms;      // relay: until the first piece of the reply
+    double turn_ms;      // relay: until the whole reply; chat: until the peer had it (delivery)
+    double lag_ms;       // chat: behind the recorded schedule
+    size_t recorded_bytes;
+    size_t bytes;
+};
+
+struct run_state {
+    bench::clock::time_point start;
+    std::atomic<bool> stop{false};
+
+    std::mutex lock;
+    std::vector<sample> samples;
+    std::vector<int> fds;
+    int failures = 0;
+    int messages = 0; // chat: sent
+};
+
+static void failed(run_state& state)
+{
+    std::lock_guard<std::mutex> hold(state.lock);
+    state.failures++;
+}
+
+static void sleep_until(const run_state& state, bench::clock::time_point t)
+{
+    while (!state.stop && bench::clock::now() < t)
+        std::this_thread::sleep_until(std::min(t, bench::clock::now() + std::chrono::milliseconds(100)));
+}
+
+static bench::clock::time_point after(bench::clock::time_point t, double s)
+{
+    return t + std::chrono::microseconds((int64_t)(s * 1e6));
+}
+
+static double ms_between(bench::clock::time_point from, bench::clock::time_point to)
+{
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+// The relay's client side of one copy of a conversation. Speaker 0 is the server's.
+static void replay_relay(int copy, const transcript::conversation& c, double start_at_s, const config& cfg, run_state& state)
+{
+    sleep_until(state, after(state.start, start_at_s));
+    if (state.stop) return;
+
+    int fd = bench::connect_server(PORT, 10);
+    if (fd == -1) {
+        fprintf(stderr, "replay_bench: copy %d could not connect\n", copy);
+        failed(state);
+        return;
+    }
+    int yes = 1;
+    if (cfg.stream && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) == -1) perror("setsockopt TCP_NODELAY");
+    {
+        std::lock_guard<std::mutex> hold(state.lock);
+        state.fds.push_back(fd);
+    }
+
+    turn_reader reader(fd);
+    std::string server_turn;
+    bool ok = reader.read_turn(server_turn); // the opening message, nothing generated yet
+    bench::clock::time_point heard = bench::clock::now(), sent = heard;
+
+    for (size_t i = 1; ok && !state.stop && i < c.turns.size(); i++) {
+        const transcript::turn& t = c.turns[i];
+        bench::clock::time_point due = after(heard, c.duration_s(i) / cfg.compression);
+
+        if (t.speaker != 0) {
+            // Ours: as long as the recorded client took, streamed over that time with -s
+            if (cfg.stream) {
+                std::vector<std::string> pieces;
+                for (size_t start = 0; start < t.text.length(); ) {
+                    size_t space = t.text.find(' ', start + 1);
+                    size_t end = space == std::string::npos ? t.text.length() : space;
+                    pieces.push_back(t.text.substr(start, end - start));
+                    start = end;
+                }
+                for (size_t k = 0; ok && k < pieces.size(); k++) {
+                    sleep_until(state, heard + (due - heard) * (k + 1) / pieces.size());
+                    ok = send_frame(fd, FRAME_TOKEN, pieces[k]);
+                }
+                ok = ok && send_frame(fd, FRAME_END, "");
+            }
+            else {
+                sleep_until(state, due);
+                ok = send(fd, t.text.c_str(), t.text.length(), MSG_NOSIGNAL) != -1;
+            }
+            sent = bench::clock::now();
+            continue;
+        }
+
+        // The server's, generated live
+        bench::clock::time_point first;
+        int chunks = 0;
+        ok = reader.read_turn(server_turn, [&](const std::string&) { if (chunks++ == 0) first = bench::clock::now(); });
+        if (!ok) break;
+        heard = bench::clock::now();
+
+        sample s;
+        s.copy = copy;
+        s.turn = i;
+        s.end_s = bench::since(state.start, heard);
+        s.recorded_ms = c.duration_s(i) * 1000;
+        s.ttft_ms = ms_between(sent, chunks ? first : heard);
+        s.turn_ms = ms_between(sent, heard);
+        s.lag_ms = 0;
+        s.recorded_bytes = t.text.length();
+        s.bytes = server_turn.length();
+        std::lock_guard<std::mutex> hold(state.lock);
+        state.samples.push_back(s);
+    }
+
+    if (!ok && !state.stop) failed(state);
+    shutdown(fd, SHUT_RDWR);
+}
+
+// One copy of a conversation in the chat server's lobby: a client per speaker
+struct chat_copy {
+    int copy;
+    const transcript::conversation* c;
+    std::vector<int> fds;            // by speaker
+    std::vector<std::string> headers; // by speaker: the name as the server puts it in front of a message
+    std::vector<std::string> texts;   // by turn: what goes on the wire
+    std::unique_ptr<std::atomic<int64_t>[]> sent_us; // by turn, since start; 0 until sent
+    bench::clock::time_point start;
+};
+
+// Message text as the chat server relays it: one line, cut to what it reads
+static std::string chat_line(const std::string& text)
+{
+    std::string line = text.substr(0, CHAT_MESSAGE_LEN - 1);
+    for (char& ch : line) if (ch == '\n' || ch == '\r' || ch == '\0') ch = ' ';
+    return line + "\n";
+}
+
+// Connects and names one client; -1 if the server wasn't having it
+static int chat_join(const std::string& name)
+{
+    int fd = bench::connect_server(PORT, 10);
+    if (fd == -1) return -1;
+    char prompt[CHAT_MESSAGE_LEN];
+    if (recv(fd, prompt, sizeof prompt, 0) < 1 || send(fd, name.c_str(), name.length(), MSG_NOSIGNAL) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Reads what speaker receives, picking out its copy's messages in the order they were sent
+static void chat_receive(chat_copy& cc, int speaker, const config& cfg, run_state& state)
+{
+    const transcript::conversation& c = *cc.c;
+    std::string buffer;
+    char chunk[4096];
+    size_t next = 0;
+    auto skip_own = [&]() { while (next < c.turns.size() && c.turns[next].speaker == speaker) next++; };
+    skip_own();
+
+    while (next < c.turns.size() && !state.stop) {
+        struct pollfd p = { cc.fds[speaker], POLLIN, 0 };
+        if (poll(&p, 1, 100) < 1) continue;
+        ssize_t n = recv(cc.fds[speaker], chunk, sizeof chunk, 0);
+        if (n < 1) break;
+        bench::clock::time_point arrived = bench::clock::now();
+        buffer.append(chunk, n);
+
+        while (next < c.turns.size()) {
+            const std::string& header = cc.headers[c.turns[next].speaker];
+            size_t at = buffer.find(header);
+            if (at == std::string::npos) {
+                if (buffer.length() >= CHAT_HEADER_LEN) buffer.erase(0, buffer.length() - (CHAT_HEADER_LEN - 1)); // all someone else's
+                break;
+            }
+            size_t end = buffer.find('\n', at + header.length());
+            if (end == std::string::npos) {
+                buffer.erase(0, at);
+                break;
+            }
+            buffer.erase(0, end + 1);
+
+            int64_t arrived_us = std::chrono::duration_cast<std::chrono::microseconds>(arrived - cc.start).count();
+            sample s;
+            s.copy = cc.copy;
+            s.turn = next;
+            s.end_s = bench::since(state.start, arrived);
+            s.recorded_ms = c.duration_s(next) * 1000;
+            s.ttft_ms = 0;
+            s.turn_ms = (arrived_us - cc.sent_us[next].load()) / 1000.0;
+            s.lag_ms = arrived_us / 1000.0 - c.turns[next].end_s / cfg.compression * 1000;
+            s.recorded_bytes = c.turns[next].text.length();
+            s.bytes = cc.texts[next].length();
+            {
+                std::lock_guard<std::mutex> hold(state.lock);
+                state.samples.push_back(s);
+            }
+            next++;
+            skip_own();
+        }
+    }
+    if (next < c.turns.size() && !state.stop) failed(state);
+}
+
+// Sends every speaker's messages of one copy on the recorded schedule
+static void chat_send(chat_copy& cc, const config& cfg, run_state& state)
+{
+    const transcript::conversation& c = *cc.c;
+    for (size_t i = 0; i < c.turns.size() && !state.stop; i++) {
+        sleep_until(state, after(cc.start, c.turns[i].end_s / cfg.compression));
+        int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(bench::clock::now() - cc.start).count();
+        cc.sent_us[i] = std::max<int64_t>(1, now_us);
+        const std::string& text = cc.texts[i];
+        if (send(cc.fds[c.turns[i].speaker], text.c_str(), text.length(), MSG_NOSIGNAL) == -1) {
+            perror("replay_bench: send");
+            failed(state);
+            return;
+        }
+        std::lock_guard<std::mutex> hold(state.lock);
+        state.messages++;
+    }
+}
+
+// Every copy of every transcript in the lobby, until they've all been delivered or gone quiet
+static void replay_chat(const std::vector<transcript::conversation>& conversations, const config& cfg, run_state& state)
+{
+    std::vector<std::unique_ptr<chat_copy>> copies;
+    int clients = 0;
+    for (int k = 0; k < cfg.copies; k++) {
+        for (const transcript::conversation& c : conversations) {
+            std::unique_ptr<chat_copy> cc(new chat_copy());
+            cc->copy = copies.size();
+            cc->c = &c;
+            cc->sent_us.reset(new std::atomic<int64_t>[c.turns.size()]());
+            for (const transcript::turn& t : c.turns) cc->texts.push_back(chat_line(t.text));
+            for (size_t speaker = 0; speaker < c.speakers.size(); speaker++) {
+                // Six characters, "r" and the client's number in base 36, so no name is another's prefix
+                std::string name = "r00000";
+                for (int n = clients++, d = CHAT_NAME_LEN - 1; n > 0 && d > 0; n /= 36, d--) name[d] = "0123456789abcdefghijklmnopqrstuvwxyz"[n % 36];
+                cc->headers.push_back(name + std::string(CHAT_HEADER_LEN - CHAT_NAME_LEN, '\0'));
+                int fd = chat_join(name);
+                if (fd == -1) {
+                    fprintf(stderr, "replay_bench: %s could not join the chat\n", name.c_str());
+                    failed(state);
+                    return;
+                }
+                cc->fds.push_back(fd);
+                std::lock_guard<std::mutex> hold(state.lock);
+                state.fds.push_back(fd);
+            }
+            copies.push_back(std::move(cc));
+        }
+    }
+
+    std::vector<std::thread> receivers, senders;
+    bench::clock::time_point now = bench::clock::now();
+    double last_end_s = 0;
+    for (size_t k = 0; k < copies.size(); k++) {
+        chat_copy& cc = *copies[k];
+        cc.start = after(now, cfg.stagger_s * (k / conversations.size()));
+        last_end_s = std::max(last_end_s, bench::since(state.start, cc.start) + cc.c->turns.back().end_s / cfg.compression);
+        for (size_t speaker = 0; speaker < cc.fds.size(); speaker++) receivers.emplace_back(chat_receive, std::ref(cc), speaker, std::cref(cfg), std::ref(state));
+        senders.emplace_back(chat_send, std::ref(cc), std::cref(cfg), std::ref(state));
+    }
+    for (std::thread& t : senders) t.join();
+
+    // Give stragglers ten seconds past the last message
+    std::thread patience([&state, last_end_s]() {
+        sleep_until(state, after(state.start, last_end_s + 10));
+        state.stop = true;
+    });
+    for (std::thread& t : receivers) t.join();
+    state.stop = true;
+    patience.join();
+}
+
+// Words in text, which is what the mock's tokens are
+static int words(const std::string& text)
+{
+    std::istringstream in(text);
+    int n = 0;
+    for (std::string word; in >> word; ) n++;
+    return n;
+}
+
+// Sets the mock up the way the recorded server behaved: its replies' lengths and token rate
+static std::string fit_mock(const std::vector<transcript::conversation>& conversations, mock::profile& p)
+{
+    std::vector<double> tokens, token_ms;
+    for (const transcript::conversation& c : conversations) {
+        for (size_t i = 1; i < c.turns.size(); i++) {
+            if (c.turns[i].speaker != 0) continue;
+            double n = std::max(1, words(c.turns[i].text));
+            tokens.push_back(n);
+            token_ms.push_back(c.duration_s(i) * 1000 / n);
+        }
+    }
+    if (tokens.empty()) return "";
+    double mean = 0, var = 0;
+    for (double n : tokens) mean += n;
+    mean /= tokens.size();
+    for (double n : tokens) var += (n - mean) * (n - mean);
+    std::sort(token_ms.begin(), token_ms.end());
+
+    p.lengths = "normal:" + std::to_string((int)(mean + 0.5)) + ":" + std::to_string((int)(sqrt(var / tokens.size()) + 0.5));
+    p.token_ms = std::max(1, (int)(token_ms[token_ms.size() / 2] + 0.5));
+    return "lengths=" + p.lengths + ",token_ms=" + std::to_string(p.token_ms);
+}
+
+static nlohmann::json report(const config& cfg, const run_state& state, double window_s, const std::string& mock_spec)
+{
+    std::vector<double> recorded_ms, recorded_bytes, ttft, turn_ms, lag, bytes, slowdown;
+    for (const sample& s : state.samples) {
+        recorded_ms.push_back(s.recorded_ms);
+        recorded_bytes.push_back(s.recorded_bytes);
+        ttft.push_back(s.ttft_ms);
+        turn_ms.push_back(s.turn_ms);
+        lag.push_back(s.lag_ms);
+        bytes.push_back(s.bytes);
+        if (s.recorded_ms > 0) slowdown.push_back(s.turn_ms / s.recorded_ms);
+    }
+
+    nlohmann::json j;
+    j["benchmark"] = "replay_bench";
+    j["config"] = {
+        {"target", cfg.target}, {"transcripts", cfg.transcripts}, {"copies", cfg.copies}, {"compression", cfg.compression},
+        {"stagger_s", cfg.stagger_s}, {"stream", cfg.stream}, {"server_args", cfg.server_args} };
+    if (cfg.target == "relay") {
+        j["config"]["backend"] = cfg.backend_url.empty() ? "mock" : cfg.backend_url;
+        j["config"]["mock"] = mock_spec;
+    }
+
+    j["window_s"] = window_s;
+    j["failures"] = state.failures;
+    j["recorded"] = { {"bytes", bench::distribution(recorded_bytes)} };
+    if (cfg.target == "relay") {
+        // The server's turns: how long the recorded one took against the replayed one
+        j["turns"] = turn_ms.size();
+        j["turns_per_sec"] = window_s > 0 ? turn_ms.size() / window_s : 0;
+        j["recorded"]["turn_ms"] = bench::distribution(recorded_ms);
+        j["replayed"] = { {"ttft_ms", bench::distribution(ttft)}, {"turn_ms", bench::distribution(turn_ms)}, {"bytes", bench::distribution(bytes)} };
+        j["slowdown"] = bench::distribution(slowdown); // replayed turn_ms over recorded, turn by turn
+    }
+    else {
+        // Every message, once for each other speaker in its copy
+        j["messages"] = state.messages;
+        j["deliveries"] = turn_ms.size();
+        j["deliveries_per_sec"] = window_s > 0 ? turn_ms.size() / window_s : 0;
+        j["replayed"] = { {"delivery_ms", bench::distribution(turn_ms)}, {"lag_ms", bench::distribution(lag)}, {"bytes", bench::distribution(bytes)} };
+    }
+    return j;
+}
+
+int main(int argc, char* argv[])
+{
+    config cfg;
+    std::string output;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "x:t:c:z:R:k:S:a:sB:m:P:o:v")) != -1) {
+        switch (opt) {
+        case 'x': cfg.target = optarg; break; // relay or chat
+        case 't': cfg.transcripts.push_back(optarg); break; // a transcript to replay; as many as you like
+        case 'c': cfg.copies = atoi(optarg); break; // copies of each transcript played at once
+        case 'z': cfg.compression = atof(optarg); break; // replay the recorded timing this many times faster
+        case 'R': cfg.stagger_s = atof(optarg); break; // seconds between starting one set of copies and the next
+        case 'k': cfg.chars_per_s = atof(optarg); break; // speaking rate assumed for transcripts without times
+        case 'S': cfg.server_path = optarg; break; // server binary under test
+        case 'a': cfg.server_args = optarg; break; // extra server flags
+        case 's': cfg.stream = true; break; // relay: stream both sides (passes -s to the server)
+        case 'B': cfg.backend_url = optarg; break; // relay: a real Ollama instead of the fitted mock
+        case 'm': cfg.mock_spec = optarg; break; // relay: mock settings over the fitted ones, key=value,...
+        case 'P': cfg.mock_port = atoi(optarg); break; // relay: port for the mock
+        case 'o': output = optarg; break; // write the JSON here instead of stdout
+        case 'v': cfg.verbose = true; break; // let the server's output through
+        default:
+            fprintf(stderr, "usage: replay_bench [-x relay|chat] -t transcript... [-c copies] [-z compression] [-R stagger_s] [-k chars_per_s] "
+                            "[-S server] [-a server_args] [-s] [-B url | -m key=value,...] [-P mock_port] [-o file] [-v]\n");
+            exit(1);
+        }
+    }
+    if (cfg.target != "relay" && cfg.target != "chat") {
+        fprintf(stderr, "replay_bench: unknown target %s\n", cfg.target.c_str());
+        exit(1);
+    }
+    if (cfg.transcripts.empty() || cfg.copies < 1 || cfg.compression <= 0 || cfg.chars_per_s <= 0) {
+        fprintf(stderr, "replay_bench: need a transcript (-t), at least one copy and positive -z and -k\n");
+        exit(1);
+    }
+
+    std::vector<transcript::conversation> conversations(cfg.transcripts.size());
+    for (size_t i = 0; i < cfg.transcripts.size(); i++) {
+        if (!transcript::load(cfg.transcripts[i], conversations[i], cfg.chars_per_s)) exit(1);
+        if (cfg.target != "relay") continue;
+        // The relay's two sides take strict turns
+        transcript::merge_runs(conversations[i]);
+        if (conversations[i].speakers.size() != 2) {
+            fprintf(stderr, "replay_bench: %s: the relay replays two speakers, not %zu\n",
+                    cfg.transcripts[i].c_str(), conversations[i].speakers.size());
+            exit(1);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // Relay: a mock backend shaped like the recording, then anything -m says
+    std::unique_ptr<mock::backend> server_mock;
+    std::string server_url = cfg.backend_url, mock_spec;
+    if (cfg.target == "relay" && cfg.backend_url.empty()) {
+        mock_spec = fit_mock(conversations, cfg.profile);
+        std::istringstream fields(cfg.mock_spec);
+        for (std::string field; std::getline(fields, field, ','); ) {
+            size_t eq = field.find('=');
+            if (eq == std::string::npos || !mock::set(cfg.profile, field.substr(0, eq), field.substr(eq + 1))) {
+                fprintf(stderr, "replay_bench: bad mock setting %s\n", field.c_str());
+                exit(1);
+            }
+            mock_spec += (mock_spec.empty() ? "" : ",") + field;
+        }
+        server_mock.reset(new mock::backend(cfg.profile));
+        server_mock->start("127.0.0.1", cfg.mock_port);
+        server_url = "http://127.0.0.1:" + std::to_string(cfg.mock_port);
+    }
+
+    std::vector<std::string> args = { cfg.server_path };
+    std::string input;
+    if (cfg.target == "relay") {
+        args.insert(args.end(), { "-B", server_url });
+        if (cfg.stream) args.push_back("-s");
+        std::string opening = conversations[0].turns[0].text;
+        for (char& ch : opening) if (ch == '\n') ch = ' '; // the server reads one line
+        input = opening + "\n";
+    }
+    std::istringstream extra(cfg.server_args);
+    for (std::string arg; extra >> arg; ) args.push_back(arg);
+    pid_t server = bench::start_server(args, input, cfg.verbose);
+    if (server == -1) exit(1);
+
+    run_state state;
+    state.start = bench::clock::now();
+    if (cfg.target == "relay") {
+        std::vector<std::thread> replays;
+        for (int k = 0; k < cfg.copies; k++)
+            for (size_t i = 0; i < conversations.size(); i++)
+                replays.emplace_back(replay_relay, k * conversations.size() + i, std::cref(conversations[i]), k * cfg.stagger_s,
+                                     std::cref(cfg), std::ref(state));
+        for (std::thread& t : replays) t.join();
+    }
+    else replay_chat(conversations, cfg, state);
+    double window_s = bench::since(state.start, bench::clock::now());
+    state.stop = true;
+    for (int fd : state.fds) close(fd);
+
+    kill(-server, SIGTERM);
+    waitpid(server, NULL, 0);
+    if (server_mock) server_mock->stop();
+
+    std::string json = report(cfg, state, window_s, mock_spec).dump(2) + "\n";
+    if (output.empty()) fputs(json.c_str(), stdout);
+    else {
+        std::ofstream out(output);
+        out << json;
+        if (!out) { perror("replay_bench: write"); return 1; }
+    }
+    return 0;
+}
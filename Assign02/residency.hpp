@@ -0,0 +1,180 @@
+/*
+** residency.hpp -- keeping the model loaded while it's needed, and only then
+**
+** Ollama loads a model on the first request that names it and unloads it once
+** its keep_alive runs out -- five minutes after the last request unless that
+** request asked for longer. So the first turn after startup, and the first
+** after any lull, sits through a model load. A model_residency
+**
+**   - loads the model on every backend as soon as it's started, on its own
+**     threads, so the load overlaps the rest of startup;
+**   - while conversations are generating, checks running_model_json() every
+**     interval, reloads the model wherever it has gone missing and renews
+**     keep_alive everywhere else (each turn's request resets it to Ollama's
+**     default, so it's renewed every interval);
+**   - once nothing has generated for idle_s, unloads it to hand the memory back.
+**
+** Conversations report activity with touch(). With shared set that goes
+** through shared memory, so one manager in the parent covers every forked
+** conversation.
+**
+** Independently of all that, count_turn() sorts each generated turn into warm
+** or cold by the load_duration Ollama reports on its final chunk.
+*/
+
+#ifndef RESIDENCY_HPP
+#define RESIDENCY_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ollama.hpp"
+#include "metrics.hpp"
+#include "backends.hpp"
+
+#define COLD_LOAD_MS 100 // a turn whose model load took longer than this was a cold start
+
+class model_residency {
+    public:
+        // keep_alive: what to renew it to, as Ollama takes it ("30m", "-1" for forever).
+        // idle_s: unload after this long without a generation; 0 never unloads.
+        model_residency(backends::pool& pool, const std::string& model, const std::string& keep_alive, int idle_s, bool shared = false):
+            pool(pool), model(model), keep_alive(keep_alive), idle_ms((int64_t)idle_s * 1000),
+            preloads("model_preloads_total"), renewals("model_keep_alive_renewals_total"), unloads("model_unloads_total"),
+            warmup_ms("model_warmup_ms")
+        {
+            void* mem = nullptr;
+            if (shared) {
+                mem = mmap(nullptr, sizeof(std::atomic<int64_t>), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+                if (mem == MAP_FAILED) { perror("residency: mmap"); mem = nullptr; }
+            }
+            if (!mem) mem = ::operator new(sizeof(std::atomic<int64_t>));
+            last_active = new (mem) std::atomic<int64_t>(backends::now_ms()); // startup counts as activity
+            for (int i = 0; i < pool.size(); i++) {
+                resident_gauges.emplace_back(new metrics::gauge("model_resident", "backend=\"" + backends::label(i) + "\""));
+                unloaded.push_back(false);
+            }
+        }
+
+        // "KEEP_ALIVE[:IDLE_S]", e.g. "30m:600". False if it doesn't parse.
+        static bool parse(const std::string& spec, std::string& keep_alive, int& idle_s)
+        {
+            size_t colon = spec.find(':');
+            keep_alive = spec.substr(0, colon);
+            idle_s = colon == std::string::npos ? 0 : atoi(spec.c_str() + colon + 1);
+            return !keep_alive.empty() && idle_s >= 0;
+        }
+
+        // Watches the model every interval_ms in the background, loading it everywhere first unless
+        // the caller already has with warm_up()
+        void start(int interval_ms = 10000, bool warm = true)
+        {
+            std::thread([this, interval_ms, warm]() {
+                if (warm) warm_up();
+                std::vector<std::unique_ptr<Ollama>> clients;
+                for (int i = 0; i < pool.size(); i++) {
+                    clients.emplace_back(new Ollama(pool.url(i)));
+                    clients.back()->setReadTimeout(120); // a reload can take a while
+                }
+                while (true) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+                    bool active = idle_ms == 0 || backends::now_ms() - *last_active < idle_ms;
+                    for (int i = 0; i < pool.size(); i++) if (pool.healthy(i)) watch(i, *clients[i], active);
+                }
+            }).detach();
+        }
+
+        // A conversation is about to generate (any process)
+        void touch() { *last_active = backends::now_ms(); }
+
+        // Counts a generated turn as warm or cold from its final chunk
+        static void count_turn(const ollama::response& final_chunk)
+        {
+            static metrics::counter cold("cold_start_turns_total"), warm("warm_turns_total");
+            static metrics::histogram cold_load_ms("cold_start_load_ms");
+            if (!final_chunk.has_timings()) return;
+            double load_ms = final_chunk.load_duration() / 1e6;
+            if (load_ms > COLD_LOAD_MS) {
+                cold.inc();
+                cold_load_ms.observe(load_ms);
+            }
+            else warm.inc();
+        }
+
+        // Loads the model on every backend at once; returns when they've all answered
+        void warm_up()
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            std::vector<std::thread> loads;
+            for (int i = 0; i < pool.size(); i++) {
+                loads.emplace_back([this, i]() {
+                    Ollama client(pool.url(i));
+                    client.setReadTimeout(300);
+                    std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+                    try {
+                        if (client.load_model(model, keep_alive)) {
+                            resident_gauges[i]->set(1);
+                            fprintf(stderr, "residency: %s loaded on %s in %.0f ms\n", model.c_str(), pool.url(i),
+                                    std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t).count());
+                        }
+                    }
+                    catch (const std::exception& e) { fprintf(stderr, "residency: loading %s on %s: %s\n", model.c_str(), pool.url(i), e.what()); }
+                });
+            }
+            for (std::thread& t : loads) t.join();
+            warmup_ms.observe(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+
+    private:
+
+        void watch(int i, Ollama& client, bool active)
+        {
+            try {
+                bool resident = false;
+                nlohmann::json running = client.running_model_json();
+                for (auto& m : running["models"]) {
+                    std::string name = m.value("name", "");
+                    if (name == model || name.compare(0, model.length() + 1, model + ":") == 0) resident = true;
+                }
+
+                if (active) {
+                    unloaded[i] = false;
+                    client.load_model(model, keep_alive); // loads it if it's gone, renews keep_alive if not
+                    if (resident) renewals.inc();
+                    else {
+                        preloads.inc();
+                        fprintf(stderr, "residency: reloaded %s on %s\n", model.c_str(), pool.url(i));
+                    }
+                    resident = true;
+                }
+                else if (resident && !unloaded[i]) {
+                    client.unload_model(model);
+                    unloads.inc();
+                    unloaded[i] = true; // leave it to Ollama if something else loads it again
+                    resident = false;
+                    fprintf(stderr, "residency: unloaded idle %s from %s\n", model.c_str(), pool.url(i));
+                }
+                resident_gauges[i]->set(resident);
+            }
+            catch (const std::exception& e) { fprintf(stderr, "residency: %s: %s\n", pool.url(i), e.what()); }
+        }
+
+        backends::pool& pool;
+        std::string model, keep_alive;
+        int64_t idle_ms;
+        std::atomic<int64_t>* last_active; // backends::now_ms() of the latest generation, in any process
+        std::vector<bool> unloaded; // by us, since the model was last in use; watcher thread only
+
+        std::vector<std::unique_ptr<metrics::gauge>> resident_gauges;
+        metrics::counter preloads, renewals, unloads;
+        metrics::histogram warmup_ms;
+};
+
+#endif
@@ -0,0 +1,283 @@
+/*
+** response_cache.hpp -- replays of deterministic generations
+**
+** With temperature 0 or a fixed seed, the same request always produces the
+** same reply, so regression and demo runs that replay a script pay for the
+** same generations over and over. A response_cache keeps those replies, keyed
+** by a hash of everything the caller built the request from that shapes the
+** output (model, prompt, options, and the session context sent with it), and
+** plays them back instead of asking a backend. Requests without a deterministic option set always go
+** to a backend.
+**
+** A reply is kept as the chunks the backend streamed, with when each arrived,
+** so a hit can be replayed at the original speed (or faster, or all at once)
+** and the rest of the relay sees a turn that behaves like a generated one.
+**
+** Replies live in an LRU in memory and, with a directory, one file per reply
+** under it, read back on a memory miss -- across restarts, and across the
+** forked conversation processes that don't share memory.
+*/
+
+#ifndef RESPONSE_CACHE_HPP
+#define RESPONSE_CACHE_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "ollama.hpp"
+#include "metrics.hpp"
+#include "backends.hpp"
+#include "hedging.hpp"
+#include "tracing.hpp"
+
+class response_cache {
+    public:
+        using token_callback = std::function<void(const ollama::response&)>;
+
+        // capacity: replies kept in memory. dir: also keep them on disk. Neither turns the cache off.
+        // replay_speed: 1 replays a reply as fast as it was generated, 2 twice as fast, 0 all at once.
+        response_cache(size_t capacity = 0, const std::string& dir = "", double replay_speed = 1):
+            capacity(capacity), dir(dir), replay_speed(replay_speed),
+            memory_hits("response_cache_hits_total", "tier=\"memory\""), disk_hits("response_cache_hits_total", "tier=\"disk\""),
+            misses("response_cache_misses_total"), bypassed("response_cache_bypassed_total"), entries("response_cache_entries") {}
+
+        bool enabled() const { return capacity > 0 || !dir.empty(); }
+
+        // Generations from run() race a second backend when they're slow to start (null: they don't)
+        void hedge(hedging::hedger* h) { hedger = h; }
+
+        // Generation options from "key=value,key=value", numbers as numbers: "temperature=0,seed=42".
+        // Shaped like ollama::options for ollama::request; null when there are none.
+        static nlohmann::json parse_options(const std::string& spec)
+        {
+            nlohmann::json options = nlohmann::json::object();
+            size_t start = 0;
+            while (start < spec.length()) {
+                size_t comma = spec.find(',', start);
+                std::string field = spec.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+                size_t eq = field.find('=');
+                if (eq != std::string::npos) {
+                    std::string key = field.substr(0, eq), value = field.substr(eq + 1);
+                    char* end;
+                    double number = strtod(value.c_str(), &end);
+                    if (!value.empty() && *end == '\0') {
+                        if (number == (int64_t)number) options[key] = (int64_t)number;
+                        else options[key] = number;
+                    }
+                    else if (value == "true" || value == "false") options[key] = value == "true";
+                    else options[key] = value;
+                }
+                if (comma == std::string::npos) break;
+                start = comma + 1;
+            }
+            if (options.empty()) return nullptr;
+            nlohmann::json wrapped;
+            wrapped["options"] = options;
+            return wrapped;
+        }
+
+        // Same request, same reply: greedy decoding, or sampling from a fixed seed
+        static bool deterministic(const nlohmann::json& request)
+        {
+            if (!request.contains("options") || !request["options"].is_object()) return false;
+            const nlohmann::json& options = request["options"];
+            if (options.contains("seed")) return true;
+            return options.contains("temperature") && options["temperature"].is_number() && options["temperature"].get<double>() == 0;
+        }
+
+        // The key for a request built from model, prompt and options (as from parse_options), with
+        // the context whose hash is context_hash (0 for none). Empty, so nothing is cached or replayed,
+        // when the cache is off or the options aren't deterministic.
+        std::string key_for(const std::string& model, const std::string& prompt, const nlohmann::json& options, uint64_t context_hash) const
+        {
+            if (!enabled() || options.is_null() || !deterministic(options)) return "";
+
+            // Two differently seeded FNV-1a passes: 128 bits, and a file name
+            uint64_t a = 0xcbf29ce484222325ULL, b = 0x6c62272e07bb0142ULL;
+            auto mix = [&](const std::string& part) {
+                for (unsigned char ch : part) {
+                    a = (a ^ ch) * 0x100000001b3ULL;
+                    b = (b ^ ch) * 0x100000001b3ULL + 1;
+                }
+                a = (a ^ 0xff) * 0x100000001b3ULL; // a byte no UTF-8 text has, between parts
+                b = (b ^ 0xff) * 0x100000001b3ULL + 1;
+            };
+            mix(model);
+            mix(prompt);
+            mix(options.dump()); // object keys come out sorted
+            mix(std::to_string(context_hash));
+            char hex[33];
+            snprintf(hex, sizeof hex, "%016llx%016llx", (unsigned long long)a, (unsigned long long)b);
+            return hex;
+        }
+
+        // Plays the reply back if one is cached under key (from key_for). False means the caller
+        // has to generate it (through run(), to cache it).
+        bool replay(const std::string& key, const token_callback& on_token)
+        {
+            if (!enabled()) return false;
+            if (key.empty()) { bypassed.inc(); return false; }
+            std::shared_ptr<const reply> cached = lookup(key);
+            if (!cached) { misses.inc(); return false; }
+
+            clock::time_point start = clock::now();
+            for (const chunk& c : cached->chunks) {
+                if (replay_speed > 0) std::this_thread::sleep_until(start + std::chrono::microseconds((int64_t)(c.offset_us / replay_speed)));
+                on_token(ollama::response(c.json));
+            }
+            return true;
+        }
+
+        // Generates on a backend the way backends::pool::run does (or the hedger, if there is one), keeping
+        // the reply under key (from key_for; empty keeps nothing) if it came back whole. keep_going as
+        // for generate_serialized.
+        bool run(backends::pool& pool, const std::string& model, int preferred, const std::string& key, const std::string& request,
+                 const token_callback& on_token, const std::function<bool()>& progress, const std::function<bool()>& keep_going = nullptr)
+        {
+            if (!enabled() || key.empty()) {
+                if (hedger) return hedger->run(pool, model, preferred, request, on_token, keep_going);
+                return pool.run(model, preferred, [&](Ollama& ollama) { trace::generate(ollama, request, on_token, keep_going); }, progress);
+            }
+
+            std::shared_ptr<reply> fresh = std::make_shared<reply>();
+            bool complete = false;
+            clock::time_point start = clock::now();
+            token_callback record = [&](const ollama::response& token) {
+                int64_t offset = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+                std::string json = token.as_json_string();
+                for (char& ch : json) if (ch == '\n' || ch == '\r') ch = ' '; // one chunk a line on disk
+                fresh->chunks.push_back(chunk{offset, json});
+                if (token.as_json().value("done", false)) complete = true;
+                on_token(token);
+            };
+            // The hedger only ever passes on one backend's tokens
+            bool ok = hedger ? hedger->run(pool, model, preferred, request, record, keep_going)
+                             : pool.run(model, preferred, [&](Ollama& ollama) {
+                                   fresh->chunks.clear(); // an earlier backend may have failed partway
+                                   trace::generate(ollama, request, record, keep_going);
+                               }, progress);
+
+            if (ok && complete) store(key, fresh);
+            return ok;
+        }
+
+    private:
+        using clock = std::chrono::steady_clock;
+
+        struct chunk {
+            int64_t offset_us; // since the request went out
+            std::string json;
+        };
+
+        struct reply {
+            std::vector<chunk> chunks;
+        };
+
+        std::shared_ptr<const reply> lookup(const std::string& key)
+        {
+            {
+                std::lock_guard<std::mutex> hold(lock);
+                auto it = index.find(key);
+                if (it != index.end()) {
+                    order.splice(order.begin(), order, it->second.second);
+                    memory_hits.inc();
+                    return it->second.first;
+                }
+            }
+            if (dir.empty()) return nullptr;
+
+            std::shared_ptr<reply> loaded = load(key);
+            if (!loaded) return nullptr;
+            disk_hits.inc();
+            remember(key, loaded);
+            return loaded;
+        }
+
+        void store(const std::string& key, const std::shared_ptr<const reply>& r)
+        {
+            remember(key, r);
+            if (!dir.empty()) save(key, *r);
+        }
+
+        void remember(const std::string& key, const std::shared_ptr<const reply>& r)
+        {
+            if (capacity == 0) return;
+            std::lock_guard<std::mutex> hold(lock);
+            auto it = index.find(key);
+            if (it != index.end()) {
+                it->second.first = r;
+                order.splice(order.begin(), order, it->second.second);
+                return;
+            }
+            order.push_front(key);
+            index[key] = std::make_pair(r, order.begin());
+            while (index.size() > capacity) {
+                index.erase(order.back());
+                order.pop_back();
+            }
+            entries.set(index.size());
+        }
+
+        std::string path(const std::string& key) const { return dir + "/" + key + ".reply"; }
+
+        // One chunk a line: "<offset_us> <json>"
+        std::shared_ptr<reply> load(const std::string& key)
+        {
+            std::ifstream in(path(key));
+            if (!in) return nullptr;
+
+            std::shared_ptr<reply> r = std::make_shared<reply>();
+            for (std::string line; std::getline(in, line); ) {
+                size_t space = line.find(' ');
+                if (space == std::string::npos) { r = nullptr; break; }
+                r->chunks.push_back(chunk{atoll(line.c_str()), line.substr(space + 1)});
+            }
+            if (!r || r->chunks.empty()) {
+                fprintf(stderr, "response_cache: ignoring corrupt %s\n", path(key).c_str());
+                return nullptr;
+            }
+            return r;
+        }
+
+        bool save(const std::string& key, const reply& r)
+        {
+            std::string final_path = path(key), tmp = final_path + "." + std::to_string(getpid()) + ".tmp";
+            FILE* f = fopen(tmp.c_str(), "w");
+            if (!f) { perror("response_cache: fopen"); return false; }
+
+            bool ok = true;
+            for (const chunk& c : r.chunks) ok = fprintf(f, "%lld %s\n", (long long)c.offset_us, c.json.c_str()) > 0 && ok;
+            ok = fclose(f) == 0 && ok;
+            if (!ok || rename(tmp.c_str(), final_path.c_str()) == -1) {
+                perror("response_cache: save");
+                unlink(tmp.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        size_t capacity;
+        std::string dir;
+        double replay_speed;
+        hedging::hedger* hedger = nullptr;
+
+        std::mutex lock;
+        std::list<std::string> order; // most recently used first
+        std::unordered_map<std::string, std::pair<std::shared_ptr<const reply>, std::list<std::string>::iterator>> index;
+
+        metrics::counter memory_hits, disk_hits, misses, bypassed;
+        metrics::gauge entries;
+};
+
+#endif
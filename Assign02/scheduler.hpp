@@ -0,0 +1,307 @@
+/*
+** scheduler.hpp -- which conversation gets a backend next
+**
+** Every generation takes a slot from the scheduler before it talks to a
+** backend and hands it back when the reply is done. At most `limit`
+** generations run on each backend; everything else waits here instead of in
+** the backend's own queue, and is let through
+**
+**   1. interactive before batch, then
+**   2. by start-time fair queuing across conversations: each turn is tagged
+**      max(virtual time, the conversation's previous tag) + cost / weight and
+**      the smallest tag goes next. A conversation that just had a turn waits
+**      behind ones that haven't, so everybody makes steady progress and a
+**      chatty conversation can't starve the rest.
+**
+** A peer picks its conversation's class and weight with FRAME_OPTIONs, but only
+** as far as the server's admission lets it: weights are clamped, and a class
+** better than the server's default is only granted if the server allows it.
+**
+** The state is plain data behind a process-shared mutex, so a scheduler made
+** with create(..., true) before forking serves every conversation process, and
+** one made without it serves the event-driven server's workers.
+*/
+
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <string>
+#include "metrics.hpp"
+
+namespace sched
+{
+    enum priority { INTERACTIVE = 0, BATCH = 1 };
+
+    inline priority parse_priority(const std::string& name) { return name == "batch" ? BATCH : INTERACTIVE; }
+    inline const char* priority_name(priority p) { return p == BATCH ? "batch" : "interactive"; }
+
+    // How much of what a peer asks for (its "priority" and "weight" options) to believe
+    struct admission {
+        priority default_class = INTERACTIVE; // for peers that don't ask
+        bool allow_raise = false; // grant a class better than default_class when asked
+        double max_weight = 8; // weights are clamped to [1 / max_weight, max_weight]
+
+        priority class_for(const std::string& asked) const
+        {
+            if (asked.empty()) return default_class;
+            priority p = parse_priority(asked);
+            return p < default_class && !allow_raise ? default_class : p;
+        }
+
+        double weight_for(const std::string& asked) const
+        {
+            double w = asked.empty() ? 1 : atof(asked.c_str());
+            if (!(w > 0)) return 1; // nonsense, NaN included
+            if (w > max_weight) return max_weight;
+            return w < 1 / max_weight ? 1 / max_weight : w;
+        }
+    };
+
+    const int MAX_BACKENDS = 16;
+    const int MAX_WAITERS = 1024;
+    const int MAX_FLOWS = 1024; // conversations remembered; the least recently seen is forgotten first
+    const int MAX_HOLDERS = 512;
+
+    class scheduler {
+        public:
+            // limit: generations allowed at once on each of `backends` backends
+            static scheduler* create(int backends, int limit, bool shared)
+            {
+                void* mem;
+                if (shared) {
+                    mem = mmap(nullptr, sizeof(scheduler), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+                    if (mem == MAP_FAILED) { perror("scheduler: mmap"); return nullptr; }
+                }
+                else mem = ::operator new(sizeof(scheduler));
+                return new (mem) scheduler(backends, limit, shared);
+            }
+
+            // Blocks until the conversation may generate. Returns the backend to use, or -1 if cancelled()
+            // turned true while it waited (checked every 100 ms).
+            int acquire(int64_t conversation, priority p, double weight = 1, double cost = 1, const std::function<bool()>& cancelled = nullptr)
+            {
+                static metrics::histogram wait_ms[2] = {
+                    metrics::histogram("scheduler_queue_wait_ms", "priority=\"interactive\""),
+                    metrics::histogram("scheduler_queue_wait_ms", "priority=\"batch\"") };
+                static metrics::gauge waiting("scheduler_waiting");
+                static metrics::counter dropped("scheduler_dropped_total");
+                std::chrono::steady_clock::time_point queued = std::chrono::steady_clock::now();
+
+                lock_state();
+                int w;
+                while ((w = free_waiter()) == -1) pthread_cond_wait(&changed, &lock);
+
+                flow& f = find_flow(conversation);
+                double start = f.tag > virtual_time ? f.tag : virtual_time;
+                f.tag = start + cost / (weight > 0 ? weight : 1);
+                waiters[w] = waiter{true, getpid(), p, start, next_ticket++};
+                waiting.add(1);
+
+                int backend;
+                while ((backend = free_backend()) == -1 || best_waiter() != w) {
+                    if (cancelled && cancelled()) {
+                        waiters[w].used = false;
+                        waiting.add(-1);
+                        dropped.inc();
+                        pthread_cond_broadcast(&changed); // we may have been the best waiter
+                        pthread_mutex_unlock(&lock);
+                        return -1;
+                    }
+                    // Wake now and then: a process that died holding a slot never signals, and
+                    // cancellation doesn't either
+                    struct timespec deadline;
+                    clock_gettime(CLOCK_REALTIME, &deadline);
+                    if (cancelled) deadline.tv_nsec += 100 * 1000000L;
+                    else deadline.tv_sec += 1;
+                    if (deadline.tv_nsec >= 1000000000L) { deadline.tv_sec++; deadline.tv_nsec -= 1000000000L; }
+                    if (pthread_cond_timedwait(&changed, &lock, &deadline) == EOWNERDEAD) pthread_mutex_consistent(&lock);
+                    reclaim_dead_holders();
+                }
+
+                waiters[w].used = false;
+                running[backend]++;
+                add_holder(backend);
+                if (start > virtual_time) virtual_time = start;
+                waiting.add(-1);
+                pthread_cond_broadcast(&changed); // the next best may fit on another backend
+                pthread_mutex_unlock(&lock);
+
+                wait_ms[p].observe(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - queued).count());
+                return backend;
+            }
+
+            // Takes a slot on a backend not in avoid (bit i for backend i), but only if one is free right
+            // now and nobody is queued: for extra work that isn't worth waiting for. The backend, or -1.
+            int try_acquire(unsigned avoid)
+            {
+                lock_state();
+                int backend = -1;
+                if (best_waiter() == -1)
+                    for (int b = 0; b < backends; b++)
+                        if (!(avoid & (1u << b)) && running[b] < limit && (backend == -1 || running[b] < running[backend])) backend = b;
+                if (backend >= 0) {
+                    running[backend]++;
+                    add_holder(backend);
+                }
+                pthread_mutex_unlock(&lock);
+                return backend;
+            }
+
+            void release(int backend)
+            {
+                lock_state();
+                running[backend]--;
+                remove_holder(backend);
+                pthread_cond_broadcast(&changed);
+                pthread_mutex_unlock(&lock);
+            }
+
+            // A slot held for the life of one generation. With cancelled, check dropped() before generating.
+            // Without a scheduler backend is -1, so the pool picks one as it would for anyone else.
+            class slot {
+                public:
+                    slot(scheduler* s, int64_t conversation, priority p, double weight = 1, const std::function<bool()>& cancelled = nullptr):
+                        s(s), backend(s ? s->acquire(conversation, p, weight, 1, cancelled) : -1) {}
+                    // Without queueing, as try_acquire: dropped() if there's no free slot
+                    slot(scheduler* s, unsigned avoid): s(s), backend(s ? s->try_acquire(avoid) : -1) {}
+                    ~slot() { if (s && backend >= 0) s->release(backend); }
+                    bool dropped() const { return s && backend < 0; }
+                    scheduler* s;
+                    const int backend;
+            };
+
+        private:
+            struct waiter {
+                bool used;
+                pid_t pid;
+                int priority;
+                double tag;
+                uint64_t ticket; // arrival order breaks ties
+            };
+
+            struct flow {
+                int64_t conversation;
+                double tag; // finish tag of its latest turn
+                uint64_t last_seen;
+            };
+
+            struct holder {
+                pid_t pid;
+                int backend;
+            };
+
+            scheduler(int backends, int limit, bool shared):
+                backends(backends < 1 ? 1 : backends > MAX_BACKENDS ? MAX_BACKENDS : backends), limit(limit < 1 ? 1 : limit)
+            {
+                pthread_mutexattr_t mattr;
+                pthread_mutexattr_init(&mattr);
+                pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+                pthread_condattr_t cattr;
+                pthread_condattr_init(&cattr);
+                if (shared) {
+                    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+                    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+                }
+                pthread_mutex_init(&lock, &mattr);
+                pthread_cond_init(&changed, &cattr);
+                pthread_mutexattr_destroy(&mattr);
+                pthread_condattr_destroy(&cattr);
+            }
+
+            // A conversation process can die holding the lock; the state is still usable
+            void lock_state()
+            {
+                if (pthread_mutex_lock(&lock) == EOWNERDEAD) pthread_mutex_consistent(&lock);
+            }
+
+            int free_waiter()
+            {
+                for (int i = 0; i < MAX_WAITERS; i++) if (!waiters[i].used) return i;
+                return -1;
+            }
+
+            flow& find_flow(int64_t conversation)
+            {
+                int oldest = 0;
+                for (int i = 0; i < MAX_FLOWS; i++) {
+                    if (flows[i].last_seen && flows[i].conversation == conversation) {
+                        flows[i].last_seen = ++seen;
+                        return flows[i];
+                    }
+                    if (flows[i].last_seen < flows[oldest].last_seen) oldest = i;
+                }
+                flows[oldest] = flow{conversation, 0, ++seen};
+                return flows[oldest];
+            }
+
+            // Least loaded backend with room, or -1
+            int free_backend()
+            {
+                int best = -1;
+                for (int b = 0; b < backends; b++)
+                    if (running[b] < limit && (best == -1 || running[b] < running[best])) best = b;
+                return best;
+            }
+
+            int best_waiter()
+            {
+                int best = -1;
+                for (int i = 0; i < MAX_WAITERS; i++) {
+                    if (!waiters[i].used) continue;
+                    const waiter& w = waiters[i];
+                    if (best == -1 || w.priority < waiters[best].priority ||
+                        (w.priority == waiters[best].priority && (w.tag < waiters[best].tag ||
+                        (w.tag == waiters[best].tag && w.ticket < waiters[best].ticket)))) best = i;
+                }
+                return best;
+            }
+
+            void add_holder(int backend)
+            {
+                for (int i = 0; i < MAX_HOLDERS; i++) if (!holders[i].pid) { holders[i] = holder{getpid(), backend}; return; }
+            }
+
+            void remove_holder(int backend)
+            {
+                for (int i = 0; i < MAX_HOLDERS; i++)
+                    if (holders[i].pid == getpid() && holders[i].backend == backend) { holders[i].pid = 0; return; }
+            }
+
+            // Gives back slots held (or queued for) by conversation processes that died
+            void reclaim_dead_holders()
+            {
+                for (int i = 0; i < MAX_WAITERS; i++)
+                    if (waiters[i].used && kill(waiters[i].pid, 0) == -1 && errno == ESRCH) waiters[i].used = false;
+                for (int i = 0; i < MAX_HOLDERS; i++) {
+                    if (holders[i].pid && kill(holders[i].pid, 0) == -1 && errno == ESRCH) {
+                        running[holders[i].backend]--;
+                        holders[i].pid = 0;
+                    }
+                }
+            }
+
+            pthread_mutex_t lock;
+            pthread_cond_t changed;
+            const int backends, limit;
+            int running[MAX_BACKENDS] = {};
+            double virtual_time = 0;
+            uint64_t next_ticket = 0, seen = 0;
+            waiter waiters[MAX_WAITERS] = {};
+            flow flows[MAX_FLOWS] = {};
+            holder holders[MAX_HOLDERS] = {};
+    };
+}
+
+#endif
@@ -0,0 +1,290 @@
+/*
+** semantic_cache.hpp -- replies reused for prompts that mean the same thing
+**
+** Two AIs talking to each other say "How are you?", "How are you doing?" and
+** "How's it going?" a lot (see test.cpp), and each variant costs a full
+** generation. A semantic_cache embeds the incoming turn with
+** Ollama::generate_embeddings, finds the most similar turn it has answered
+** before, and reuses that answer when the cosine similarity clears a threshold.
+**
+** The index is flat: unit vectors packed row after row, searched with a SIMD
+** dot product (AVX2/FMA, SSE2 or NEON, whichever the build targets). It's kept
+** under a byte budget by evicting the least recently used entries.
+**
+** To tune the threshold, every lookup records how far its nearest neighbour
+** was (semantic_cache_distance_permille, split by hit and miss). With an
+** audit rate, that fraction of would-be hits is generated anyway and the fresh
+** reply compared with the cached one (semantic_cache_audit_distance_permille).
+**
+** The index lives in the process that made it: the event-driven server shares
+** one across conversations, while fork mode gets one per conversation. Either
+** way a turn only matches turns from its own conversation (entries are scoped
+** by conversation id), so "And then?" is never answered with what followed it
+** somewhere else.
+**
+**   server -S threshold=0.92,budget_mb=64,model=nomic-embed-text,audit=0.05
+*/
+
+#ifndef SEMANTIC_CACHE_HPP
+#define SEMANTIC_CACHE_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "ollama.hpp"
+#include "metrics.hpp"
+#include "backends.hpp"
+
+namespace semantic
+{
+    // Dot product of two float vectors
+    inline float dot(const float* a, const float* b, size_t n)
+    {
+        size_t i = 0;
+        float sum = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+        __m256 acc = _mm256_setzero_ps();
+        for (; i + 8 <= n; i += 8) acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc);
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+        sum = _mm_cvtss_f32(s);
+#elif defined(__SSE2__)
+        __m128 acc = _mm_setzero_ps();
+        for (; i + 4 <= n; i += 4) acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+        acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+        sum = _mm_cvtss_f32(acc);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+        float32x4_t acc = vdupq_n_f32(0);
+        for (; i + 4 <= n; i += 4) acc = vfmaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+        sum = vaddvq_f32(acc);
+#endif
+        for (; i < n; i++) sum += a[i] * b[i];
+        return sum;
+    }
+
+    inline void normalize(std::vector<float>& v)
+    {
+        float norm = sqrtf(dot(v.data(), v.data(), v.size()));
+        if (norm > 0) for (float& x : v) x /= norm;
+    }
+
+    class cache {
+        public:
+            // What a lookup found, handed back to record() once the turn is generated
+            struct probe {
+                std::vector<float> vector; // empty if the embedding failed
+                size_t scope = 0; // hash of the conversation id
+                bool audit = false; // a hit we generated anyway, to check it
+                std::string cached; // the reply the audit is checking
+            };
+
+            cache(backends::pool& pool, const std::string& model, double threshold, size_t budget_bytes, double audit_rate = 0):
+                pool(pool), model(model), threshold(threshold), budget(budget_bytes), audit_rate(audit_rate), coin(12345),
+                hits("semantic_cache_lookups_total", "result=\"hit\""), misses("semantic_cache_lookups_total", "result=\"miss\""),
+                errors("semantic_cache_lookups_total", "result=\"error\""),
+                hit_distance("semantic_cache_distance_permille", "result=\"hit\""), miss_distance("semantic_cache_distance_permille", "result=\"miss\""),
+                audit_distance("semantic_cache_audit_distance_permille"), lookup_ms("semantic_cache_lookup_ms"),
+                entry_count("semantic_cache_entries"), byte_count("semantic_cache_bytes"), evictions("semantic_cache_evictions_total") {}
+
+            struct settings {
+                double threshold = 0.95;
+                double budget_mb = 64;
+                std::string model; // embedding model; empty for the generation model
+                double audit = 0;
+            };
+
+            // "threshold=0.92,budget_mb=64,model=NAME,audit=0.05", any of them. False if the spec is bad.
+            static bool parse(const std::string& spec, settings& s)
+            {
+                size_t start = 0;
+                while (start < spec.length()) {
+                    size_t comma = spec.find(',', start);
+                    std::string field = spec.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+                    size_t eq = field.find('=');
+                    if (eq == std::string::npos) return false;
+                    std::string key = field.substr(0, eq), value = field.substr(eq + 1);
+                    if (key == "threshold") s.threshold = atof(value.c_str());
+                    else if (key == "budget_mb") s.budget_mb = atof(value.c_str());
+                    else if (key == "model") s.model = value;
+                    else if (key == "audit") s.audit = atof(value.c_str());
+                    else return false;
+                    if (comma == std::string::npos) break;
+                    start = comma + 1;
+                }
+                return s.threshold > 0 && s.threshold <= 1 && s.budget_mb > 0;
+            }
+
+            // A cache from a parse() spec, embedding with default_model unless it names one; nullptr if the spec is bad
+            static std::unique_ptr<cache> make(backends::pool& pool, const std::string& default_model, const std::string& spec)
+            {
+                settings s;
+                if (!parse(spec, s)) return nullptr;
+                return std::unique_ptr<cache>(new cache(pool, s.model.empty() ? default_model : s.model, s.threshold,
+                                                        (size_t)(s.budget_mb * 1024 * 1024), s.audit));
+            }
+
+            // Streams a cached reply to a turn of conversation close enough to this one, if there is
+            // one. Either way p is filled in for record().
+            bool replay(const std::string& conversation, const std::string& turn, const std::function<void(const ollama::response&)>& on_token, probe& p)
+            {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                p = probe();
+                p.scope = std::hash<std::string>()(conversation);
+                p.vector = embed(turn);
+                if (p.vector.empty()) { errors.inc(); return false; }
+
+                std::string reply;
+                float similarity = nearest(p.vector, p.scope, reply);
+                lookup_ms.observe(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+                double distance = (1 - similarity) * 1000;
+
+                if (reply.empty()) { misses.inc(); return false; } // nothing indexed yet
+                if (similarity < threshold) {
+                    misses.inc();
+                    miss_distance.observe(distance);
+                    return false;
+                }
+                hits.inc();
+                hit_distance.observe(distance);
+                {
+                    std::lock_guard<std::mutex> hold(lock);
+                    p.audit = audit_rate > 0 && std::uniform_real_distribution<double>(0, 1)(coin) < audit_rate;
+                }
+                if (p.audit) { p.cached = reply; return false; }
+
+                // A word a chunk, then the closing chunk (without a context: this reply was never generated here)
+                size_t from = 0;
+                while (from < reply.length()) {
+                    size_t space = reply.find(' ', from + 1);
+                    if (space == std::string::npos) space = reply.length();
+                    nlohmann::json chunk = { {"model", model}, {"response", reply.substr(from, space - from)}, {"done", false} };
+                    on_token(ollama::response(chunk.dump()));
+                    from = space;
+                }
+                nlohmann::json done = { {"model", model}, {"response", ""}, {"done", true}, {"done_reason", "stop"} };
+                on_token(ollama::response(done.dump()));
+                return true;
+            }
+
+            // After a generated turn: keeps the reply for next time, or scores the audit
+            void record(const probe& p, const std::string& turn, const std::string& reply)
+            {
+                if (p.vector.empty() || reply.empty()) return;
+                if (p.audit) {
+                    std::vector<float> fresh = embed(reply), cached = embed(p.cached);
+                    if (!fresh.empty() && fresh.size() == cached.size())
+                        audit_distance.observe((1 - dot(fresh.data(), cached.data(), fresh.size())) * 1000);
+                    return;
+                }
+                insert(p.vector, p.scope, turn, reply);
+            }
+
+        private:
+            struct entry {
+                std::string turn, reply;
+                size_t scope;
+                uint64_t last_used;
+            };
+
+            std::vector<float> embed(const std::string& text)
+            {
+                std::vector<float> v;
+                pool.run(model, -1, [&](Ollama& ollama) {
+                    ollama::response r = ollama.generate_embeddings(model, text);
+                    const nlohmann::json& j = r.as_json();
+                    if (!j.contains("embeddings") || !j["embeddings"].is_array() || j["embeddings"].empty()) return;
+                    v = j["embeddings"][0].get<std::vector<float>>();
+                }, nullptr);
+                normalize(v);
+                return v;
+            }
+
+            // Best cosine similarity among scope's entries (the reply it belongs to in reply), or -1
+            float nearest(const std::vector<float>& q, size_t scope, std::string& reply)
+            {
+                std::lock_guard<std::mutex> hold(lock);
+                if (q.size() != dim || entries.empty()) return -1;
+                float best = -1;
+                size_t best_row = entries.size();
+                for (size_t row = 0; row < entries.size(); row++) {
+                    if (entries[row].scope != scope) continue;
+                    float s = dot(q.data(), &vectors[row * dim], dim);
+                    if (s > best) { best = s; best_row = row; }
+                }
+                if (best_row == entries.size()) return -1;
+                entries[best_row].last_used = ++tick;
+                reply = entries[best_row].reply;
+                return best;
+            }
+
+            void insert(const std::vector<float>& v, size_t scope, const std::string& turn, const std::string& reply)
+            {
+                std::lock_guard<std::mutex> hold(lock);
+                if (entries.empty()) dim = v.size();
+                if (v.size() != dim) return; // the embedding model changed under us
+
+                entries.push_back(entry{turn, reply, scope, ++tick});
+                vectors.insert(vectors.end(), v.begin(), v.end());
+                bytes += cost(entries.back());
+                while (bytes > budget && entries.size() > 1) evict();
+                entry_count.set(entries.size());
+                byte_count.set(bytes);
+            }
+
+            size_t cost(const entry& e) const { return dim * sizeof(float) + e.turn.size() + e.reply.size() + sizeof(entry); }
+
+            // Drops the least recently used entry; the last row moves into its place. Caller holds lock.
+            void evict()
+            {
+                size_t victim = 0;
+                for (size_t row = 1; row < entries.size(); row++)
+                    if (entries[row].last_used < entries[victim].last_used) victim = row;
+
+                bytes -= cost(entries[victim]);
+                size_t last = entries.size() - 1;
+                if (victim != last) {
+                    entries[victim] = std::move(entries[last]);
+                    std::copy(vectors.begin() + last * dim, vectors.begin() + (last + 1) * dim, vectors.begin() + victim * dim);
+                }
+                entries.pop_back();
+                vectors.resize(last * dim);
+                evictions.inc();
+            }
+
+            backends::pool& pool;
+            std::string model;
+            double threshold;
+            size_t budget;
+            double audit_rate;
+
+            std::mutex lock;
+            std::mt19937 coin;
+            size_t dim = 0;
+            std::vector<float> vectors; // entries.size() rows of dim, unit length
+            std::vector<entry> entries;
+            size_t bytes = 0;
+            uint64_t tick = 0;
+
+            metrics::counter hits, misses, errors;
+            metrics::histogram hit_distance, miss_distance, audit_distance, lookup_ms;
+            metrics::gauge entry_count, byte_count;
+            metrics::counter evictions;
+    };
+}
+
+#endif
@@ -0,0 +1,214 @@
+/*
+** session_store.hpp -- model context kept per conversation, in binary
+**
+** Passing an ollama::response back into generate() copies its "context" JSON
+** array -- thousands of ints held as json nodes -- into the next request, which
+** then gets printed back out as text. A session_store keeps each conversation's
+** context as a flat int32 vector keyed by conversation id, and writes the
+** numbers straight from that vector into the request body as it's built.
+**
+** A reply generated from only part of the peer's turn (a speculation's) comes
+** back with a context that lacks the rest of it. That rest is carried as text
+** and goes in at the start of the next prompt, so the context after that covers it.
+**
+** With a directory, a session the peer named (restore()) is written to
+** <dir>/<id>.ctx after every turn (replaced atomically) and read back the first
+** time its name comes up again, so a conversation picks up where it left off
+** after a restart. Sessions under ids we made up ourselves ("conv-<pid>" and the
+** like) are never saved: the next process to get that pid isn't the same
+** conversation.
+*/
+
+#ifndef SESSION_STORE_HPP
+#define SESSION_STORE_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <charconv>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ollama.hpp"
+#include "metrics.hpp"
+
+#define SESSION_MAGIC 0x5854434f // "OCTX"
+#define SESSION_VERSION 1
+#define MAX_SESSION_ID 64 // longer names are kept in memory only
+
+class session_store {
+    public:
+        // An empty dir keeps sessions in memory only
+        session_store(const std::string& dir = ""): dir(dir), restored("sessions_restored_total"),
+            context_tokens("session_context_tokens") {}
+
+        // Ids become file names, so anything but [A-Za-z0-9_-] is written %XX; no two ids share one
+        static std::string clean_id(const std::string& id)
+        {
+            static const char hex[] = "0123456789ABCDEF";
+            std::string clean = "s"; // never empty, never hidden
+            for (char ch : id) {
+                if (isalnum((unsigned char)ch) || ch == '_' || ch == '-') clean += ch;
+                else { clean += '%'; clean += hex[(unsigned char)ch >> 4]; clean += hex[(unsigned char)ch & 15]; }
+            }
+            return clean;
+        }
+
+        // id is the peer's own name for its conversation: pick up its saved context, if there
+        // is one, and save it from now on (with a directory)
+        void restore(const std::string& id)
+        {
+            if (dir.empty()) return;
+            if (id.length() > MAX_SESSION_ID) {
+                fprintf(stderr, "session_store: session id over %d bytes; not saving it\n", MAX_SESSION_ID);
+                return;
+            }
+            std::lock_guard<std::mutex> hold(lock);
+            session& s = find(id);
+            if (s.saved) return;
+            s.saved = true;
+            if (s.turns == 0 && load(id, s)) restored.inc();
+        }
+
+        // Streaming generate request body for the session's next turn, stored context (and carried text) included
+        std::string build_request(const std::string& id, const std::string& model, const std::string& prompt, const nlohmann::json& options = nullptr)
+        {
+            std::lock_guard<std::mutex> hold(lock);
+            const session& s = find(id);
+            ollama::request request(model, s.carried.empty() ? prompt : s.carried + "Them: " + prompt, options, true);
+            std::string body = request.dump();
+            if (s.context.empty()) return body;
+
+            body.pop_back(); // reopen the object
+            body.reserve(body.length() + 16 + s.context.size() * 7);
+            body += ",\"context\":[";
+            char digits[16];
+            for (size_t i = 0; i < s.context.size(); i++) {
+                if (i) body += ',';
+                std::to_chars_result r = std::to_chars(digits, digits + sizeof digits, s.context[i]);
+                body.append(digits, r.ptr - digits);
+            }
+            body += "]}";
+            return body;
+        }
+
+        // Keeps the context from a turn's final chunk (and saves it, with a directory)
+        void update(const std::string& id, const ollama::response& final_chunk)
+        {
+            const nlohmann::json& j = final_chunk.as_json();
+            if (!j.contains("context") || !j["context"].is_array()) return;
+
+            std::lock_guard<std::mutex> hold(lock);
+            session& s = find(id);
+            s.context.clear();
+            s.context.reserve(j["context"].size());
+            for (const nlohmann::json& token : j["context"]) s.context.push_back(token.get<int32_t>());
+            s.carried.clear(); // the new context has them
+            s.rehash();
+            s.turns++;
+            context_tokens.observe(s.context.size());
+            if (s.saved) save(id, s);
+        }
+
+        // The context from the last update() lacks the end of the peer's turn, unseen: the next request
+        // starts its prompt with it (and update() forgets it once a context covers it)
+        void carry(const std::string& id, const std::string& unseen)
+        {
+            if (unseen.empty()) return;
+            std::lock_guard<std::mutex> hold(lock);
+            session& s = find(id);
+            s.carried += "Them (the rest of what they said before): " + unseen + "\n";
+            s.rehash();
+        }
+
+        // FNV-1a of what build_request adds to the prompt: the stored context and carried text; 0 for none
+        uint64_t context_hash(const std::string& id)
+        {
+            std::lock_guard<std::mutex> hold(lock);
+            return find(id).hash;
+        }
+
+        // Drops the in-memory copy; the saved one stays for the next time the id shows up
+        void forget(const std::string& id)
+        {
+            std::lock_guard<std::mutex> hold(lock);
+            sessions.erase(id);
+        }
+
+    private:
+        struct session {
+            std::vector<int32_t> context;
+            uint32_t turns = 0;
+            bool saved = false; // restore()d: written to dir after every turn
+            std::string carried; // what the context is missing, as prompt text
+            uint64_t hash = 0; // of context and carried
+
+            void rehash()
+            {
+                hash = 0;
+                if (context.empty() && carried.empty()) return;
+                hash = 0xcbf29ce484222325ULL;
+                const unsigned char* bytes = (const unsigned char*)context.data();
+                for (size_t i = 0; i < context.size() * sizeof(int32_t); i++) hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+                for (unsigned char ch : carried) hash = (hash ^ ch) * 0x100000001b3ULL;
+            }
+        };
+
+        // Caller holds lock
+        session& find(const std::string& id) { return sessions[id]; }
+
+        std::string path(const std::string& id) const { return dir + "/" + clean_id(id) + ".ctx"; }
+
+        // [magic][version][turns][count][count x int32], native byte order
+        bool load(const std::string& id, session& s)
+        {
+            FILE* f = fopen(path(id).c_str(), "rb");
+            if (!f) return false;
+
+            uint32_t header[4];
+            bool ok = fread(header, sizeof header, 1, f) == 1 && header[0] == SESSION_MAGIC && header[1] == SESSION_VERSION;
+            if (ok) {
+                s.turns = header[2];
+                s.context.resize(header[3]);
+                ok = header[3] == 0 || fread(s.context.data(), sizeof(int32_t), header[3], f) == header[3];
+            }
+            s.rehash();
+            fclose(f);
+            if (!ok) {
+                fprintf(stderr, "session_store: ignoring corrupt %s\n", path(id).c_str());
+                s.turns = 0;
+                s.context.clear();
+                s.hash = 0;
+            }
+            return ok;
+        }
+
+        bool save(const std::string& id, const session& s)
+        {
+            std::string final_path = path(id), tmp = final_path + ".tmp";
+            FILE* f = fopen(tmp.c_str(), "wb");
+            if (!f) { perror("session_store: fopen"); return false; }
+
+            uint32_t header[4] = { SESSION_MAGIC, SESSION_VERSION, s.turns, (uint32_t)s.context.size() };
+            bool ok = fwrite(header, sizeof header, 1, f) == 1 &&
+                      fwrite(s.context.data(), sizeof(int32_t), s.context.size(), f) == s.context.size();
+            ok = fclose(f) == 0 && ok;
+            if (!ok || rename(tmp.c_str(), final_path.c_str()) == -1) {
+                perror("session_store: save");
+                unlink(tmp.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        std::string dir;
+        std::mutex lock;
+        std::unordered_map<std::string, session> sessions;
+        metrics::counter restored;
+        metrics::histogram context_tokens;
+};
+
+#endif
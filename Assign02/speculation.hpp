@@ -0,0 +1,198 @@
+/*
+** speculation.hpp -- starting our reply before the peer has finished theirs
+**
+** With -s the peer's turn streams in token by token, but we only start
+** generating once the last one arrives, so every turn waits for the peer's
+** whole decode and then for our own prompt evaluation, one after the other.
+** A speculator starts our reply as soon as the peer's turn has `after`
+** sentences, on just that much of it, and holds on to the tokens. When the
+** turn ends:
+**
+**   - if what came after that prefix is at most `diverge` of the whole turn,
+**     the speculation stands: the tokens it has so far are handed over at
+**     once and the rest as they arrive (a hit). Its final chunk's context only
+**     covers the prefix, so callers keeping a session's context have to make
+**     up for the rest of the turn (see session_store::carry);
+**   - otherwise it's cancelled and the reply is generated from the full turn
+**     as usual (a miss). The backend has still evaluated the prompt up to the
+**     prefix, and Ollama reuses that for the follow-up request.
+**
+** speculation_hits_total and speculation_misses_total give the hit rate (also
+** kept in speculation_hit_permille), speculation_wasted_tokens_total what the
+** misses cost, and speculation_head_start_ms how long before the end of the
+** peer's turn the hits started.
+**
+**   server -s -X after=1,diverge=0.25
+*/
+
+#ifndef SPECULATION_HPP
+#define SPECULATION_HPP
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ollama.hpp"
+#include "metrics.hpp"
+#include "backends.hpp"
+
+class speculator {
+    public:
+        using token_callback = std::function<void(const ollama::response&)>;
+        // Generates request into on_token, stopping as soon as keep_going() is false. False if it failed.
+        using generator = std::function<bool(const std::string& request, const token_callback& on_token, const std::function<bool()>& keep_going)>;
+
+        struct settings {
+            int after = 1; // sentences of the peer's turn to wait for
+            double diverge = 0.25; // most of the final turn the speculation may not have seen
+        };
+
+        // "after=N,diverge=F", either of them. False if the spec is bad.
+        static bool parse(const std::string& spec, settings& s)
+        {
+            size_t start = 0;
+            while (start < spec.length()) {
+                size_t comma = spec.find(',', start);
+                std::string field = spec.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+                size_t eq = field.find('=');
+                if (eq == std::string::npos) return false;
+                std::string key = field.substr(0, eq), value = field.substr(eq + 1);
+                if (key == "after") s.after = atoi(value.c_str());
+                else if (key == "diverge") s.diverge = atof(value.c_str());
+                else return false;
+                if (comma == std::string::npos) break;
+                start = comma + 1;
+            }
+            return s.after >= 1 && s.diverge >= 0 && s.diverge <= 1;
+        }
+
+        speculator(const settings& s):
+            s(s), started("speculation_started_total"), hits("speculation_hits_total"), misses("speculation_misses_total"),
+            wasted_tokens("speculation_wasted_tokens_total"), hit_permille("speculation_hit_permille"),
+            head_start_ms("speculation_head_start_ms") {}
+
+        ~speculator() { cancel(); }
+
+        // The peer's turn so far, as it streams in. Once it has enough sentences, starts generating a reply
+        // to it in the background (once a turn).
+        void partial(const std::string& so_far, const std::function<std::string(const std::string&)>& request_for, const generator& generate)
+        {
+            if (current || sentences(so_far) < s.after) return;
+            std::shared_ptr<attempt> a = std::make_shared<attempt>();
+            a->prefix = so_far;
+            a->start = std::chrono::steady_clock::now();
+            std::string request = request_for(so_far);
+            a->worker = std::thread([a, request, generate]() {
+                bool ok = generate(request, [a](const ollama::response& token) {
+                    std::lock_guard<std::mutex> hold(a->lock);
+                    a->tokens.push_back(token);
+                    a->changed.notify_all();
+                }, [a]() { return !a->cancelled; });
+                std::lock_guard<std::mutex> hold(a->lock);
+                a->backend = backends::last_used();
+                a->ok = ok && !a->cancelled;
+                a->done = true;
+                a->changed.notify_all();
+            });
+            current = a;
+            started.inc();
+        }
+
+        // The peer's turn is complete. If a speculation covers enough of it, streams its reply into on_token
+        // and returns true, with complete saying whether it got to the end and seen how much of turn it was
+        // generated from (all of it, or its context lacks the rest). False: generate the reply as usual.
+        bool finish(const std::string& turn, const token_callback& on_token, bool& complete, size_t& seen)
+        {
+            if (!current) return false;
+            std::shared_ptr<attempt> a = current;
+            double unseen = turn.empty() ? 0 : 1 - (double)a->prefix.length() / turn.length();
+            if (turn.compare(0, a->prefix.length(), a->prefix) != 0 || unseen > s.diverge) {
+                cancel();
+                return false;
+            }
+
+            double head_start = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - a->start).count();
+            size_t handed = 0;
+            std::unique_lock<std::mutex> hold(a->lock);
+            while (true) {
+                a->changed.wait(hold, [&]() { return handed < a->tokens.size() || a->done; });
+                if (a->done && handed == a->tokens.size()) break;
+                ollama::response token = a->tokens[handed++];
+                hold.unlock();
+                on_token(token);
+                hold.lock();
+            }
+            bool ok = a->ok;
+            hold.unlock();
+            if (!ok && handed == 0) { // failed before it produced anything; nothing lost by starting over
+                cancel();
+                return false;
+            }
+
+            a->worker.join();
+            backends::last_used() = a->backend; // the reply is ours now, and so is where it came from
+            current = nullptr;
+            complete = ok;
+            seen = a->prefix.length();
+            hits.inc();
+            head_start_ms.observe(head_start);
+            update_rate();
+            return true;
+        }
+
+        // Drops the speculation, if any: the turn was answered some other way, or it went wrong
+        void cancel()
+        {
+            if (!current) return;
+            current->cancelled = true;
+            current->worker.join();
+            wasted_tokens.inc(current->tokens.size());
+            misses.inc();
+            update_rate();
+            current = nullptr;
+        }
+
+    private:
+        struct attempt {
+            std::string prefix;
+            std::chrono::steady_clock::time_point start;
+            std::thread worker;
+            std::atomic<bool> cancelled{false};
+            std::mutex lock;
+            std::condition_variable changed;
+            std::vector<ollama::response> tokens;
+            std::string backend; // that generated it
+            bool done = false, ok = false;
+        };
+
+        // Finished sentences: ., ! or ? followed by whitespace
+        static int sentences(const std::string& text)
+        {
+            int n = 0;
+            for (size_t i = 0; i + 1 < text.length(); i++)
+                if ((text[i] == '.' || text[i] == '!' || text[i] == '?') && isspace((unsigned char)text[i + 1])) n++;
+            return n;
+        }
+
+        void update_rate()
+        {
+            int64_t h = hits.value(), total = h + misses.value();
+            if (total > 0) hit_permille.set(h * 1000 / total);
+        }
+
+        settings s;
+        std::shared_ptr<attempt> current;
+
+        metrics::counter started, hits, misses, wasted_tokens;
+        metrics::gauge hit_permille;
+        metrics::histogram head_start_ms;
+};
+
+#endif
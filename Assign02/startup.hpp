@@ -0,0 +1,174 @@
+/*
+** startup.hpp -- getting the server ready without waiting on the operator
+**
+** The server used to ask for its opening message before doing anything else,
+** so until someone typed one, clients were refused and the backends sat cold.
+** Startup is now a pipeline of stages run side by side -- bind and listen,
+** warm the model, learn the opening message -- and the server is ready once
+** the last of them finishes. Connections made in the meantime wait in the
+** listen backlog instead of being refused.
+**
+** The opening message comes from whichever source has it first: the command
+** line, an opening= line in the persona file, POST /admin/opening on the
+** metrics port, or the terminal as before.
+**
+**   startup::pipeline boot;
+**   boot.stage("listen", [&]() { return (sockfd = listen_on(PORT)) != -1; });
+**   boot.stage("opening", [&]() { opening = greeting.wait(); return true; });
+**   if (!boot.run()) exit(1); // logs "server: ready in ... ms (listen ..., opening ...)"
+*/
+
+#ifndef STARTUP_HPP
+#define STARTUP_HPP
+
+#include <stdio.h>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "metrics.hpp"
+
+namespace startup
+{
+    using clock = std::chrono::steady_clock;
+
+    // When the process started, near enough: call it first thing in main
+    inline clock::time_point began()
+    {
+        static clock::time_point t = clock::now();
+        return t;
+    }
+
+    inline double ms_since(clock::time_point t) { return std::chrono::duration<double, std::milli>(clock::now() - t).count(); }
+
+    class pipeline {
+        public:
+            // fn returns false if the server can't start
+            void stage(const std::string& name, const std::function<bool()>& fn) { stages.push_back(entry{name, fn, 0, false}); }
+
+            // Runs every stage at once and waits for them all. Logs time-to-ready (from began()) and
+            // how long each stage took, and exports both as gauges.
+            bool run()
+            {
+                clock::time_point start = clock::now();
+                std::vector<std::thread> threads;
+                for (entry& e : stages) {
+                    threads.emplace_back([&e, start]() {
+                        e.ok = e.fn();
+                        e.ms = ms_since(start);
+                    });
+                }
+                for (std::thread& t : threads) t.join();
+
+                std::string detail;
+                bool ok = true;
+                for (const entry& e : stages) {
+                    char part[128];
+                    snprintf(part, sizeof part, "%s%s %.0f ms%s", detail.empty() ? "" : ", ", e.name.c_str(), e.ms, e.ok ? "" : " FAILED");
+                    detail += part;
+                    metrics::gauge("startup_stage_ms", "stage=\"" + e.name + "\"").set((int64_t)e.ms);
+                    ok = ok && e.ok;
+                }
+                double ready = ms_since(began());
+                if (ok) {
+                    metrics::gauge("startup_ready_ms").set((int64_t)ready);
+                    fprintf(stderr, "server: ready in %.0f ms (%s)\n", ready, detail.c_str());
+                }
+                else fprintf(stderr, "server: startup failed after %.0f ms (%s)\n", ready, detail.c_str());
+                return ok;
+            }
+
+        private:
+            struct entry {
+                std::string name;
+                std::function<bool()> fn;
+                double ms;
+                bool ok;
+            };
+            std::vector<entry> stages;
+    };
+
+    // The opening message, settable once from any thread
+    class opening {
+        public:
+            // False if it was already set. A newline is added if missing: the peer reads it as a line.
+            bool set(std::string text)
+            {
+                if (text.empty()) return false;
+                if (text.back() != '\n') text += '\n';
+                std::lock_guard<std::mutex> hold(lock);
+                if (!message.empty()) return false;
+                message = text;
+                changed.notify_all();
+                return true;
+            }
+
+            std::string wait()
+            {
+                std::unique_lock<std::mutex> hold(lock);
+                changed.wait(hold, [this]() { return !message.empty(); });
+                return message;
+            }
+
+            // Prompts on the terminal the way the server always has, in the background; whatever
+            // else sets it first wins and the prompt is left unanswered
+            void read_from_terminal()
+            {
+                std::thread([this]() {
+                    char line[1000];
+                    printf("Starting Message: ");
+                    fflush(stdout);
+                    while (!fgets(line, sizeof line, stdin)) {
+                        if (feof(stdin)) return; // nobody at the terminal; the admin command it is
+                        clearerr(stdin);
+                    }
+                    if (!set(line)) fprintf(stderr, "server: already have an opening message, ignoring the one typed\n");
+                }).detach();
+            }
+
+        private:
+            std::mutex lock;
+            std::condition_variable changed;
+            std::string message;
+    };
+
+    // A persona file: "key=value" lines, blank lines and # comments ignored.
+    //   name=sam
+    //   opening=Hi! I'm Sam. Seen any good films lately?
+    //   options=temperature=0.9,seed=7
+    struct persona {
+        std::string name = "default"; // what telemetry files its replies under; the file's name if it doesn't say
+        std::string opening;
+        std::string options; // generation options, as -O takes them
+    };
+
+    inline bool load_persona(const std::string& path, persona& p)
+    {
+        std::ifstream in(path);
+        if (!in) { perror(("server: " + path).c_str()); return false; }
+        size_t slash = path.rfind('/'), dot = path.rfind('.');
+        p.name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+        if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) p.name = p.name.substr(0, p.name.rfind('.'));
+        int n = 0;
+        for (std::string line; std::getline(in, line); ) {
+            n++;
+            if (line.empty() || line[0] == '#') continue;
+            size_t eq = line.find('=');
+            std::string key = line.substr(0, eq);
+            if (eq != std::string::npos && key == "name") p.name = line.substr(eq + 1);
+            else if (eq != std::string::npos && key == "opening") p.opening = line.substr(eq + 1);
+            else if (eq != std::string::npos && key == "options") p.options = line.substr(eq + 1);
+            else {
+                fprintf(stderr, "server: %s:%d: expected name=..., opening=... or options=...\n", path.c_str(), n);
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+#endif
@@ -0,0 +1,133 @@
+/*
+** talker.cpp -- rooms of AIs talking among themselves (see arbiter.hpp)
+**
+** Runs -n rooms of the same agents at once on one scheduler and prints room
+** 0's conversation (every room's with -v), then a summary.
+**
+**   talker -a agents.txt -P interrupt:60 -t 30
+**   talker -n 300 -P bid:2 -c 4 -w 16 -B http://localhost:11435 -m 9200
+**
+** An agents file has one agent a line, "Name: persona"; # starts a comment.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ollama.hpp"
+#include "metrics.hpp"
+#include "backends.hpp"
+#include "scheduler.hpp"
+#include "response_cache.hpp"
+#include "arbiter.hpp"
+
+static bool load_agents(const std::string& path, std::vector<arbiter::agent>& agents)
+{
+    std::ifstream in(path);
+    if (!in) { perror(("talker: " + path).c_str()); return false; }
+    int n = 0;
+    for (std::string line; std::getline(in, line); ) {
+        n++;
+        if (line.empty() || line[0] == '#') continue;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || colon == 0) {
+            fprintf(stderr, "talker: %s:%d: expected Name: persona\n", path.c_str(), n);
+            return false;
+        }
+        size_t start = line.find_first_not_of(' ', colon + 1);
+        agents.push_back(arbiter::agent{line.substr(0, colon), start == std::string::npos ? "" : line.substr(start)});
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    int rooms = 1;
+    std::string agents_file;
+    std::string policy_spec = "round-robin";
+    int workers = 8;
+    int concurrency = 4; // 0: no scheduler
+    std::string backend_urls = "http://localhost:11434";
+    std::string embed_model; // empty: the generation model
+    std::string options_spec;
+    std::string opening = "Hi everyone! What's something you've been thinking about lately?";
+    std::string priority = "interactive";
+    int metrics_port = 0;
+    bool verbose = false;
+    arbiter::engine::settings settings;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:a:P:t:w:c:B:M:E:O:o:H:q:m:v")) != -1) {
+        switch (opt) {
+        case 'n': rooms = atoi(optarg); break;
+        case 'a': agents_file = optarg; break; // "Name: persona" lines; three stock agents without it
+        case 'P': policy_spec = optarg; break; // round-robin, addressed, bid:K or interrupt:TOKENS
+        case 't': settings.turns = atoi(optarg); break; // generated turns per room
+        case 'w': workers = atoi(optarg); break; // generation threads shared by every room
+        case 'c': concurrency = atoi(optarg); break; // generations at once per backend; 0 for no limit
+        case 'B': backend_urls = optarg; break; // comma-separated Ollama URLs
+        case 'M': settings.model = optarg; break;
+        case 'E': embed_model = optarg; break; // model the bid policy embeds with
+        case 'O': options_spec = optarg; break; // generation options as key=value,...
+        case 'o': opening = optarg; break; // what the first agent opens every room with
+        case 'H': settings.history = atoi(optarg); break; // transcript lines in each prompt
+        case 'q': priority = optarg; break; // interactive or batch
+        case 'm': metrics_port = atoi(optarg); break; // serve /metrics on this port
+        case 'v': verbose = true; break; // print every room, not just room 0
+        default:
+            fprintf(stderr, "usage: talker [-n rooms] [-a agents_file] [-P policy] [-t turns] [-w workers] [-c concurrency] [-B url,...] "
+                            "[-M model] [-E embed_model] [-O key=value,...] [-o opening] [-H history] [-q priority] [-m metrics_port] [-v]\n");
+            exit(1);
+        }
+    }
+
+    std::vector<arbiter::agent> agents;
+    if (!agents_file.empty() && !load_agents(agents_file, agents)) exit(1);
+    if (agents.empty()) agents = {
+        { "Ada", "You are curious and ask a lot of questions." },
+        { "Ben", "You are a skeptical engineer who likes concrete examples." },
+        { "Cleo", "You are a cheerful traveller with a story for everything." },
+    };
+    if (agents.size() < 2) {
+        fprintf(stderr, "talker: a room needs at least two agents\n");
+        exit(1);
+    }
+    backends::pool pool(backend_urls);
+    if (embed_model.empty()) embed_model = settings.model;
+    if (!arbiter::make(policy_spec, pool, embed_model)) {
+        fprintf(stderr, "talker: unknown turn policy %s\n", policy_spec.c_str());
+        exit(1);
+    }
+    settings.options = response_cache::parse_options(options_spec);
+    settings.priority = sched::parse_priority(priority);
+
+    pool.start_health_checks();
+    if (metrics_port) metrics::serve(metrics_port);
+    sched::scheduler* scheduler = concurrency > 0 ? sched::scheduler::create(pool.size(), concurrency, false) : nullptr;
+
+    std::mutex print;
+    arbiter::engine engine(pool, scheduler, workers, settings);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rooms; i++) {
+        engine.open(agents, arbiter::make(policy_spec, pool, embed_model), opening,
+                    [&](int room, const arbiter::agent& speaker, const arbiter::line& said) {
+            if (room != 0 && !verbose) return;
+            std::lock_guard<std::mutex> hold(print);
+            printf("[room %d] %s: %s%s\n", room, speaker.name.c_str(), said.text.c_str(), said.interrupted ? " --" : "");
+            fflush(stdout);
+        });
+    }
+    engine.wait();
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const arbiter::engine::totals& t = engine.counters();
+    printf("talker: %d rooms, %lld turns in %.1f s (%.1f turns/s); %lld candidates, %lld cancelled (%lld tokens wasted), "
+           "%lld interrupts, %lld failed turns\n",
+           rooms, (long long)t.turns, elapsed, t.turns / elapsed, (long long)t.candidates, (long long)t.cancelled,
+           (long long)t.wasted_tokens, (long long)t.interrupts, (long long)t.failed);
+    return 0;
+}
@@ -0,0 +1,80 @@
+/*
+** telemetry.hpp -- where the time in a reply went, per model, persona and backend
+**
+** Ollama ends every reply with how many prompt tokens it evaluated and how
+** long that took, how many it generated and how long that took, and how long
+** it spent loading the model first. record() turns a reply's final chunk into
+**
+**   ollama_prefill_tokens_per_second  prompt evaluation speed
+**   ollama_decode_tokens_per_second   generation speed
+**   ollama_load_ms                    model load before the reply (~0 when warm)
+**   ollama_prompt_tokens              prompt size, which grows with the context
+**
+** histograms labelled with the model, the persona speaking and the backend
+** that served it (its backends::label(), the index the pool logs a URL for),
+** on the metrics endpoint. A turn that slowed down with a
+** growing ollama_prompt_tokens is context growth; with ollama_load_ms, a
+** model load; with decode speed dropping on one backend only, that backend.
+**
+**   telemetry::record(final_chunk, "sam", backends::last_used());
+*/
+
+#ifndef TELEMETRY_HPP
+#define TELEMETRY_HPP
+
+#include <map>
+#include <mutex>
+#include <string>
+#include "ollama.hpp"
+#include "metrics.hpp"
+
+namespace telemetry
+{
+    // The three values and their 30 bytes of keys and quotes fit in metrics::LABELS_LEN (the backend's is a
+    // short index, so only the model and persona could ever be clipped)
+    const size_t LABEL_VALUE_LEN = 30;
+
+    struct series {
+        metrics::histogram prefill_tps, decode_tps, load_ms, prompt_tokens;
+    };
+
+    // Label values as Prometheus takes them, clipped so the metric is found again next time
+    inline std::string label_value(const std::string& v)
+    {
+        std::string out;
+        for (char ch : v.substr(0, LABEL_VALUE_LEN)) {
+            if (ch == '"' || ch == '\\' || ch == '\n') out += '_';
+            else out += ch;
+        }
+        return out.empty() ? "unknown" : out;
+    }
+
+    inline series& find(const std::string& model, const std::string& persona, const std::string& backend)
+    {
+        static std::mutex lock;
+        static std::map<std::string, series> known; // this process's handles; the numbers are in the registry
+        std::string labels = "model=\"" + label_value(model) + "\",persona=\"" + label_value(persona) +
+                             "\",backend=\"" + label_value(backend) + "\"";
+        std::lock_guard<std::mutex> hold(lock);
+        auto it = known.find(labels);
+        if (it == known.end()) {
+            it = known.emplace(labels, series{
+                metrics::histogram("ollama_prefill_tokens_per_second", labels), metrics::histogram("ollama_decode_tokens_per_second", labels),
+                metrics::histogram("ollama_load_ms", labels), metrics::histogram("ollama_prompt_tokens", labels) }).first;
+        }
+        return it->second;
+    }
+
+    // A reply generated for persona on backend, by its final chunk. Chunks without timings are skipped.
+    inline void record(const ollama::response& final_chunk, const std::string& persona, const std::string& backend)
+    {
+        if (!final_chunk.has_timings()) return;
+        series& s = find(final_chunk.as_json().value("model", ""), persona, backend);
+        if (final_chunk.prompt_eval_duration() > 0) s.prefill_tps.observe(final_chunk.prompt_tokens_per_second());
+        if (final_chunk.eval_duration() > 0) s.decode_tps.observe(final_chunk.eval_tokens_per_second());
+        s.load_ms.observe(final_chunk.load_duration() / 1e6);
+        s.prompt_tokens.observe(final_chunk.prompt_eval_count());
+    }
+}
+
+#endif
@@ -0,0 +1,341 @@
+/*
+** tracing.hpp -- per-turn spans, exported as Chrome trace events
+**
+** A slow turn could be slow anywhere: reading the peer's turn off the
+** socket, queueing for a backend, building the request, the backend's
+** prefill or decode, or sending the reply. Spans time each of those for the
+** turns being traced and the trace opens in chrome://tracing or Perfetto.
+** The backend's share is timed around the request by trace::generate, which
+** stands in for Ollama::generate_serialized (ollama.hpp is upstream's).
+**
+** Each thread writes its spans into a ring of its own, so recording takes no
+** lock: two clock reads and a slot write. The rings are a fixed table that,
+** after init() with shared set, lives in memory shared with the conversation
+** processes forked later, so the parent can export every process's spans.
+** Only 1 turn in `sample` is traced; outside a traced turn a span costs one
+** thread-local read. Exports come from GET /trace on the metrics port
+** (?since=US for only the spans that ended later) and, with `every`, a file
+** of what's new written to `dir` that often.
+**
+**   server -t sample=10,every=60,dir=/var/tmp/relay-traces
+**
+**   trace::turn_scope traced(conversation, turn);
+**   { trace::span s("serialize"); request = ...; }
+*/
+
+#ifndef TRACING_HPP
+#define TRACING_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <string>
+#include <thread>
+#include "ollama.hpp"
+
+namespace trace
+{
+    const int MAX_RINGS = 128; // threads that can trace at once, across every process
+    const int RING_SPANS = 1024; // the most recent spans kept per thread
+    const int NAME_LEN = 24;
+
+    struct settings {
+        int sample = 1; // trace 1 turn in this many; 0 traces none
+        int every_s = 0; // write a trace file this often; 0 for GET /trace only
+        std::string dir = "."; // where
+    };
+
+    // "sample=N,every=S,dir=PATH", any of them. False if the spec is bad.
+    inline bool parse(const std::string& spec, settings& s)
+    {
+        size_t start = 0;
+        while (start < spec.length()) {
+            size_t comma = spec.find(',', start);
+            std::string field = spec.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+            size_t eq = field.find('=');
+            if (eq == std::string::npos) return false;
+            std::string key = field.substr(0, eq), value = field.substr(eq + 1);
+            if (key == "sample") s.sample = atoi(value.c_str());
+            else if (key == "every") s.every_s = atoi(value.c_str());
+            else if (key == "dir") s.dir = value;
+            else return false;
+            if (comma == std::string::npos) break;
+            start = comma + 1;
+        }
+        return s.sample >= 0 && s.every_s >= 0 && !s.dir.empty();
+    }
+
+    struct event {
+        std::atomic<uint32_t> seq; // odd while being written
+        char name[NAME_LEN];
+        int32_t pid, tid;
+        int32_t turn;
+        int64_t conversation;
+        int64_t start_us, dur_us;
+        int64_t n; // what the span counted (bytes, chunks...), 0 if nothing
+    };
+
+    struct ring {
+        std::atomic<int32_t> pid; // owner; 0 when free, its spans kept until someone else claims it
+        std::atomic<int64_t> next; // spans ever written
+        event events[RING_SPANS];
+    };
+
+    struct table {
+        std::atomic_flag lock = ATOMIC_FLAG_INIT;
+        std::atomic<int64_t> turns{0}; // started, for sampling
+        int sample = 0;
+        ring rings[MAX_RINGS];
+    };
+
+    inline table*& current_table() { static table* t = nullptr; return t; }
+
+    inline int64_t now_us()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Turns tracing on. With shared, the spans of processes forked afterwards are visible here too.
+    inline bool init(const settings& s, bool shared)
+    {
+        void* mem = nullptr;
+        if (shared) {
+            mem = mmap(nullptr, sizeof(table), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) { perror("trace: mmap"); mem = nullptr; }
+        }
+        if (!mem) mem = ::operator new(sizeof(table));
+        table* t = new (mem) table();
+        t->sample = s.sample;
+        current_table() = t;
+        return true;
+    }
+
+    // The turn the calling thread is working on
+    struct context {
+        int64_t conversation = 0;
+        int turn = 0;
+        bool sampled = false;
+    };
+
+    inline context& current()
+    {
+        thread_local context c;
+        return c;
+    }
+
+    inline bool sampled() { return current().sampled; }
+
+    // This thread's ring, claimed on its first span and given back when the thread ends. Null if
+    // tracing is off or every ring is taken.
+    class writer {
+        public:
+            ~writer() { if (r && pid == getpid()) r->pid = 0; }
+
+            ring* get()
+            {
+                if (r && pid != getpid()) { r = nullptr; tried = false; } // a forked copy of the parent's thread
+                if (!r && !tried) claim();
+                return r;
+            }
+
+            int pid = 0, tid = 0;
+
+        private:
+            void claim()
+            {
+                tried = true;
+                table* t = current_table();
+                if (!t) return;
+                pid = getpid();
+                tid = (int)syscall(SYS_gettid);
+                while (t->lock.test_and_set(std::memory_order_acquire)) ;
+                // A free ring, or one whose process died without giving it back; the emptiest of them
+                for (int i = 0; i < MAX_RINGS; i++) {
+                    ring& candidate = t->rings[i];
+                    int owner = candidate.pid;
+                    if (owner != 0 && (kill(owner, 0) == 0 || errno != ESRCH)) continue;
+                    if (!r || candidate.next < r->next) r = &candidate;
+                }
+                if (r) r->pid = pid;
+                t->lock.clear(std::memory_order_release);
+            }
+
+            ring* r = nullptr;
+            bool tried = false;
+    };
+
+    inline void record(const char* name, int64_t start_us, int64_t dur_us, int64_t n = 0)
+    {
+        thread_local writer w;
+        ring* r = w.get();
+        if (!r) return;
+        const context& c = current();
+        int64_t i = r->next.load(std::memory_order_relaxed);
+        event& e = r->events[i % RING_SPANS];
+        e.seq.fetch_add(1, std::memory_order_acq_rel);
+        snprintf(e.name, NAME_LEN, "%s", name);
+        e.pid = w.pid;
+        e.tid = w.tid;
+        e.conversation = c.conversation;
+        e.turn = c.turn;
+        e.start_us = start_us;
+        e.dur_us = dur_us;
+        e.n = n;
+        e.seq.fetch_add(1, std::memory_order_release);
+        r->next.store(i + 1, std::memory_order_release);
+    }
+
+    // Marks the calling thread as working on a turn for as long as it lives; whether the turn is
+    // traced is decided here. Also carries a turn over to another thread: turn_scope(c).
+    class turn_scope {
+        public:
+            turn_scope(int64_t conversation, int turn): saved(current())
+            {
+                table* t = current_table();
+                context c;
+                c.conversation = conversation;
+                c.turn = turn;
+                c.sampled = t && t->sample > 0 && t->turns.fetch_add(1, std::memory_order_relaxed) % t->sample == 0;
+                current() = c;
+            }
+            turn_scope(const context& c): saved(current()) { current() = c; }
+            ~turn_scope() { current() = saved; }
+        private:
+            context saved;
+    };
+
+    // Times its scope (or up to end()) if the turn is traced
+    class span {
+        public:
+            span(const char* name, int64_t n = 0): name(name), n(n), on(sampled()), start(on ? now_us() : 0) {}
+            ~span() { end(); }
+
+            void count(int64_t v) { n = v; }
+            void end()
+            {
+                if (!on) return;
+                on = false;
+                record(name, start, now_us() - start, n);
+            }
+
+        private:
+            const char* name;
+            int64_t n;
+            bool on;
+            int64_t start;
+    };
+
+    // Ollama::generate_serialized, recording ollama.prefill (until the first chunk is handed over) and
+    // ollama.decode (from there to the end) if the turn is traced
+    inline bool generate(Ollama& ollama, const std::string& request, const std::function<void(const ollama::response&)>& on_token,
+                         const std::function<bool()>& keep_going = nullptr)
+    {
+        if (!sampled()) return ollama.generate_serialized(request, on_token, keep_going);
+
+        struct timings {
+            int64_t sent_us = now_us(), first_us = 0, chunks = 0;
+            size_t bytes;
+            ~timings() // thrown out of or not, the request took this long
+            {
+                int64_t end_us = now_us();
+                if (!first_us) first_us = end_us;
+                record("ollama.prefill", sent_us, first_us - sent_us, bytes);
+                record("ollama.decode", first_us, end_us - first_us, chunks);
+            }
+        } t;
+        t.bytes = request.length();
+        return ollama.generate_serialized(request, [&](const ollama::response& token) {
+            if (!t.first_us) t.first_us = now_us();
+            t.chunks++;
+            on_token(token);
+        }, keep_going);
+    }
+
+    inline void append_json_string(std::string& out, const char* s)
+    {
+        out += '"';
+        for (; *s; s++) {
+            if (*s == '"' || *s == '\\') out += '\\';
+            if ((unsigned char)*s >= 0x20) out += *s;
+        }
+        out += '"';
+    }
+
+    // Every span still in a ring that ended in [since_us, until_us), as Chrome trace event JSON
+    inline std::string chrome_json(int64_t since_us = 0, int64_t until_us = INT64_MAX)
+    {
+        std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        table* t = current_table();
+        bool first = true;
+        char line[256];
+        for (int i = 0; t && i < MAX_RINGS; i++) {
+            ring& r = t->rings[i];
+            int64_t next = r.next.load(std::memory_order_acquire);
+            if (next == 0) continue;
+            for (int64_t j = next > RING_SPANS ? next - RING_SPANS : 0; j < next; j++) {
+                event& e = r.events[j % RING_SPANS];
+                uint32_t before = e.seq.load(std::memory_order_acquire);
+                if (before & 1) continue;
+                event copy;
+                memcpy(copy.name, e.name, NAME_LEN);
+                copy.name[NAME_LEN - 1] = '\0';
+                copy.pid = e.pid;
+                copy.tid = e.tid;
+                copy.turn = e.turn;
+                copy.conversation = e.conversation;
+                copy.start_us = e.start_us;
+                copy.dur_us = e.dur_us;
+                copy.n = e.n;
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (e.seq.load(std::memory_order_relaxed) != before) continue; // overwritten while we read it
+                int64_t ended = copy.start_us + copy.dur_us;
+                if (ended < since_us || ended >= until_us) continue;
+
+                out += first ? "\n" : ",\n";
+                first = false;
+                out += "{\"name\":";
+                append_json_string(out, copy.name);
+                snprintf(line, sizeof line, ",\"cat\":\"turn\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d,"
+                                            "\"args\":{\"conversation\":%lld,\"turn\":%d,\"n\":%lld}}",
+                         (long long)copy.start_us, (long long)copy.dur_us, copy.pid, copy.tid,
+                         (long long)copy.conversation, copy.turn, (long long)copy.n);
+                out += line;
+            }
+        }
+        out += "\n]}\n";
+        return out;
+    }
+
+    // Writes dir/trace-<pid>-<n>.json every every_s seconds, each with the spans since the last one.
+    // Call it in one process only (the parent, in fork mode).
+    inline void start_dumps(const settings& s)
+    {
+        if (s.every_s <= 0) return;
+        std::thread([s]() {
+            int64_t since = 0;
+            for (int n = 1; ; n++) {
+                std::this_thread::sleep_for(std::chrono::seconds(s.every_s));
+                int64_t upto = now_us();
+                std::string json = chrome_json(since, upto);
+                since = upto;
+                std::string path = s.dir + "/trace-" + std::to_string(getpid()) + "-" + std::to_string(n) + ".json";
+                FILE* f = fopen(path.c_str(), "w");
+                if (!f) { perror(("trace: " + path).c_str()); continue; }
+                fputs(json.c_str(), f);
+                fclose(f);
+            }
+        }).detach();
+    }
+}
+
+#endif
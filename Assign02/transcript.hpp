@@ -0,0 +1,149 @@
+/*
+** transcript.hpp -- recorded conversations, for replaying as load
+**
+** A transcript is who said what, and when. Two forms are read:
+**
+**   timed    one turn a line, the seconds since the conversation started at
+**            which the turn was complete, then the speaker:
+**
+**              0.0 SERVER: Hello! What should we talk about today?
+**              6.4 CLIENT: How about the weather?
+**
+**   console  what ollama_server and ollama_client print: "SPEAKER: text",
+**            carried on over following lines, between dashed rules. There
+**            are no times, so each turn is taken to have lasted its length
+**            at chars_per_s characters a second.
+**
+** Blank lines and lines starting with # are skipped in both. Speakers are
+** numbered in the order they first speak.
+*/
+
+#ifndef TRANSCRIPT_HPP
+#define TRANSCRIPT_HPP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace transcript
+{
+    const double CHARS_PER_S = 40; // about 10 tokens a second, when the transcript has no times
+
+    struct turn {
+        int speaker;
+        double end_s; // since the conversation started
+        std::string text;
+    };
+
+    struct conversation {
+        std::string path;
+        bool timed = false; // end_s were recorded, not estimated
+        std::vector<std::string> speakers;
+        std::vector<turn> turns;
+
+        // How long turn i took the speaker: since the turn before it was complete
+        double duration_s(size_t i) const { return i == 0 ? turns[0].end_s : turns[i].end_s - turns[i - 1].end_s; }
+    };
+
+    // "NAME: text" with a name of letters, digits, _ and -; false otherwise
+    inline bool split_speaker(const std::string& line, std::string& name, std::string& text)
+    {
+        size_t colon = line.find(": ");
+        if (colon == std::string::npos || colon == 0) return false;
+        for (size_t i = 0; i < colon; i++)
+            if (!isalnum((unsigned char)line[i]) && line[i] != '_' && line[i] != '-') return false;
+        name = line.substr(0, colon);
+        text = line.substr(colon + 2);
+        return true;
+    }
+
+    inline int speaker_index(conversation& c, const std::string& name)
+    {
+        for (size_t i = 0; i < c.speakers.size(); i++) if (c.speakers[i] == name) return i;
+        c.speakers.push_back(name);
+        return c.speakers.size() - 1;
+    }
+
+    inline bool rule(const std::string& line)
+    {
+        return line.length() >= 3 && line.find_first_not_of('-') == std::string::npos;
+    }
+
+    // Reads path into c, in whichever form it's in. False (with a message) if it can't.
+    inline bool load(const std::string& path, conversation& c, double chars_per_s = CHARS_PER_S)
+    {
+        std::ifstream in(path);
+        if (!in) { perror(("transcript: " + path).c_str()); return false; }
+        c = conversation();
+        c.path = path;
+
+        std::vector<std::string> lines;
+        for (std::string line; std::getline(in, line); ) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            lines.push_back(line);
+        }
+        // Timed if the first turn starts with a number
+        for (const std::string& line : lines) {
+            if (line.empty() || line[0] == '#' || rule(line)) continue;
+            c.timed = isdigit((unsigned char)line[0]) || line[0] == '.';
+            break;
+        }
+
+        int n = 0;
+        double previous_end = 0;
+        for (const std::string& line : lines) {
+            n++;
+            if (line.empty() || line[0] == '#') continue;
+            std::string name, text;
+            if (c.timed) {
+                char* rest;
+                double end_s = strtod(line.c_str(), &rest);
+                if (rest == line.c_str() || *rest != ' ' || !split_speaker(rest + 1, name, text)) {
+                    fprintf(stderr, "transcript: %s:%d: expected SECONDS SPEAKER: text\n", path.c_str(), n);
+                    return false;
+                }
+                if (end_s < previous_end) {
+                    fprintf(stderr, "transcript: %s:%d: turns out of order\n", path.c_str(), n);
+                    return false;
+                }
+                previous_end = end_s;
+                c.turns.push_back(turn{speaker_index(c, name), end_s, text});
+            }
+            else if (rule(line)) continue;
+            else if (split_speaker(line, name, text)) c.turns.push_back(turn{speaker_index(c, name), 0, text});
+            else if (!c.turns.empty()) c.turns.back().text += "\n" + line; // a turn that ran over several lines
+        }
+        if (c.turns.empty()) {
+            fprintf(stderr, "transcript: %s: no turns\n", path.c_str());
+            return false;
+        }
+        if (!c.timed) {
+            double t = 0;
+            for (turn& each : c.turns) {
+                while (!each.text.empty() && each.text.back() == '\n') each.text.pop_back();
+                t += each.text.length() / chars_per_s;
+                each.end_s = t;
+            }
+        }
+        return true;
+    }
+
+    // Consecutive turns by one speaker as one turn, for protocols where speakers take turns strictly
+    inline void merge_runs(conversation& c)
+    {
+        std::vector<turn> merged;
+        for (const turn& t : c.turns) {
+            if (!merged.empty() && merged.back().speaker == t.speaker) {
+                merged.back().text += "\n" + t.text;
+                merged.back().end_s = t.end_s;
+            }
+            else merged.push_back(t);
+        }
+        c.turns = merged;
+    }
+}
+
+#endif
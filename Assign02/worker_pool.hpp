@@ -0,0 +1,77 @@
+/*
+** worker_pool.hpp -- a fixed set of threads working through a job queue
+**
+** Generations block for seconds on a backend (and on the scheduler before
+** that), so the event-driven server and the talker rooms run them here, off
+** their own threads. The queue depth and the number of busy workers are
+** exported as gauges.
+*/
+
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "metrics.hpp"
+
+namespace relay
+{
+    // Fixed number of threads running generations, first come first served
+    class worker_pool {
+        public:
+            worker_pool(int threads): queued("generation_queue_depth"), busy("generation_workers_busy")
+            {
+                for (int i = 0; i < threads; i++) workers.emplace_back([this]() { run(); });
+            }
+
+            ~worker_pool()
+            {
+                {
+                    std::lock_guard<std::mutex> hold(lock);
+                    stopping = true;
+                }
+                ready.notify_all();
+                for (std::thread& t : workers) t.join();
+            }
+
+            void submit(std::function<void()> job)
+            {
+                std::lock_guard<std::mutex> hold(lock);
+                jobs.push_back(std::move(job));
+                queued.set(jobs.size());
+                ready.notify_one();
+            }
+
+        private:
+            void run()
+            {
+                while (true) {
+                    std::function<void()> job;
+                    {
+                        std::unique_lock<std::mutex> hold(lock);
+                        ready.wait(hold, [this]() { return stopping || !jobs.empty(); });
+                        if (jobs.empty()) return;
+                        job = std::move(jobs.front());
+                        jobs.pop_front();
+                        queued.set(jobs.size());
+                    }
+                    busy.add(1);
+                    job();
+                    busy.add(-1);
+                }
+            }
+
+            std::mutex lock;
+            std::condition_variable ready;
+            std::deque<std::function<void()>> jobs;
+            std::vector<std::thread> workers;
+            bool stopping = false;
+            metrics::gauge queued, busy;
+    };
+}
+
+#endif